@@ -0,0 +1,523 @@
+//
+// admission.hpp
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Limits on the clients the acceptors let in, and on the bytes a second
+// each bridge may read.
+//
+// A new client is checked against the bridges open at once, the bridges
+// open from its address and the rate of new bridges, in that order, and
+// is let in only if it is under all three. It then holds a ticket, which
+// gives its place back when the bridge is destroyed.
+//
+// The checks run on the acceptors' threads and the tickets are given back
+// on the bridges' loops, so the state is shared: the open bridges are an
+// atomic count, the rate is a single atomic time of arrival (the generic
+// cell rate algorithm) and the bridges per address are a hash table split
+// into shards with a lock each, which keeps an address's count in a few
+// cache lines and lets the acceptors check different addresses at once.
+//
+// The byte rate of a bridge is a token bucket for each direction, only
+// used from the bridge's loop. Reads are let deep into the bucket by one
+// read, and the direction then waits until the debt is paid off.
+//
+// The limits may be changed while clients come and go. A ticket notes
+// which counts it was taken into, so that it gives back the same ones; the
+// bridges open before a limit was set aren't held to it. Byte rates are
+// given to each bridge as it is let in.
+//
+
+
+#ifndef INCLUDE_ADMISSION_HPP
+#define INCLUDE_ADMISSION_HPP
+
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "metrics.hpp"
+
+
+namespace tcp_proxy
+{
+   enum { nanoseconds_per_second = 1000000000 };
+
+   // Limits of 0 don't apply.
+   struct admission_limits
+   {
+      admission_limits()
+      : max_bridges(0),
+        max_bridges_per_source(0),
+        connection_rate(0),
+        connection_burst(0),
+        bridge_rate(0),
+        bridge_burst(0)
+      {}
+
+      // Bridges open at once, bridges open from one client address, and new
+      // bridges a second, in bursts of up to connection_burst (0: a second's
+      // worth).
+      std::size_t max_bridges;
+      std::size_t max_bridges_per_source;
+      std::size_t connection_rate;
+      std::size_t connection_burst;
+
+      // Bytes a second each direction of a bridge may read, in bursts of up
+      // to bridge_burst (0: a second's worth).
+      std::size_t bridge_rate;
+      std::size_t bridge_burst;
+   };
+
+   // Bytes a second, in bursts of up to burst bytes, for one loop's thread.
+   class byte_bucket
+   {
+   public:
+
+      // A rate of 0 never waits; a burst of 0 is a second's worth.
+      byte_bucket(std::size_t rate, std::size_t burst)
+      : rate_(rate),
+        burst_(static_cast<boost::int64_t>(burst ? burst : rate)),
+        tokens_(burst_),
+        last_(0)
+      {}
+
+      bool enabled() const
+      {
+         return rate_ != 0;
+      }
+
+      // Takes bytes that have been read, which may leave it in debt.
+      void take(std::size_t bytes, metrics::value_type now)
+      {
+         refill(now);
+         tokens_ -= static_cast<boost::int64_t>(bytes);
+      }
+
+      // Nanoseconds until it is out of debt, 0 if it isn't.
+      metrics::value_type delay(metrics::value_type now)
+      {
+         refill(now);
+
+         if (tokens_ >= 0)
+         {
+            return 0;
+         }
+
+         return static_cast<metrics::value_type>(-tokens_) * nanoseconds_per_second / rate_ + 1;
+      }
+
+   private:
+
+      // Only the time the added tokens stand for is used up, so frequent
+      // refills lose no fractions of a byte.
+      void refill(metrics::value_type now)
+      {
+         if (now <= last_)
+         {
+            return;
+         }
+
+         const metrics::value_type missing = static_cast<metrics::value_type>(burst_ - tokens_);
+         const metrics::value_type elapsed = now - last_;
+
+         if (elapsed >= missing * nanoseconds_per_second / rate_)
+         {
+            tokens_ = burst_;
+            last_ = now;
+            return;
+         }
+
+         const metrics::value_type added = elapsed * rate_ / nanoseconds_per_second;
+         tokens_ += static_cast<boost::int64_t>(added);
+         last_ += added * nanoseconds_per_second / rate_;
+      }
+
+      metrics::value_type rate_;
+      boost::int64_t burst_;
+      boost::int64_t tokens_;
+      metrics::value_type last_;
+   };
+
+   // New bridges a second, in bursts of up to burst. The state is the time
+   // the next bridge would be due at if they came evenly; a bridge is let in
+   // if that is no further ahead of now than the burst allows, and moves it
+   // on by one interval.
+   class connection_rate : private boost::noncopyable
+   {
+   public:
+
+      connection_rate()
+      : interval_(0),
+        tolerance_(0),
+        due_(0)
+      {}
+
+      // A rate of 0 lets everyone in; a burst of 0 is a second's worth.
+      void reset(std::size_t rate, std::size_t burst)
+      {
+         const metrics::value_type interval = rate ? nanoseconds_per_second / rate : 0;
+
+         tolerance_.store(interval * ((burst ? burst : rate) - (rate ? 1 : 0)), boost::memory_order_relaxed);
+         interval_.store(interval, boost::memory_order_relaxed);
+      }
+
+      bool enabled() const
+      {
+         return interval_.load(boost::memory_order_relaxed) != 0;
+      }
+
+      bool admit(metrics::value_type now)
+      {
+         const metrics::value_type interval = interval_.load(boost::memory_order_relaxed);
+         const metrics::value_type tolerance = tolerance_.load(boost::memory_order_relaxed);
+         metrics::value_type due = due_.load(boost::memory_order_relaxed);
+
+         for (;;)
+         {
+            const metrics::value_type start = (due > now) ? due : now;
+
+            if (start - now > tolerance)
+            {
+               return false;
+            }
+
+            if (due_.compare_exchange_weak(due, start + interval, boost::memory_order_relaxed))
+            {
+               return true;
+            }
+         }
+      }
+
+   private:
+
+      boost::atomic<metrics::value_type> interval_;
+      boost::atomic<metrics::value_type> tolerance_;
+      boost::atomic<metrics::value_type> due_;
+   };
+
+   // Bridges open from each IPv4 address. Each shard is an open addressing
+   // table of address and count pairs, eight bytes each; addresses are
+   // removed once their count drops to zero, so the table only holds the
+   // addresses with bridges open.
+   class source_table : private boost::noncopyable
+   {
+   public:
+
+      typedef boost::uint32_t address_type;
+
+      // Counts the address in if it has fewer than limit bridges open.
+      bool acquire(address_type address, std::size_t limit)
+      {
+         const boost::uint32_t h = hash(address);
+         shard& s = shards_[h & (shard_count - 1)];
+         boost::mutex::scoped_lock lock(s.mutex);
+
+         entry& e = s.find(address, h >> shard_bits);
+
+         if (e.count >= limit)
+         {
+            return false;
+         }
+
+         if (e.count++ == 0)
+         {
+            e.address = address;
+            s.added();
+         }
+
+         return true;
+      }
+
+      void release(address_type address)
+      {
+         const boost::uint32_t h = hash(address);
+         shard& s = shards_[h & (shard_count - 1)];
+         boost::mutex::scoped_lock lock(s.mutex);
+
+         entry& e = s.find(address, h >> shard_bits);
+
+         if (e.count != 0 && --e.count == 0)
+         {
+            s.erase(e);
+         }
+      }
+
+   private:
+
+      enum {
+         shard_bits = 6,
+         shard_count = 1 << shard_bits,
+         initial_capacity = 16
+      };
+
+      // An empty slot has a count of 0.
+      struct entry
+      {
+         address_type address;
+         boost::uint32_t count;
+      };
+
+      struct shard
+      {
+         shard()
+         : slots(initial_capacity),
+           size(0)
+         {
+            clear(slots);
+         }
+
+         // The address's slot if it is in the table, otherwise the empty
+         // slot it would go into.
+         entry& find(address_type address, boost::uint32_t h)
+         {
+            const std::size_t mask = slots.size() - 1;
+
+            for (std::size_t i = h & mask; ; i = (i + 1) & mask)
+            {
+               if (slots[i].count == 0 || slots[i].address == address)
+               {
+                  return slots[i];
+               }
+            }
+         }
+
+         // Keeps the table at most half full, so probes stay short.
+         void added()
+         {
+            if (++size * 2 <= slots.size())
+            {
+               return;
+            }
+
+            std::vector<entry> old(slots.size() * 2);
+            clear(old);
+            old.swap(slots);
+
+            for (std::size_t i = 0; i < old.size(); ++i)
+            {
+               if (old[i].count != 0)
+               {
+                  find(old[i].address, hash(old[i].address) >> shard_bits) = old[i];
+               }
+            }
+         }
+
+         // Moves the entries that follow e back into the gap, so that
+         // lookups never need to probe past an empty slot.
+         void erase(entry& e)
+         {
+            const std::size_t mask = slots.size() - 1;
+            std::size_t gap = static_cast<std::size_t>(&e - &slots[0]);
+
+            for (std::size_t i = (gap + 1) & mask; slots[i].count != 0; i = (i + 1) & mask)
+            {
+               const std::size_t home = (hash(slots[i].address) >> shard_bits) & mask;
+
+               // The entry may move to the gap if its home slot isn't
+               // between the gap and where it is now.
+               if (((i - home) & mask) >= ((i - gap) & mask))
+               {
+                  slots[gap] = slots[i];
+                  gap = i;
+               }
+            }
+
+            slots[gap].count = 0;
+            --size;
+         }
+
+         static void clear(std::vector<entry>& v)
+         {
+            for (std::size_t i = 0; i < v.size(); ++i)
+            {
+               v[i].address = 0;
+               v[i].count = 0;
+            }
+         }
+
+         boost::mutex mutex;
+         std::vector<entry> slots;
+         std::size_t size;
+      };
+
+      static boost::uint32_t hash(address_type address)
+      {
+         boost::uint32_t h = address;
+         h ^= h >> 16;
+         h *= 0x85ebca6bu;
+         h ^= h >> 13;
+         h *= 0xc2b2ae35u;
+         h ^= h >> 16;
+         return h;
+      }
+
+      shard shards_[shard_count];
+   };
+
+   class admission : private boost::noncopyable
+   {
+   public:
+
+      enum verdict
+      {
+         admitted,
+         over_max_bridges,
+         over_source_limit,
+         over_rate
+      };
+
+      // A client's place, given back when it is destroyed.
+      class ticket : private boost::noncopyable
+      {
+      public:
+
+         ticket()
+         : admission_(0),
+           source_(0),
+           counted_(false),
+           sourced_(false)
+         {}
+
+         ~ticket()
+         {
+            if (admission_)
+            {
+               admission_->release(*this);
+            }
+         }
+
+      private:
+
+         friend class admission;
+
+         admission* admission_;
+         source_table::address_type source_;
+
+         // Taken into the open bridges, and into its address's bridges.
+         bool counted_;
+         bool sourced_;
+      };
+
+      explicit admission(const admission_limits& limits)
+      : max_bridges_(0),
+        max_bridges_per_source_(0),
+        bridge_rate_(0),
+        bridge_burst_(0),
+        bridges_(0)
+      {
+         set_limits(limits);
+      }
+
+      // From any thread.
+      void set_limits(const admission_limits& limits)
+      {
+         max_bridges_.store(limits.max_bridges, boost::memory_order_relaxed);
+         max_bridges_per_source_.store(limits.max_bridges_per_source, boost::memory_order_relaxed);
+         rate_.reset(limits.connection_rate, limits.connection_burst);
+         bridge_rate_.store(limits.bridge_rate, boost::memory_order_relaxed);
+         bridge_burst_.store(limits.bridge_burst, boost::memory_order_relaxed);
+      }
+
+      // Whether new clients are checked at all.
+      bool enabled() const
+      {
+         return max_bridges_.load(boost::memory_order_relaxed) != 0 ||
+                max_bridges_per_source_.load(boost::memory_order_relaxed) != 0 ||
+                rate_.enabled();
+      }
+
+      std::size_t bridge_rate() const
+      {
+         return bridge_rate_.load(boost::memory_order_relaxed);
+      }
+
+      std::size_t bridge_burst() const
+      {
+         return bridge_burst_.load(boost::memory_order_relaxed);
+      }
+
+      // Checks a client from source, which holds t if it is let in. The
+      // counts taken for it are given back if a later check turns it away.
+      verdict admit(source_table::address_type source, ticket& t)
+      {
+         const std::size_t max_bridges = max_bridges_.load(boost::memory_order_relaxed);
+         const std::size_t max_bridges_per_source = max_bridges_per_source_.load(boost::memory_order_relaxed);
+
+         t.admission_ = this;
+         t.source_ = source;
+
+         if (max_bridges != 0)
+         {
+            t.counted_ = true;
+
+            if (bridges_.fetch_add(1, boost::memory_order_relaxed) >= max_bridges)
+            {
+               return reject(t, over_max_bridges);
+            }
+         }
+
+         if (max_bridges_per_source != 0)
+         {
+            if (!sources_.acquire(source, max_bridges_per_source))
+            {
+               return reject(t, over_source_limit);
+            }
+
+            t.sourced_ = true;
+         }
+
+         if (rate_.enabled() && !rate_.admit(metrics::now()))
+         {
+            return reject(t, over_rate);
+         }
+
+         return admitted;
+      }
+
+   private:
+
+      verdict reject(ticket& t, verdict v)
+      {
+         release(t);
+         t.admission_ = 0;
+         return v;
+      }
+
+      void release(ticket& t)
+      {
+         if (t.sourced_)
+         {
+            sources_.release(t.source_);
+            t.sourced_ = false;
+         }
+
+         if (t.counted_)
+         {
+            bridges_.fetch_sub(1, boost::memory_order_relaxed);
+            t.counted_ = false;
+         }
+      }
+
+      boost::atomic<std::size_t> max_bridges_;
+      boost::atomic<std::size_t> max_bridges_per_source_;
+      connection_rate rate_;
+      boost::atomic<std::size_t> bridge_rate_;
+      boost::atomic<std::size_t> bridge_burst_;
+
+      // Only kept while a limit on them is set.
+      boost::atomic<std::size_t> bridges_;
+      source_table sources_;
+   };
+}
+
+#endif
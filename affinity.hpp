@@ -0,0 +1,154 @@
+//
+// affinity.hpp
+// ~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Placing the I/O loops on CPUs: parsing CPU lists, finding the CPUs of
+// the NUMA node a network interface is attached to, pinning a thread to a
+// CPU, and steering a listening socket's connections to the CPU whose
+// receive queue they arrive on.
+//
+// Memory is placed by the kernel's default first-touch policy: the pages
+// a pinned thread touches first come from its own node. The loops do
+// their own allocating, and each loop's state is built on its CPU.
+//
+// Linux only; elsewhere TCP_PROXY_AFFINITY is left undefined.
+//
+
+
+#ifndef INCLUDE_AFFINITY_HPP
+#define INCLUDE_AFFINITY_HPP
+
+
+#if defined(__linux__) && !defined(TCP_PROXY_NO_AFFINITY)
+
+#define TCP_PROXY_AFFINITY
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+
+namespace tcp_proxy
+{
+   namespace affinity
+   {
+      // Parses a list such as "0-3,8,10-11", as sysfs and taskset write
+      // them, appending the CPUs in the order given.
+      inline bool parse_cpu_list(const std::string& text, std::vector<int>& cpus)
+      {
+         std::size_t begin = 0;
+
+         while (begin < text.size())
+         {
+            std::size_t end = text.find(',', begin);
+
+            if (end == std::string::npos)
+            {
+               end = text.size();
+            }
+
+            const std::string range = text.substr(begin, end - begin);
+            const std::size_t dash = range.find('-');
+            char* rest = 0;
+
+            const long first = std::strtol(range.c_str(), &rest, 10);
+            long last = first;
+
+            if (range.empty() || rest == range.c_str() || first < 0)
+            {
+               return false;
+            }
+
+            if (dash != std::string::npos)
+            {
+               const char* const from = range.c_str() + dash + 1;
+               last = std::strtol(from, &rest, 10);
+
+               if (rest == from || last < first)
+               {
+                  return false;
+               }
+            }
+
+            if (*rest != '\0' || last >= CPU_SETSIZE)
+            {
+               return false;
+            }
+
+            for (long cpu = first; cpu <= last; ++cpu)
+            {
+               cpus.push_back(static_cast<int>(cpu));
+            }
+
+            begin = end + 1;
+         }
+
+         return !cpus.empty();
+      }
+
+      inline bool read_line(const std::string& path, std::string& line)
+      {
+         std::ifstream in(path.c_str());
+         return std::getline(in, line) && !line.empty();
+      }
+
+      // The CPUs of the NUMA node the interface's device is attached to,
+      // or every online CPU for an interface with no node, such as a
+      // virtual one on a single node machine.
+      inline bool interface_cpus(const std::string& name, std::vector<int>& cpus)
+      {
+         std::string line;
+
+         if (name.empty() || name.find('/') != std::string::npos ||
+             !read_line("/sys/class/net/" + name + "/ifindex", line))
+         {
+            return false;
+         }
+
+         if (read_line("/sys/class/net/" + name + "/device/numa_node", line) && line != "-1" &&
+             read_line("/sys/devices/system/node/node" + line + "/cpulist", line))
+         {
+            return parse_cpu_list(line, cpus);
+         }
+
+         return read_line("/sys/devices/system/cpu/online", line) && parse_cpu_list(line, cpus);
+      }
+
+      // Pins the calling thread.
+      inline bool pin_thread(int cpu)
+      {
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         CPU_SET(cpu, &set);
+
+         return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+      }
+
+      // With SO_REUSEPORT, recent kernels give a connection to the
+      // listener set to the CPU its packets are received on, if there is
+      // one; older ones hash it to any of them as before.
+      inline bool set_incoming_cpu(int fd, int cpu)
+      {
+      #ifdef SO_INCOMING_CPU
+         return ::setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == 0;
+      #else
+         return false;
+      #endif
+      }
+   }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,348 @@
+//
+// backends.hpp
+// ~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// The remote servers bridges are forwarded to, and the choice of server for
+// each new bridge. Servers can be picked in turn, by fewest active bridges,
+// or by an exponentially weighted moving average of their connect and
+// first-byte latency scaled by their active bridges.
+//
+// A server whose connects fail eject_after times in a row is passed over
+// for eject_time seconds. If every server is ejected they are all tried
+// anyway, rather than failing every client.
+//
+// Shared by all I/O loops, so all state is atomic. The average is updated
+// with a plain load and store, so concurrent samples may overwrite each
+// other; it is an estimate either way.
+//
+// Servers may be added and retired while bridges are being forwarded, when
+// the configuration is reloaded. The servers are kept in a fixed table that
+// a new one is appended to before the count is raised, so the loops choose
+// from it without a lock. A retired server keeps its place, and its open
+// bridges, but isn't picked any more; it is picked again if it comes back.
+// Once its last bridge has finished, a new server may be put in its place,
+// so that servers that come and go, as those behind a name do, don't fill
+// the table. The server replaced is kept for the loops that may still hold
+// it.
+//
+
+
+#ifndef INCLUDE_BACKENDS_HPP
+#define INCLUDE_BACKENDS_HPP
+
+
+#include <cstddef>
+#include <iostream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "metrics.hpp"
+
+
+namespace tcp_proxy
+{
+   enum backend_policy
+   {
+      backend_round_robin,
+      backend_least_active,
+      backend_ewma
+   };
+
+   class backend : private boost::noncopyable
+   {
+   public:
+
+      backend(std::size_t index, const boost::asio::ip::tcp::endpoint& endpoint)
+      : active(0),
+        index_(index),
+        endpoint_(endpoint),
+        latency_(0),
+        failures_(0),
+        ejected_until_(0),
+        retired_(false)
+      {}
+
+      std::size_t index() const
+      {
+         return index_;
+      }
+
+      const boost::asio::ip::tcp::endpoint& endpoint() const
+      {
+         return endpoint_;
+      }
+
+      // Average latency in nanoseconds, 0 until the first sample.
+      metrics::value_type latency() const
+      {
+         return latency_.load(boost::memory_order_relaxed);
+      }
+
+      void observe_latency(metrics::value_type nanoseconds)
+      {
+         const metrics::value_type old = latency();
+         const metrics::value_type updated =
+            (old == 0) ? nanoseconds : old - old / weight + nanoseconds / weight;
+
+         latency_.store(updated == 0 ? 1 : updated, boost::memory_order_relaxed);
+      }
+
+      bool ejected(metrics::value_type now) const
+      {
+         return now < ejected_until_.load(boost::memory_order_relaxed);
+      }
+
+      // Taken out of the set by a reload.
+      bool retired() const
+      {
+         return retired_.load(boost::memory_order_relaxed);
+      }
+
+      void set_retired(bool retired)
+      {
+         retired_.store(retired, boost::memory_order_relaxed);
+      }
+
+      void connect_succeeded()
+      {
+         failures_.store(0, boost::memory_order_relaxed);
+      }
+
+      // Returns true if this failure ejected the server.
+      bool connect_failed(std::size_t eject_after, metrics::value_type eject_time)
+      {
+         if (eject_after == 0 || (failures_.fetch_add(1, boost::memory_order_relaxed) + 1) < eject_after)
+         {
+            return false;
+         }
+
+         failures_.store(0, boost::memory_order_relaxed);
+         ejected_until_.store(metrics::now() + eject_time, boost::memory_order_relaxed);
+         return true;
+      }
+
+      // Bridges currently forwarded to this server.
+      boost::atomic<std::size_t> active;
+
+   private:
+
+      // Each sample moves the average 1/weight of the way.
+      enum { weight = 8 };
+
+      std::size_t index_;
+      boost::asio::ip::tcp::endpoint endpoint_;
+      boost::atomic<metrics::value_type> latency_;
+      boost::atomic<std::size_t> failures_;
+      boost::atomic<metrics::value_type> ejected_until_;
+      boost::atomic<bool> retired_;
+   };
+
+   class backend_set : private boost::noncopyable
+   {
+   public:
+
+      enum { max_backends = 256 };
+
+      backend_set(backend_policy policy, std::size_t eject_after, std::size_t eject_time)
+      : policy_(policy),
+        eject_after_(eject_after),
+        eject_time_(static_cast<metrics::value_type>(eject_time) * 1000000000u),
+        size_(0),
+        next_(0)
+      {}
+
+      // From one thread at a time; the loops may be choosing meanwhile.
+      // Takes the place of a retired server without bridges if there is
+      // one.
+      backend& add(const boost::asio::ip::tcp::endpoint& endpoint)
+      {
+         const std::size_t count = size();
+         std::size_t index = count;
+
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            const backend* b = slot(i);
+
+            if (b->retired() && b->active.load(boost::memory_order_relaxed) == 0)
+            {
+               index = i;
+               break;
+            }
+         }
+
+         if (index == max_backends)
+         {
+            throw std::runtime_error("too many remote servers");
+         }
+
+         owned_.push_back(boost::shared_ptr<backend>(new backend(index, endpoint)));
+         backends_[index].store(owned_.back().get(), boost::memory_order_release);
+
+         if (index == count)
+         {
+            size_.store(count + 1, boost::memory_order_release);
+         }
+
+         return *owned_.back();
+      }
+
+      // Retired servers included.
+      std::size_t size() const
+      {
+         return size_.load(boost::memory_order_acquire);
+      }
+
+      backend* find(const boost::asio::ip::tcp::endpoint& endpoint)
+      {
+         for (std::size_t i = 0; i < size(); ++i)
+         {
+            if (slot(i)->endpoint() == endpoint)
+            {
+               return slot(i);
+            }
+         }
+
+         return 0;
+      }
+
+      backend& get(std::size_t i)
+      {
+         return *slot(i);
+      }
+
+      // Server for a new bridge, other than exclude if there is a choice.
+      backend& choose(const backend* exclude = 0)
+      {
+         const metrics::value_type now = metrics::now();
+         const std::size_t start = next_.fetch_add(1, boost::memory_order_relaxed);
+
+         backend* best = select(start, now, exclude, true);
+
+         if (best == 0)
+         {
+            best = select(start, now, exclude, false);
+         }
+
+         return best ? *best : *slot(start % size());
+      }
+
+      void connect_succeeded(backend& b, metrics::value_type connect_time)
+      {
+         b.observe_latency(connect_time);
+         b.connect_succeeded();
+      }
+
+      void connect_failed(backend& b)
+      {
+         if (b.connect_failed(eject_after_, eject_time_))
+         {
+            std::cerr << "backend " << b.endpoint() << " ejected\n";
+         }
+      }
+
+      void write_metrics(std::ostream& out) const
+      {
+         const metrics::value_type now = metrics::now();
+         const std::size_t count = size();
+
+         out << "# HELP tcpproxy_backend_active_bridges Bridges forwarded to each remote server.\n"
+             << "# TYPE tcpproxy_backend_active_bridges gauge\n";
+
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            out << "tcpproxy_backend_active_bridges{backend=\"" << slot(i)->endpoint() << "\"} "
+                << slot(i)->active << '\n';
+         }
+
+         out << "# HELP tcpproxy_backend_latency_seconds Average connect and first-byte latency of each remote server.\n"
+             << "# TYPE tcpproxy_backend_latency_seconds gauge\n";
+
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            out << "tcpproxy_backend_latency_seconds{backend=\"" << slot(i)->endpoint() << "\"} ";
+            metrics::details::write_seconds(out, slot(i)->latency());
+            out << '\n';
+         }
+
+         out << "# HELP tcpproxy_backend_ejected Whether each remote server is currently ejected.\n"
+             << "# TYPE tcpproxy_backend_ejected gauge\n";
+
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            out << "tcpproxy_backend_ejected{backend=\"" << slot(i)->endpoint() << "\"} "
+                << (slot(i)->ejected(now) ? 1 : 0) << '\n';
+         }
+      }
+
+   private:
+
+      // Scans from start so that ties go round the servers.
+      backend* select(std::size_t start,
+                      metrics::value_type now,
+                      const backend* exclude,
+                      bool healthy_only)
+      {
+         const std::size_t count = size();
+         backend* best = 0;
+         metrics::value_type best_cost = 0;
+
+         for (std::size_t n = 0; n < count; ++n)
+         {
+            backend* b = slot((start + n) % count);
+
+            if (b == exclude || b->retired() || (healthy_only && b->ejected(now)))
+            {
+               continue;
+            }
+
+            if (policy_ == backend_round_robin)
+            {
+               return b;
+            }
+
+            const metrics::value_type active = b->active.load(boost::memory_order_relaxed);
+
+            // A server without a latency sample yet costs nothing, so that
+            // it gets one.
+            const metrics::value_type cost =
+               (policy_ == backend_least_active) ? active : b->latency() * (active + 1);
+
+            if (best == 0 || cost < best_cost)
+            {
+               best = b;
+               best_cost = cost;
+            }
+         }
+
+         return best;
+      }
+
+      backend_policy policy_;
+      std::size_t eject_after_;
+      metrics::value_type eject_time_;
+      backend* slot(std::size_t i) const
+      {
+         return backends_[i].load(boost::memory_order_acquire);
+      }
+
+      // The servers in the table, and every server ever made, those whose
+      // place was taken included; only changed by the thread adding.
+      boost::atomic<backend*> backends_[max_backends];
+      std::vector<boost::shared_ptr<backend> > owned_;
+      boost::atomic<std::size_t> size_;
+      boost::atomic<std::size_t> next_;
+   };
+}
+
+#endif
@@ -0,0 +1,159 @@
+//
+// framing_bench.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Throughput of the receive ring's frame parser. A stream of newline
+// terminated Base64 frames, or of length prefixed binary frames, is fed
+// through the ring in socket-read sized pieces, and every frame is found and
+// consumed as the bridge would, without decoding it.
+//
+// usage: framing_bench [milliseconds per case]
+//
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../buffer_pool.hpp"
+#include "../frame_ring.hpp"
+#include "../metrics.hpp"
+
+
+namespace
+{
+   // Frames of frame_length characters plus terminator, or of frame_length
+   // bytes after their length prefix, back to back.
+   std::vector<unsigned char> make_stream(std::size_t frame_length, std::size_t total, bool prefixed)
+   {
+      const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+      std::vector<unsigned char> stream;
+      stream.reserve(total + frame_length + 8);
+
+      while (stream.size() < total)
+      {
+         if (prefixed)
+         {
+            unsigned char prefix[8];
+            const std::size_t n = tcp_proxy::frame_ring::write_prefix(prefix, frame_length);
+            stream.insert(stream.end(), prefix, prefix + n);
+         }
+
+         for (std::size_t i = 0; i < frame_length; ++i)
+         {
+            stream.push_back(prefixed ? std::rand() & 0xff : alphabet[std::rand() % 64]);
+         }
+
+         if (!prefixed)
+         {
+            stream.push_back('\n');
+         }
+      }
+
+      return stream;
+   }
+
+   // Copies the stream into the ring read_size bytes at a time and drains
+   // the frames after every read. Returns the number of frames seen.
+   std::size_t parse(tcp_proxy::frame_ring& ring,
+                     const std::vector<unsigned char>& stream,
+                     std::size_t read_size,
+                     bool prefixed)
+   {
+      std::size_t frames = 0;
+      std::size_t offset = 0;
+      tcp_proxy::frame_ring::frame frame;
+      std::size_t length;
+
+      while (offset < stream.size())
+      {
+         const tcp_proxy::frame_ring::buffers_type buffers = ring.prepare();
+         std::size_t room = std::min(read_size, stream.size() - offset);
+         std::size_t copied = 0;
+
+         for (std::size_t i = 0; i < buffers.size() && room > 0; ++i)
+         {
+            const std::size_t n = std::min(room, boost::asio::buffer_size(buffers[i]));
+            std::memcpy(boost::asio::buffer_cast<unsigned char*>(buffers[i]), &stream[offset + copied], n);
+            copied += n;
+            room -= n;
+         }
+
+         ring.commit(copied);
+         offset += copied;
+
+         while (prefixed ? ring.next_prefixed_frame(frame, length) : ring.next_frame(frame))
+         {
+            ++frames;
+            ring.consume(frame);
+         }
+
+         if (copied == 0 && !ring.grow())
+         {
+            std::fprintf(stderr, "frame does not fit the ring\n");
+            std::exit(1);
+         }
+      }
+
+      ring.release_if_empty();
+      return frames;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   const metrics::value_type budget =
+      static_cast<metrics::value_type>(argc > 1 ? std::atoi(argv[1]) : 200) * 1000000u;
+
+   const std::size_t frame_lengths[] = { 64, 1024, 10924, 65536 };
+   const std::size_t read_sizes[] = { 1500, 16384, 65536 };
+
+   tcp_proxy::buffer_pool pool(64 * 1024 * 1024);
+
+   std::printf("%8s %8s %8s %14s %14s\n", "framing", "frame", "read", "throughput", "frames");
+
+   for (std::size_t c = 0; c < 2 * sizeof(frame_lengths) / sizeof(frame_lengths[0]); ++c)
+   {
+      const bool prefixed = c >= sizeof(frame_lengths) / sizeof(frame_lengths[0]);
+      const std::size_t frame_length = frame_lengths[c % (sizeof(frame_lengths) / sizeof(frame_lengths[0]))];
+      const std::vector<unsigned char> stream = make_stream(frame_length, 8 * 1024 * 1024, prefixed);
+
+      for (std::size_t r = 0; r < sizeof(read_sizes) / sizeof(read_sizes[0]); ++r)
+      {
+         // Sized as the bridge sizes it for chunks of this frame length.
+         tcp_proxy::frame_ring ring(pool, 2 * (frame_length + 1), 2 * (frame_length + 1), '\n');
+
+         std::size_t frames = 0;
+         std::size_t bytes = 0;
+         const metrics::value_type start = metrics::now();
+         metrics::value_type elapsed = 0;
+
+         do
+         {
+            frames += parse(ring, stream, read_sizes[r], prefixed);
+            bytes += stream.size();
+            elapsed = metrics::now() - start;
+         }
+         while (elapsed < budget);
+
+         const double seconds = elapsed / 1e9;
+
+         std::printf("%8s %8lu %8lu %9.1f MB/s %9.2f M/s\n",
+                     prefixed ? "binary" : "base64",
+                     static_cast<unsigned long>(frame_length),
+                     static_cast<unsigned long>(read_sizes[r]),
+                     bytes / seconds / 1e6,
+                     frames / seconds / 1e6);
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,269 @@
+//
+// handler_bench.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Cost of re-arming an operation with a boost::bind handler holding a
+// shared_ptr, against an owned_handler allocated from the object's own
+// handler_memory (see handler_memory.hpp), which is what the bridges use.
+// Each runs two chains on one thread:
+//
+//    post    a handler that posts itself again
+//    socket  a small async_write to one end of a loopback connection, then
+//            a wait for the other end to be readable and a read_some
+//
+// and reports operations a second and heap allocations per operation.
+//
+// usage: handler_bench [milliseconds per case]
+//
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "../handler_memory.hpp"
+#include "../metrics.hpp"
+
+
+namespace
+{
+   boost::atomic<metrics::value_type> allocations(0);
+}
+
+// Every allocation is counted. GCC takes the malloc() inside for the one
+// the free() below is paired with wherever both are inlined.
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+   allocations.fetch_add(1, boost::memory_order_relaxed);
+   void* p = std::malloc(size ? size : 1);
+
+   if (!p)
+   {
+      throw std::bad_alloc();
+   }
+
+   return p;
+}
+
+void operator delete(void* p) throw()
+{
+   std::free(p);
+}
+
+namespace
+{
+   namespace ip = boost::asio::ip;
+
+   enum { message_size = 64 };
+
+   class chain : public boost::enable_shared_from_this<chain>,
+                 public tcp_proxy::handler_owner<chain>
+   {
+   public:
+
+      typedef boost::shared_ptr<chain> ptr_type;
+
+      chain(boost::asio::io_service& io_service, bool owned)
+      : io_service_(io_service),
+        writer_(io_service),
+        reader_(io_service),
+        owned_(owned),
+        deadline_(0),
+        operations_(0)
+      {
+         ip::tcp::acceptor acceptor(io_service, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+         writer_.connect(acceptor.local_endpoint());
+         acceptor.accept(reader_);
+         writer_.set_option(ip::tcp::no_delay(true));
+         reader_.non_blocking(true);
+      }
+
+      metrics::value_type operations() const
+      {
+         return operations_;
+      }
+
+      void start(bool socket, metrics::value_type deadline)
+      {
+         deadline_ = deadline;
+
+         if (socket)
+         {
+            start_writes();
+         }
+         else
+         {
+            start_posts();
+         }
+      }
+
+   private:
+
+      typedef tcp_proxy::handler_memory<192> read_memory;
+      typedef tcp_proxy::handler_memory<576> write_memory;
+
+      void start_posts()
+      {
+         if (owned_)
+         {
+            io_service_.post(handler(&chain::handle_post, read_memory_));
+         }
+         else
+         {
+            io_service_.post(boost::bind(&chain::handle_post, shared_from_this(), boost::system::error_code()));
+         }
+      }
+
+      void start_writes()
+      {
+         if (owned_)
+         {
+            boost::asio::async_write(writer_, boost::asio::buffer(message_, message_size),
+                 handler(&chain::handle_write, write_memory_));
+         }
+         else
+         {
+            boost::asio::async_write(writer_, boost::asio::buffer(message_, message_size),
+                 boost::bind(&chain::handle_write,
+                      shared_from_this(),
+                      boost::asio::placeholders::error,
+                      boost::asio::placeholders::bytes_transferred));
+         }
+      }
+
+      template <typename Function, typename Memory>
+      tcp_proxy::owned_handler<chain, Function, Memory> handler(Function function, Memory& memory)
+      {
+         return tcp_proxy::owned_handler<chain, Function, Memory>(*this, function, memory);
+      }
+
+      bool more()
+      {
+         ++operations_;
+         return (operations_ & 1023) != 0 || metrics::now() < deadline_;
+      }
+
+      void handle_post(const boost::system::error_code&)
+      {
+         if (more())
+         {
+            start_posts();
+         }
+      }
+
+      void handle_write(const boost::system::error_code& error, const std::size_t&)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         ++operations_;
+
+         if (owned_)
+         {
+            reader_.async_wait(ip::tcp::socket::wait_read, handler(&chain::handle_readable, read_memory_));
+         }
+         else
+         {
+            reader_.async_wait(ip::tcp::socket::wait_read,
+                 boost::bind(&chain::handle_readable,
+                      shared_from_this(),
+                      boost::asio::placeholders::error));
+         }
+      }
+
+      void handle_readable(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         boost::system::error_code ec;
+         std::size_t received = 0;
+
+         while (received < message_size)
+         {
+            received += reader_.read_some(boost::asio::buffer(incoming_ + received, message_size - received), ec);
+
+            if (ec && ec != boost::asio::error::would_block)
+            {
+               return;
+            }
+         }
+
+         if (more())
+         {
+            start_writes();
+         }
+      }
+
+      boost::asio::io_service& io_service_;
+      ip::tcp::socket writer_;
+      ip::tcp::socket reader_;
+      bool owned_;
+      metrics::value_type deadline_;
+      metrics::value_type operations_;
+      char message_[message_size];
+      char incoming_[message_size];
+      read_memory read_memory_;
+      write_memory write_memory_;
+   };
+}
+
+int main(int argc, char* argv[])
+{
+   const metrics::value_type budget =
+      static_cast<metrics::value_type>(argc > 1 ? std::atoi(argv[1]) : 500) * 1000000u;
+
+   std::printf("%8s %8s %14s %14s\n", "handler", "chain", "operations", "allocations");
+
+   for (std::size_t c = 0; c < 4; ++c)
+   {
+      const bool owned = (c % 2) == 1;
+      const bool socket = c >= 2;
+
+      // A short warm up, then the timed run.
+      for (std::size_t run = 0; run < 2; ++run)
+      {
+         boost::asio::io_service io_service;
+         const chain::ptr_type bench(new chain(io_service, owned));
+
+         const metrics::value_type allocated = allocations.load();
+         const metrics::value_type start = metrics::now();
+
+         bench->start(socket, start + (run ? budget : budget / 10));
+         io_service.run();
+
+         if (run)
+         {
+            const double seconds = (metrics::now() - start) / 1e9;
+            const double operations = static_cast<double>(bench->operations());
+
+            std::printf("%8s %8s %11.2f M/s %14.3f\n",
+                        owned ? "owned" : "bind",
+                        socket ? "socket" : "post",
+                        operations / seconds / 1e6,
+                        (allocations.load() - allocated) / operations);
+         }
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,455 @@
+//
+// loopback_bench.cpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// End-to-end benchmark over loopback. An encode proxy is chained into a
+// decode proxy in front of an echo server, all on 127.0.0.1:
+//
+//    client --> encode proxy --> decode proxy --> echo server
+//
+// and the following are measured:
+//
+//    latency     round trips of a small message on one connection, first
+//                straight to the echo server and then through the chain;
+//                the difference is the latency the proxies add
+//    throughput  N connections streaming data through the chain and back
+//    connections connections per second opened, used for one round trip
+//                and closed again, from N client threads
+//
+// usage: loopback_bench <tcpproxy_server binary> [options] [-- proxy options]
+//    --connections=<n>   concurrent connections (default: 16)
+//    --megabytes=<n>     data sent per connection for throughput (default: 16)
+//    --round_trips=<n>   round trips for latency (default: 5000)
+//    --message=<bytes>   size of the latency message (default: 512)
+//    --connects=<n>      connections for the connection rate (default: 5000)
+//
+// Everything after "--" is passed to both proxies.
+//
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "../metrics.hpp"
+
+
+namespace
+{
+   namespace ip = boost::asio::ip;
+
+   typedef boost::shared_ptr<ip::tcp::socket> socket_ptr;
+
+   struct options
+   {
+      options()
+      : connections(16),
+        megabytes(16),
+        round_trips(5000),
+        message(512),
+        connects(5000)
+      {}
+
+      std::size_t connections;
+      std::size_t megabytes;
+      std::size_t round_trips;
+      std::size_t message;
+      std::size_t connects;
+      std::vector<std::string> proxy_options;
+   };
+
+   void echo_connection(socket_ptr socket)
+   {
+      std::vector<char> buffer(65536);
+      boost::system::error_code ec;
+
+      for ( ; ; )
+      {
+         const std::size_t n = socket->read_some(boost::asio::buffer(buffer), ec);
+
+         if (ec || boost::asio::write(*socket, boost::asio::buffer(&buffer[0], n), ec) != n)
+         {
+            break;
+         }
+      }
+   }
+
+   // Accepts until stopping is set, echoing on a thread per connection.
+   // The connection that wakes it up to stop is dropped.
+   void echo_server(ip::tcp::acceptor& acceptor,
+                    boost::thread_group& threads,
+                    const boost::atomic<bool>& stopping)
+   {
+      for ( ; ; )
+      {
+         socket_ptr socket(new ip::tcp::socket(acceptor.get_executor()));
+         boost::system::error_code ec;
+         acceptor.accept(*socket, ec);
+
+         if (ec || stopping)
+         {
+            break;
+         }
+
+         socket->set_option(ip::tcp::no_delay(true));
+         threads.create_thread(boost::bind(&echo_connection, socket));
+      }
+   }
+
+   unsigned short free_port(boost::asio::io_service& ios)
+   {
+      ip::tcp::acceptor acceptor(ios, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+      return acceptor.local_endpoint().port();
+   }
+
+   std::string to_string(std::size_t n)
+   {
+      char buffer[32];
+      std::sprintf(buffer, "%lu", static_cast<unsigned long>(n));
+      return buffer;
+   }
+
+   pid_t spawn_proxy(const std::string& binary,
+                     unsigned short local_port,
+                     unsigned short forward_port,
+                     const char* direction,
+                     const std::vector<std::string>& proxy_options)
+   {
+      std::vector<std::string> args;
+      args.push_back(binary);
+      args.push_back("127.0.0.1");
+      args.push_back(to_string(local_port));
+      args.push_back("127.0.0.1");
+      args.push_back(to_string(forward_port));
+      args.push_back(direction);
+      args.insert(args.end(), proxy_options.begin(), proxy_options.end());
+
+      std::vector<char*> argv;
+
+      for (std::size_t i = 0; i < args.size(); ++i)
+      {
+         argv.push_back(const_cast<char*>(args[i].c_str()));
+      }
+
+      argv.push_back(0);
+
+      const pid_t pid = fork();
+
+      if (pid == 0)
+      {
+         execv(binary.c_str(), &argv[0]);
+         std::perror("execv");
+         _exit(127);
+      }
+
+      return pid;
+   }
+
+   socket_ptr connect(boost::asio::io_service& ios, unsigned short port)
+   {
+      socket_ptr socket(new ip::tcp::socket(ios));
+      socket->connect(ip::tcp::endpoint(ip::address_v4::loopback(), port));
+      socket->set_option(ip::tcp::no_delay(true));
+      return socket;
+   }
+
+   // Waits for the chain to pass a round trip, as the proxies start up.
+   bool wait_ready(boost::asio::io_service& ios, unsigned short port)
+   {
+      for (std::size_t attempt = 0; attempt < 100; ++attempt)
+      {
+         try
+         {
+            socket_ptr socket = connect(ios, port);
+            char c = 'x';
+            boost::asio::write(*socket, boost::asio::buffer(&c, 1));
+            boost::asio::read(*socket, boost::asio::buffer(&c, 1));
+            return true;
+         }
+         catch (std::exception&)
+         {
+            usleep(20000);
+         }
+      }
+
+      return false;
+   }
+
+   // Round trip times in nanoseconds, sorted.
+   std::vector<metrics::value_type> measure_latency(boost::asio::io_service& ios,
+                                                    unsigned short port,
+                                                    const options& opt)
+   {
+      socket_ptr socket = connect(ios, port);
+      std::vector<char> message(opt.message, 'm');
+      std::vector<metrics::value_type> samples;
+      samples.reserve(opt.round_trips);
+
+      for (std::size_t i = 0; i < opt.round_trips; ++i)
+      {
+         const metrics::value_type start = metrics::now();
+         boost::asio::write(*socket, boost::asio::buffer(message));
+         boost::asio::read(*socket, boost::asio::buffer(message));
+         samples.push_back(metrics::now() - start);
+      }
+
+      std::sort(samples.begin(), samples.end());
+      return samples;
+   }
+
+   double percentile(const std::vector<metrics::value_type>& sorted, double p)
+   {
+      const std::size_t i = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+      return sorted[i] / 1000.0;
+   }
+
+   // Stops early if the connection fails; the reader reports it.
+   void send_all(socket_ptr socket, std::size_t bytes)
+   {
+      std::vector<char> buffer(65536, 's');
+      boost::system::error_code ec;
+
+      while (bytes > 0 && !ec)
+      {
+         const std::size_t n = std::min(bytes, buffer.size());
+         boost::asio::write(*socket, boost::asio::buffer(&buffer[0], n), ec);
+         bytes -= n;
+      }
+   }
+
+   void stream_connection(boost::asio::io_service& ios,
+                          unsigned short port,
+                          std::size_t bytes,
+                          boost::mutex& lock,
+                          std::size_t& failures)
+   {
+      try
+      {
+         socket_ptr socket = connect(ios, port);
+         boost::thread writer(boost::bind(&send_all, socket, bytes));
+
+         std::vector<char> buffer(65536);
+         std::size_t received = 0;
+
+         while (received < bytes)
+         {
+            received += socket->read_some(boost::asio::buffer(buffer));
+         }
+
+         writer.join();
+      }
+      catch (std::exception& e)
+      {
+         boost::mutex::scoped_lock guard(lock);
+         std::fprintf(stderr, "stream connection failed: %s\n", e.what());
+         ++failures;
+      }
+   }
+
+   void connect_loop(boost::asio::io_service& ios,
+                     unsigned short port,
+                     std::size_t count,
+                     boost::mutex& lock,
+                     std::size_t& failures)
+   {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+         try
+         {
+            socket_ptr socket = connect(ios, port);
+            char c = 'c';
+            boost::asio::write(*socket, boost::asio::buffer(&c, 1));
+            boost::asio::read(*socket, boost::asio::buffer(&c, 1));
+         }
+         catch (std::exception&)
+         {
+            boost::mutex::scoped_lock guard(lock);
+            ++failures;
+         }
+      }
+   }
+
+   bool parse_option(const std::string& arg, options& opt)
+   {
+      const std::string::size_type eq = arg.find('=');
+
+      if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+      {
+         return false;
+      }
+
+      const std::string name = arg.substr(2, eq - 2);
+      const std::size_t value = static_cast<std::size_t>(std::strtoul(arg.c_str() + eq + 1, 0, 10));
+
+      if (value == 0)
+      {
+         return false;
+      }
+
+      if      (name == "connections") opt.connections = value;
+      else if (name == "megabytes"  ) opt.megabytes   = value;
+      else if (name == "round_trips") opt.round_trips = value;
+      else if (name == "message"    ) opt.message     = value;
+      else if (name == "connects"   ) opt.connects    = value;
+      else return false;
+
+      return true;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      std::fprintf(stderr, "usage: loopback_bench <tcpproxy_server binary> [options] [-- proxy options]\n");
+      return 1;
+   }
+
+   const std::string binary = argv[1];
+   options opt;
+
+   for (int i = 2; i < argc; ++i)
+   {
+      if (std::strcmp(argv[i], "--") == 0)
+      {
+         opt.proxy_options.assign(argv + i + 1, argv + argc);
+         break;
+      }
+      else if (!parse_option(argv[i], opt))
+      {
+         std::fprintf(stderr, "invalid option: %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   boost::asio::io_service ios;
+   boost::thread_group echo_threads;
+
+   ip::tcp::acceptor echo_acceptor(ios, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+   const unsigned short echo_port = echo_acceptor.local_endpoint().port();
+   boost::atomic<bool> stopping(false);
+   boost::thread echo(boost::bind(&echo_server, boost::ref(echo_acceptor),
+                                  boost::ref(echo_threads), boost::cref(stopping)));
+
+   const unsigned short decode_port = free_port(ios);
+   const unsigned short encode_port = free_port(ios);
+
+   const pid_t decoder = spawn_proxy(binary, decode_port, echo_port, "decode", opt.proxy_options);
+   const pid_t encoder = spawn_proxy(binary, encode_port, decode_port, "encode", opt.proxy_options);
+
+   int status = 0;
+
+   try
+   {
+      if (!wait_ready(ios, encode_port))
+      {
+         throw std::runtime_error("proxies did not come up");
+      }
+
+      boost::mutex lock;
+      std::size_t failures = 0;
+
+      // Latency
+      const std::vector<metrics::value_type> direct  = measure_latency(ios, echo_port, opt);
+      const std::vector<metrics::value_type> proxied = measure_latency(ios, encode_port, opt);
+
+      std::printf("latency     %lu x %lu bytes\n",
+                  static_cast<unsigned long>(opt.round_trips),
+                  static_cast<unsigned long>(opt.message));
+      std::printf("  direct    p50 %8.1f us   p99 %8.1f us\n", percentile(direct, 0.5), percentile(direct, 0.99));
+      std::printf("  proxied   p50 %8.1f us   p99 %8.1f us\n", percentile(proxied, 0.5), percentile(proxied, 0.99));
+      std::printf("  added     p50 %8.1f us   p99 %8.1f us\n",
+                  percentile(proxied, 0.5) - percentile(direct, 0.5),
+                  percentile(proxied, 0.99) - percentile(direct, 0.99));
+
+      // Throughput
+      {
+         const std::size_t bytes = opt.megabytes * 1024 * 1024;
+         boost::thread_group clients;
+         const metrics::value_type start = metrics::now();
+
+         for (std::size_t i = 0; i < opt.connections; ++i)
+         {
+            clients.create_thread(boost::bind(&stream_connection, boost::ref(ios), encode_port, bytes,
+                                              boost::ref(lock), boost::ref(failures)));
+         }
+
+         clients.join_all();
+
+         const double seconds = (metrics::now() - start) / 1e9;
+
+         std::printf("throughput  %lu connections x %lu MB\n",
+                     static_cast<unsigned long>(opt.connections),
+                     static_cast<unsigned long>(opt.megabytes));
+         std::printf("  %.1f MB/s each way\n", opt.connections * bytes / seconds / 1e6);
+      }
+
+      // Connection rate
+      {
+         boost::thread_group clients;
+         const std::size_t per_thread = (opt.connects + opt.connections - 1) / opt.connections;
+         const metrics::value_type start = metrics::now();
+
+         for (std::size_t i = 0; i < opt.connections; ++i)
+         {
+            clients.create_thread(boost::bind(&connect_loop, boost::ref(ios), encode_port, per_thread,
+                                              boost::ref(lock), boost::ref(failures)));
+         }
+
+         clients.join_all();
+
+         const double seconds = (metrics::now() - start) / 1e9;
+
+         std::printf("connections %lu from %lu threads\n",
+                     static_cast<unsigned long>(per_thread * opt.connections),
+                     static_cast<unsigned long>(opt.connections));
+         std::printf("  %.0f connections/s\n", per_thread * opt.connections / seconds);
+      }
+
+      if (failures != 0)
+      {
+         std::printf("failures    %lu\n", static_cast<unsigned long>(failures));
+         status = 1;
+      }
+   }
+   catch (std::exception& e)
+   {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      status = 1;
+   }
+
+   kill(encoder, SIGTERM);
+   kill(decoder, SIGTERM);
+   waitpid(encoder, 0, 0);
+   waitpid(decoder, 0, 0);
+
+   stopping = true;
+   connect(ios, echo_port);
+   echo.join();
+   echo_threads.join_all();
+
+   return status;
+}
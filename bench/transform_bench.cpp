@@ -0,0 +1,180 @@
+//
+// transform_bench.cpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Throughput of the frame transforms across payload sizes: the fused
+// xorb64 kernels the bridges use, against a plain XOR pass followed by
+// TurboBase64, which is what they replaced. The chacha20 cases time the
+// keystream alone, which the bridges apply ahead of the same kernels.
+//
+// usage: transform_bench [milliseconds per case]
+//
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../chacha20.hpp"
+#include "../metrics.hpp"
+#include "../xorb64.hpp"
+
+
+namespace
+{
+   const unsigned char kKey = 42;
+
+   std::size_t reference_encode(unsigned char* in, std::size_t length, unsigned char* out)
+   {
+      for (std::size_t i = 0; i < length; ++i)
+      {
+         in[i] ^= kKey;
+      }
+
+      return tb64enc(in, length, out);
+   }
+
+   std::size_t reference_decode(const unsigned char* in, std::size_t length, unsigned char* out)
+   {
+      const std::size_t decoded = tb64dec(in, length, out);
+
+      for (std::size_t i = 0; i < decoded; ++i)
+      {
+         out[i] ^= kKey;
+      }
+
+      return decoded;
+   }
+
+   // Runs op over the payload until the time budget is spent and prints
+   // the throughput in payload bytes.
+   template <typename Op>
+   void run(const char* name, std::size_t payload, metrics::value_type budget, Op op)
+   {
+      std::size_t iterations = 0;
+      std::size_t check = 0;
+      const metrics::value_type start = metrics::now();
+      metrics::value_type elapsed = 0;
+
+      do
+      {
+         for (std::size_t i = 0; i < 16; ++i)
+         {
+            check += op();
+         }
+
+         iterations += 16;
+         elapsed = metrics::now() - start;
+      }
+      while (elapsed < budget);
+
+      const double seconds = elapsed / 1e9;
+
+      std::printf("%-14s %9lu %12.1f MB/s %10.1f ns/op   (%lu)\n",
+                  name,
+                  static_cast<unsigned long>(payload),
+                  iterations * payload / seconds / 1e6,
+                  elapsed / static_cast<double>(iterations),
+                  static_cast<unsigned long>(check % 10));
+   }
+
+   struct encode_op
+   {
+      encode_op(std::vector<unsigned char>& in, std::vector<unsigned char>& out, bool fused)
+      : in_(in), out_(out), fused_(fused)
+      {}
+
+      std::size_t operator()() const
+      {
+         return fused_ ? xorb64::xorb64enc(&in_[0], in_.size(), &out_[0], kKey)
+                       : reference_encode(&in_[0], in_.size(), &out_[0]);
+      }
+
+      std::vector<unsigned char>& in_;
+      std::vector<unsigned char>& out_;
+      bool fused_;
+   };
+
+   struct decode_op
+   {
+      decode_op(const std::vector<unsigned char>& in, std::vector<unsigned char>& out, bool fused)
+      : in_(in), out_(out), fused_(fused)
+      {}
+
+      std::size_t operator()() const
+      {
+         return fused_ ? xorb64::xorb64dec(&in_[0], in_.size(), &out_[0], kKey)
+                       : reference_decode(&in_[0], in_.size(), &out_[0]);
+      }
+
+      const std::vector<unsigned char>& in_;
+      std::vector<unsigned char>& out_;
+      bool fused_;
+   };
+
+   struct chacha20_op
+   {
+      chacha20_op(chacha20::stream& stream, std::vector<unsigned char>& data)
+      : stream_(stream), data_(data)
+      {}
+
+      std::size_t operator()() const
+      {
+         stream_.apply(&data_[0], data_.size(), &data_[0]);
+         return data_[0];
+      }
+
+      chacha20::stream& stream_;
+      std::vector<unsigned char>& data_;
+   };
+}
+
+int main(int argc, char* argv[])
+{
+   const metrics::value_type budget =
+      static_cast<metrics::value_type>(argc > 1 ? std::atoi(argv[1]) : 200) * 1000000u;
+
+   const std::size_t sizes[] = { 64, 512, 4096, 8192, 65536, 1048576 };
+
+   std::printf("transform kernel: %s, chacha20 kernel: %s\n",
+               xorb64::xorb64_kernel_name(), chacha20::kernel_name());
+   std::printf("%-14s %9s %17s %13s\n", "case", "bytes", "throughput", "latency");
+
+   for (std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+   {
+      const std::size_t size = sizes[s];
+
+      std::vector<unsigned char> plain(size);
+      std::vector<unsigned char> encoded(TB64ENCLEN(size));
+      std::vector<unsigned char> decoded(size + 3);
+
+      for (std::size_t i = 0; i < size; ++i)
+      {
+         plain[i] = static_cast<unsigned char>(std::rand());
+      }
+
+      std::vector<unsigned char> scratch(plain);
+      xorb64::xorb64enc(&scratch[0], size, &encoded[0], kKey);
+
+      run("encode",     size, budget, encode_op(plain, encoded, true));
+      run("encode/ref", size, budget, encode_op(plain, encoded, false));
+
+      run("decode",     size, budget, decode_op(encoded, decoded, true));
+      run("decode/ref", size, budget, decode_op(encoded, decoded, false));
+
+      const unsigned char nonce[chacha20::nonce_size] = { 0 };
+      chacha20::stream stream;
+      stream.reset(chacha20::key::random(), nonce);
+      std::vector<unsigned char> data(plain);
+
+      run("chacha20",   size, budget, chacha20_op(stream, data));
+   }
+
+   return 0;
+}
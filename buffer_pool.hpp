@@ -0,0 +1,122 @@
+//
+// buffer_pool.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+
+
+#ifndef INCLUDE_BUFFER_POOL_HPP
+#define INCLUDE_BUFFER_POOL_HPP
+
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+
+namespace tcp_proxy
+{
+   // Cache of buffers for one loop, in size classes of 2^n and 3 * 2^(n-1)
+   // bytes. Bridges check buffers out only while a read, transform or write
+   // is in progress, so an idle bridge holds none. Only ever used from its
+   // loop's thread, so it needs no locking.
+   class buffer_pool : private boost::noncopyable
+   {
+   public:
+
+      explicit buffer_pool(std::size_t max_cached_bytes)
+      : max_cached_bytes_(max_cached_bytes),
+        cached_bytes_(0)
+      {}
+
+      ~buffer_pool()
+      {
+         for (std::size_t i = 0; i < free_.size(); ++i)
+         {
+            for (std::size_t j = 0; j < free_[i].size(); ++j)
+            {
+               delete [] free_[i][j];
+            }
+         }
+      }
+
+      // Usable size of a buffer allocated for size bytes.
+      static std::size_t capacity(std::size_t size)
+      {
+         std::size_t c = min_capacity;
+
+         while (c < size)
+         {
+            c = next_capacity(c);
+         }
+
+         return c;
+      }
+
+      unsigned char* allocate(std::size_t size)
+      {
+         const std::size_t c = capacity(size);
+         std::vector<unsigned char*>& free = free_list(c);
+
+         if (free.empty())
+         {
+            return new unsigned char[c];
+         }
+
+         unsigned char* buffer = free.back();
+         free.pop_back();
+         cached_bytes_ -= c;
+         return buffer;
+      }
+
+      // Returns a buffer allocated with the same size.
+      void deallocate(unsigned char* buffer, std::size_t size)
+      {
+         const std::size_t c = capacity(size);
+
+         if (cached_bytes_ + c > max_cached_bytes_)
+         {
+            delete [] buffer;
+            return;
+         }
+
+         free_list(c).push_back(buffer);
+         cached_bytes_ += c;
+      }
+
+   private:
+
+      enum { min_capacity = 4096 };
+
+      // 4K, 6K, 8K, 12K, 16K, ...
+      static std::size_t next_capacity(std::size_t c)
+      {
+         return (c & (c - 1)) ? (c / 3 * 4) : (c / 2 * 3);
+      }
+
+      std::vector<unsigned char*>& free_list(std::size_t c)
+      {
+         std::size_t index = 0;
+
+         for (std::size_t i = min_capacity; i < c; i = next_capacity(i))
+         {
+            ++index;
+         }
+
+         if (index >= free_.size())
+         {
+            free_.resize(index + 1);
+         }
+
+         return free_[index];
+      }
+
+      std::size_t max_cached_bytes_;
+      std::size_t cached_bytes_;
+      std::vector<std::vector<unsigned char*> > free_;
+   };
+}
+
+#endif
@@ -0,0 +1,554 @@
+//
+// chacha20.hpp
+// ~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// The ChaCha20 stream cipher, in the original form with a 64-bit block
+// counter and a 64-bit nonce, so that a stream can run for as long as a
+// connection lasts. A stream XORs its keystream over whatever is passed to
+// it, picking up where the last call stopped, including partway through a
+// block.
+//
+// Full blocks go through a kernel chosen once at runtime, as in xorb64:
+// eight blocks at a time with AVX2, four with SSSE3, or one at a time in
+// plain C++. All of them produce the keystream of RFC 8439's block
+// function.
+//
+// The cipher only hides the data; it does not detect tampering.
+//
+
+
+#ifndef INCLUDE_CHACHA20_HPP
+#define INCLUDE_CHACHA20_HPP
+
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+   #define CHACHA20_X86
+   #include <immintrin.h>
+#endif
+
+
+namespace chacha20
+{
+   typedef boost::uint32_t word;
+
+   enum {
+      key_size = 32,
+      nonce_size = 8,
+      block_size = 64
+   };
+
+   // XORs blocks keystream blocks over in into out, starting at the block
+   // counter in words 12 and 13 of state. in and out may be the same.
+   typedef void (*xor_function)(const word* state, const unsigned char* in,
+                                unsigned char* out, std::size_t blocks);
+
+   namespace details
+   {
+      inline word load32(const unsigned char* p)
+      {
+         return static_cast<word>(p[0])       | static_cast<word>(p[1]) << 8 |
+                static_cast<word>(p[2]) << 16 | static_cast<word>(p[3]) << 24;
+      }
+
+      inline void store32(unsigned char* p, word v)
+      {
+         p[0] = static_cast<unsigned char>(v);
+         p[1] = static_cast<unsigned char>(v >> 8);
+         p[2] = static_cast<unsigned char>(v >> 16);
+         p[3] = static_cast<unsigned char>(v >> 24);
+      }
+
+      inline word rotl(word v, int n)
+      {
+         return (v << n) | (v >> (32 - n));
+      }
+
+      inline void quarter_round(word& a, word& b, word& c, word& d)
+      {
+         a += b; d ^= a; d = rotl(d, 16);
+         c += d; b ^= c; b = rotl(b, 12);
+         a += b; d ^= a; d = rotl(d,  8);
+         c += d; b ^= c; b = rotl(b,  7);
+      }
+
+      inline void advance(word* state, std::size_t blocks)
+      {
+         const boost::uint64_t counter =
+            ((static_cast<boost::uint64_t>(state[13]) << 32) | state[12]) + blocks;
+
+         state[12] = static_cast<word>(counter);
+         state[13] = static_cast<word>(counter >> 32);
+      }
+
+      // One block of keystream.
+      inline void block(const word* state, unsigned char* out)
+      {
+         word x[16];
+         std::memcpy(x, state, sizeof(x));
+
+         for (int i = 0; i < 10; ++i)
+         {
+            quarter_round(x[0], x[4], x[ 8], x[12]);
+            quarter_round(x[1], x[5], x[ 9], x[13]);
+            quarter_round(x[2], x[6], x[10], x[14]);
+            quarter_round(x[3], x[7], x[11], x[15]);
+
+            quarter_round(x[0], x[5], x[10], x[15]);
+            quarter_round(x[1], x[6], x[11], x[12]);
+            quarter_round(x[2], x[7], x[ 8], x[13]);
+            quarter_round(x[3], x[4], x[ 9], x[14]);
+         }
+
+         for (int i = 0; i < 16; ++i)
+         {
+            store32(out + 4 * i, x[i] + state[i]);
+         }
+      }
+
+      inline void xor_scalar(const word* state, const unsigned char* in,
+                             unsigned char* out, std::size_t blocks)
+      {
+         word s[16];
+         std::memcpy(s, state, sizeof(s));
+         unsigned char keystream[block_size];
+
+         for (; blocks > 0; --blocks, in += block_size, out += block_size)
+         {
+            block(s, keystream);
+            advance(s, 1);
+
+            for (std::size_t i = 0; i < block_size; ++i)
+            {
+               out[i] = in[i] ^ keystream[i];
+            }
+         }
+      }
+
+   #ifdef CHACHA20_X86
+
+      /*
+         The vector kernels run several blocks side by side: vector i holds
+         word i of every block, the lanes differing only in the counter.
+         The finished words are transposed back into blocks before they are
+         XORed over the data.
+      */
+
+      __attribute__((target("ssse3")))
+      inline void quarter_round_ssse3(__m128i& a, __m128i& b, __m128i& c, __m128i& d)
+      {
+         const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+         const __m128i rot8  = _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+         a = _mm_add_epi32(a, b); d = _mm_shuffle_epi8(_mm_xor_si128(d, a), rot16);
+         c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);
+         b = _mm_or_si128(_mm_slli_epi32(b, 12), _mm_srli_epi32(b, 20));
+         a = _mm_add_epi32(a, b); d = _mm_shuffle_epi8(_mm_xor_si128(d, a), rot8);
+         c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);
+         b = _mm_or_si128(_mm_slli_epi32(b, 7), _mm_srli_epi32(b, 25));
+      }
+
+      // Four blocks per step.
+      __attribute__((target("ssse3")))
+      inline void xor_ssse3(const word* state, const unsigned char* in,
+                            unsigned char* out, std::size_t blocks)
+      {
+         word s[16];
+         std::memcpy(s, state, sizeof(s));
+
+         for (; blocks >= 4; blocks -= 4, in += 4 * block_size, out += 4 * block_size)
+         {
+            __m128i x[16];
+
+            for (int i = 0; i < 16; ++i)
+            {
+               x[i] = _mm_set1_epi32(static_cast<int>(s[i]));
+            }
+
+            // Lanes count up from the counter, carrying into word 13.
+            const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+            const __m128i low = _mm_add_epi32(x[12], _mm_setr_epi32(0, 1, 2, 3));
+            const __m128i carry = _mm_cmpgt_epi32(_mm_xor_si128(x[12], sign), _mm_xor_si128(low, sign));
+            const __m128i high = _mm_sub_epi32(x[13], carry);
+            x[12] = low;
+            x[13] = high;
+
+            for (int i = 0; i < 10; ++i)
+            {
+               quarter_round_ssse3(x[0], x[4], x[ 8], x[12]);
+               quarter_round_ssse3(x[1], x[5], x[ 9], x[13]);
+               quarter_round_ssse3(x[2], x[6], x[10], x[14]);
+               quarter_round_ssse3(x[3], x[7], x[11], x[15]);
+
+               quarter_round_ssse3(x[0], x[5], x[10], x[15]);
+               quarter_round_ssse3(x[1], x[6], x[11], x[12]);
+               quarter_round_ssse3(x[2], x[7], x[ 8], x[13]);
+               quarter_round_ssse3(x[3], x[4], x[ 9], x[14]);
+            }
+
+            for (int i = 0; i < 16; ++i)
+            {
+               x[i] = _mm_add_epi32(x[i], (i == 12) ? low : (i == 13) ? high
+                                                     : _mm_set1_epi32(static_cast<int>(s[i])));
+            }
+
+            // Words 4g to 4g+3 of the four blocks.
+            for (int g = 0; g < 4; ++g)
+            {
+               const __m128i t0 = _mm_unpacklo_epi32(x[4 * g    ], x[4 * g + 1]);
+               const __m128i t1 = _mm_unpackhi_epi32(x[4 * g    ], x[4 * g + 1]);
+               const __m128i t2 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+               const __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+
+               const __m128i r[4] = {
+                  _mm_unpacklo_epi64(t0, t2),
+                  _mm_unpackhi_epi64(t0, t2),
+                  _mm_unpacklo_epi64(t1, t3),
+                  _mm_unpackhi_epi64(t1, t3)
+               };
+
+               for (int b = 0; b < 4; ++b)
+               {
+                  const std::size_t p = b * block_size + 16 * g;
+                  const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + p));
+                  _mm_storeu_si128(reinterpret_cast<__m128i*>(out + p), _mm_xor_si128(v, r[b]));
+               }
+            }
+
+            advance(s, 4);
+         }
+
+         xor_scalar(s, in, out, blocks);
+      }
+
+      __attribute__((target("avx2")))
+      inline void quarter_round_avx2(__m256i& a, __m256i& b, __m256i& c, __m256i& d)
+      {
+         const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                                2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+         const __m256i rot8  = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                                3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+         a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16);
+         c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);
+         b = _mm256_or_si256(_mm256_slli_epi32(b, 12), _mm256_srli_epi32(b, 20));
+         a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);
+         c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);
+         b = _mm256_or_si256(_mm256_slli_epi32(b, 7), _mm256_srli_epi32(b, 25));
+      }
+
+      // Eight blocks per step; what is left goes through the SSSE3 kernel.
+      __attribute__((target("avx2")))
+      inline void xor_avx2(const word* state, const unsigned char* in,
+                           unsigned char* out, std::size_t blocks)
+      {
+         word s[16];
+         std::memcpy(s, state, sizeof(s));
+
+         for (; blocks >= 8; blocks -= 8, in += 8 * block_size, out += 8 * block_size)
+         {
+            __m256i x[16];
+
+            for (int i = 0; i < 16; ++i)
+            {
+               x[i] = _mm256_set1_epi32(static_cast<int>(s[i]));
+            }
+
+            const __m256i sign = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+            const __m256i low = _mm256_add_epi32(x[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            const __m256i carry = _mm256_cmpgt_epi32(_mm256_xor_si256(x[12], sign), _mm256_xor_si256(low, sign));
+            const __m256i high = _mm256_sub_epi32(x[13], carry);
+            x[12] = low;
+            x[13] = high;
+
+            for (int i = 0; i < 10; ++i)
+            {
+               quarter_round_avx2(x[0], x[4], x[ 8], x[12]);
+               quarter_round_avx2(x[1], x[5], x[ 9], x[13]);
+               quarter_round_avx2(x[2], x[6], x[10], x[14]);
+               quarter_round_avx2(x[3], x[7], x[11], x[15]);
+
+               quarter_round_avx2(x[0], x[5], x[10], x[15]);
+               quarter_round_avx2(x[1], x[6], x[11], x[12]);
+               quarter_round_avx2(x[2], x[7], x[ 8], x[13]);
+               quarter_round_avx2(x[3], x[4], x[ 9], x[14]);
+            }
+
+            for (int i = 0; i < 16; ++i)
+            {
+               x[i] = _mm256_add_epi32(x[i], (i == 12) ? low : (i == 13) ? high
+                                                        : _mm256_set1_epi32(static_cast<int>(s[i])));
+            }
+
+            // Words 8h to 8h+7 of the eight blocks. The unpacks work within
+            // 128-bit lanes, leaving blocks b and b+4 in the two halves.
+            for (int h = 0; h < 2; ++h)
+            {
+               const __m256i* a = x + 8 * h;
+
+               const __m256i t0 = _mm256_unpacklo_epi32(a[0], a[1]);
+               const __m256i t1 = _mm256_unpackhi_epi32(a[0], a[1]);
+               const __m256i t2 = _mm256_unpacklo_epi32(a[2], a[3]);
+               const __m256i t3 = _mm256_unpackhi_epi32(a[2], a[3]);
+               const __m256i t4 = _mm256_unpacklo_epi32(a[4], a[5]);
+               const __m256i t5 = _mm256_unpackhi_epi32(a[4], a[5]);
+               const __m256i t6 = _mm256_unpacklo_epi32(a[6], a[7]);
+               const __m256i t7 = _mm256_unpackhi_epi32(a[6], a[7]);
+
+               const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+               const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+               const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+               const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+               const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+               const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+               const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+               const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+               const __m256i r[8] = {
+                  _mm256_permute2x128_si256(u0, u4, 0x20),
+                  _mm256_permute2x128_si256(u1, u5, 0x20),
+                  _mm256_permute2x128_si256(u2, u6, 0x20),
+                  _mm256_permute2x128_si256(u3, u7, 0x20),
+                  _mm256_permute2x128_si256(u0, u4, 0x31),
+                  _mm256_permute2x128_si256(u1, u5, 0x31),
+                  _mm256_permute2x128_si256(u2, u6, 0x31),
+                  _mm256_permute2x128_si256(u3, u7, 0x31)
+               };
+
+               for (int b = 0; b < 8; ++b)
+               {
+                  const std::size_t p = b * block_size + 32 * h;
+                  const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + p));
+                  _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + p), _mm256_xor_si256(v, r[b]));
+               }
+            }
+
+            advance(s, 8);
+         }
+
+         xor_ssse3(s, in, out, blocks);
+      }
+
+   #endif
+
+      struct kernel
+      {
+         kernel()
+         : transform(&xor_scalar),
+           name("scalar")
+         {
+         #ifdef CHACHA20_X86
+            __builtin_cpu_init();
+
+            if (__builtin_cpu_supports("avx2"))
+            {
+               transform = &xor_avx2;
+               name      = "avx2";
+            }
+            else if (__builtin_cpu_supports("ssse3"))
+            {
+               transform = &xor_ssse3;
+               name      = "ssse3";
+            }
+         #endif
+         }
+
+         xor_function transform;
+         const char* name;
+      };
+
+      inline const kernel& selected_kernel()
+      {
+         static const kernel k;
+         return k;
+      }
+   }
+
+   class key
+   {
+   public:
+
+      // Reads a key file of 64 hex digits; whitespace between them is
+      // ignored.
+      static key from_file(const std::string& path)
+      {
+         std::ifstream file(path.c_str());
+
+         if (!file)
+         {
+            throw std::runtime_error("cannot read cipher key " + path);
+         }
+
+         key k;
+         std::size_t digits = 0;
+         char c;
+
+         while (file.get(c))
+         {
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            {
+               continue;
+            }
+
+            const int value = hex_value(c);
+
+            if (value < 0 || digits == 2 * key_size)
+            {
+               throw std::runtime_error("cipher key " + path + " is not 64 hex digits");
+            }
+
+            k.bytes_[digits / 2] = static_cast<unsigned char>((digits % 2 == 0) ? value << 4
+                                                                                : k.bytes_[digits / 2] | value);
+            ++digits;
+         }
+
+         if (digits != 2 * key_size)
+         {
+            throw std::runtime_error("cipher key " + path + " is not 64 hex digits");
+         }
+
+         return k;
+      }
+
+      // A key from the system's random source.
+      static key random()
+      {
+         std::ifstream source("/dev/urandom", std::ios::in | std::ios::binary);
+         key k;
+
+         if (!source.read(reinterpret_cast<char*>(k.bytes_), key_size))
+         {
+            throw std::runtime_error("cannot read /dev/urandom");
+         }
+
+         return k;
+      }
+
+      const unsigned char* data() const
+      {
+         return bytes_;
+      }
+
+   private:
+
+      key()
+      {}
+
+      static int hex_value(char c)
+      {
+         if (c >= '0' && c <= '9') return c - '0';
+         if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+         if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+         return -1;
+      }
+
+      unsigned char bytes_[key_size];
+   };
+
+   class stream
+   {
+   public:
+
+      stream()
+      : used_(block_size),
+        keyed_(false)
+      {}
+
+      // Starts the keystream of key and nonce at block 0.
+      void reset(const key& k, const unsigned char* nonce)
+      {
+         state_[0] = 0x61707865;
+         state_[1] = 0x3320646e;
+         state_[2] = 0x79622d32;
+         state_[3] = 0x6b206574;
+
+         for (int i = 0; i < 8; ++i)
+         {
+            state_[4 + i] = details::load32(k.data() + 4 * i);
+         }
+
+         state_[12] = 0;
+         state_[13] = 0;
+         state_[14] = details::load32(nonce);
+         state_[15] = details::load32(nonce + 4);
+
+         used_ = block_size;
+         keyed_ = true;
+      }
+
+      bool keyed() const
+      {
+         return keyed_;
+      }
+
+      // XORs the next length bytes of keystream over in into out, which
+      // may be the same.
+      void apply(const unsigned char* in, std::size_t length, unsigned char* out)
+      {
+         // The rest of the block the last call stopped in.
+         for (; length > 0 && used_ < block_size; --length)
+         {
+            *out++ = *in++ ^ keystream_[used_++];
+         }
+
+         const std::size_t blocks = length / block_size;
+
+         if (blocks > 0)
+         {
+            details::selected_kernel().transform(state_, in, out, blocks);
+            details::advance(state_, blocks);
+
+            in     += blocks * block_size;
+            out    += blocks * block_size;
+            length -= blocks * block_size;
+         }
+
+         if (length > 0)
+         {
+            details::block(state_, keystream_);
+            details::advance(state_, 1);
+
+            for (std::size_t i = 0; i < length; ++i)
+            {
+               out[i] = in[i] ^ keystream_[i];
+            }
+
+            used_ = length;
+         }
+      }
+
+      // Writes the next length bytes of keystream itself.
+      void generate(unsigned char* out, std::size_t length)
+      {
+         std::memset(out, 0, length);
+         apply(out, length, out);
+      }
+
+   private:
+
+      word state_[16];
+      unsigned char keystream_[block_size];
+      std::size_t used_;
+      bool keyed_;
+   };
+
+   // Name of the kernel picked for this CPU.
+   inline const char* kernel_name()
+   {
+      return details::selected_kernel().name;
+   }
+}
+
+#endif
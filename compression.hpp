@@ -0,0 +1,329 @@
+//
+// compression.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Optional per-frame compression, applied to a chunk before it is XORed and
+// framed, and undone after a frame is decoded. Every compressed frame's
+// payload starts with a byte naming its codec; a chunk that doesn't shrink
+// is sent raw behind a zero byte, so incompressible traffic only costs that
+// one byte per frame.
+//
+// LZ4 is built in with -DTCP_PROXY_LZ4 (linking -llz4) and zstd with
+// -DTCP_PROXY_ZSTD (linking -lzstd); see the Makefile. zstd can use a
+// dictionary trained on sample traffic (zstd --train), which is where it
+// pays off on frames as small as chunks. A frame is decoded with whatever
+// codec its flag names, so the two ends need not pick the same codec, only
+// both have compression on.
+//
+// The dictionary is shared by all loops; each loop has its own compressor
+// with its own zstd contexts.
+//
+
+
+#ifndef INCLUDE_COMPRESSION_HPP
+#define INCLUDE_COMPRESSION_HPP
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#ifdef TCP_PROXY_LZ4
+   #include <lz4.h>
+#endif
+
+#ifdef TCP_PROXY_ZSTD
+   #include <zstd.h>
+#endif
+
+
+namespace tcp_proxy
+{
+   enum compression_type
+   {
+      compression_off,
+      compression_lz4,
+      compression_zstd
+   };
+
+   // Codecs this build has, for option parsing.
+   inline bool compression_supported(compression_type type)
+   {
+      switch (type)
+      {
+         case compression_off  : return true;
+      #ifdef TCP_PROXY_LZ4
+         case compression_lz4  : return true;
+      #endif
+      #ifdef TCP_PROXY_ZSTD
+         case compression_zstd : return true;
+      #endif
+         default               : return false;
+      }
+   }
+
+   // A zstd dictionary, loaded from a file and digested once for every
+   // loop. The digested forms are read-only and safe to share.
+   class compression_dictionary : private boost::noncopyable
+   {
+   public:
+
+      compression_dictionary(const std::string& path, int level)
+      #ifdef TCP_PROXY_ZSTD
+      : cdict_(0),
+        ddict_(0)
+      #endif
+      {
+         std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+
+         if (!file)
+         {
+            throw std::runtime_error("cannot read compression dictionary " + path);
+         }
+
+         const std::vector<char> content((std::istreambuf_iterator<char>(file)),
+                                         std::istreambuf_iterator<char>());
+
+      #ifdef TCP_PROXY_ZSTD
+         cdict_ = ZSTD_createCDict(content.empty() ? 0 : &content[0], content.size(), level);
+         ddict_ = ZSTD_createDDict(content.empty() ? 0 : &content[0], content.size());
+
+         if (cdict_ == 0 || ddict_ == 0)
+         {
+            release();
+            throw std::runtime_error("invalid compression dictionary " + path);
+         }
+      #else
+         (void)level;
+         throw std::runtime_error("compression dictionaries need zstd (-DTCP_PROXY_ZSTD)");
+      #endif
+      }
+
+      ~compression_dictionary()
+      {
+      #ifdef TCP_PROXY_ZSTD
+         release();
+      #endif
+      }
+
+   #ifdef TCP_PROXY_ZSTD
+      const ZSTD_CDict* cdict() const
+      {
+         return cdict_;
+      }
+
+      const ZSTD_DDict* ddict() const
+      {
+         return ddict_;
+      }
+
+   private:
+
+      void release()
+      {
+         ZSTD_freeCDict(cdict_);
+         ZSTD_freeDDict(ddict_);
+      }
+
+      ZSTD_CDict* cdict_;
+      ZSTD_DDict* ddict_;
+   #endif
+   };
+
+   // Compresses and decompresses frame payloads for one loop. Only ever
+   // used from its loop's thread.
+   class compressor : private boost::noncopyable
+   {
+   public:
+
+      // A level of 0 is the codec's default: LZ4's fastest acceleration,
+      // or zstd's level 3. LZ4 takes the level as its acceleration.
+      compressor(compression_type type, int level, const compression_dictionary* dictionary)
+      : type_(type),
+        level_(level),
+        dictionary_(dictionary)
+      #ifdef TCP_PROXY_ZSTD
+        ,cctx_(0),
+        dctx_(0)
+      #endif
+      {
+         if (!compression_supported(type_))
+         {
+            throw std::runtime_error("compression codec not built in");
+         }
+
+      #ifdef TCP_PROXY_ZSTD
+         cctx_ = ZSTD_createCCtx();
+         dctx_ = ZSTD_createDCtx();
+
+         if (cctx_ == 0 || dctx_ == 0)
+         {
+            release();
+            throw std::runtime_error("cannot create zstd contexts");
+         }
+      #endif
+      }
+
+      ~compressor()
+      {
+      #ifdef TCP_PROXY_ZSTD
+         release();
+      #endif
+      }
+
+      // Bytes compress() may write for length bytes of input.
+      std::size_t bound(std::size_t length) const
+      {
+         std::size_t codec_bound = length;
+
+         switch (type_)
+         {
+         #ifdef TCP_PROXY_LZ4
+            case compression_lz4  : codec_bound = static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(length)));
+                                    break;
+         #endif
+         #ifdef TCP_PROXY_ZSTD
+            case compression_zstd : codec_bound = ZSTD_compressBound(length);
+                                    break;
+         #endif
+            default               : break;
+         }
+
+         return 1 + std::max(length, codec_bound);
+      }
+
+      // Writes the flag byte and the compressed chunk, or the chunk as it is
+      // if compressing doesn't make it smaller. Returns the bytes written.
+      std::size_t compress(const unsigned char* in, std::size_t length, unsigned char* out)
+      {
+         std::size_t compressed = 0;
+
+         switch (type_)
+         {
+         #ifdef TCP_PROXY_LZ4
+            case compression_lz4  :
+            {
+               const int n = LZ4_compress_fast(reinterpret_cast<const char*>(in),
+                                               reinterpret_cast<char*>(out + 1),
+                                               static_cast<int>(length),
+                                               static_cast<int>(bound(length) - 1),
+                                               level_ > 0 ? level_ : 1);
+               compressed = (n > 0) ? static_cast<std::size_t>(n) : 0;
+               break;
+            }
+         #endif
+         #ifdef TCP_PROXY_ZSTD
+            case compression_zstd :
+            {
+               const std::size_t n = dictionary_
+                  ? ZSTD_compress_usingCDict(cctx_, out + 1, bound(length) - 1, in, length, dictionary_->cdict())
+                  : ZSTD_compressCCtx(cctx_, out + 1, bound(length) - 1, in, length, level_ > 0 ? level_ : 3);
+               compressed = ZSTD_isError(n) ? 0 : n;
+               break;
+            }
+         #endif
+            default               : break;
+         }
+
+         if (compressed == 0 || compressed >= length)
+         {
+            out[0] = flag_raw;
+            std::memcpy(out + 1, in, length);
+            return 1 + length;
+         }
+
+         out[0] = static_cast<unsigned char>(type_);
+         return 1 + compressed;
+      }
+
+      // Restores a frame's chunk into out, which has room for capacity
+      // bytes, the largest chunk. Returns false if the frame is corrupt,
+      // too large, or uses a codec this build lacks.
+      bool decompress(const unsigned char* in, std::size_t length,
+                      unsigned char* out, std::size_t capacity,
+                      std::size_t& out_length)
+      {
+         if (length == 0)
+         {
+            return false;
+         }
+
+         const unsigned char* const payload = in + 1;
+         const std::size_t payload_length = length - 1;
+
+         switch (in[0])
+         {
+            case flag_raw :
+            {
+               if (payload_length > capacity)
+               {
+                  return false;
+               }
+
+               std::memcpy(out, payload, payload_length);
+               out_length = payload_length;
+               return true;
+            }
+         #ifdef TCP_PROXY_LZ4
+            case compression_lz4 :
+            {
+               const int n = LZ4_decompress_safe(reinterpret_cast<const char*>(payload),
+                                                 reinterpret_cast<char*>(out),
+                                                 static_cast<int>(payload_length),
+                                                 static_cast<int>(capacity));
+               out_length = (n > 0) ? static_cast<std::size_t>(n) : 0;
+               return n > 0;
+            }
+         #endif
+         #ifdef TCP_PROXY_ZSTD
+            case compression_zstd :
+            {
+               const std::size_t n = dictionary_
+                  ? ZSTD_decompress_usingDDict(dctx_, out, capacity, payload, payload_length, dictionary_->ddict())
+                  : ZSTD_decompressDCtx(dctx_, out, capacity, payload, payload_length);
+               out_length = ZSTD_isError(n) ? 0 : n;
+               return !ZSTD_isError(n) && n > 0;
+            }
+         #endif
+            default :
+               return false;
+         }
+      }
+
+   private:
+
+      // Flag of a chunk sent uncompressed; the codecs' flags are their
+      // compression_type values.
+      enum { flag_raw = compression_off };
+
+   #ifdef TCP_PROXY_ZSTD
+      void release()
+      {
+         ZSTD_freeCCtx(cctx_);
+         ZSTD_freeDCtx(dctx_);
+      }
+   #endif
+
+      compression_type type_;
+      int level_;
+      const compression_dictionary* dictionary_;
+   #ifdef TCP_PROXY_ZSTD
+      ZSTD_CCtx* cctx_;
+      ZSTD_DCtx* dctx_;
+   #endif
+   };
+}
+
+#endif
@@ -0,0 +1,85 @@
+//
+// coroutines.hpp
+// ~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// What the coroutine engine needs beyond asio's awaitables: a wakeup that
+// a coroutine parks on until another coroutine, or a handler, on the same
+// loop has given it something to do.
+//
+// Built when asio supports co_await, which takes a C++20 compiler (make
+// COROUTINES=1), unless TCP_PROXY_NO_COROUTINES is defined.
+//
+
+
+#ifndef INCLUDE_COROUTINES_HPP
+#define INCLUDE_COROUTINES_HPP
+
+
+// Boost 1.74's awaitable.hpp uses std::exchange without including <utility>.
+#include <utility>
+
+#include <boost/asio.hpp>
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT) && !defined(TCP_PROXY_NO_COROUTINES)
+
+#define TCP_PROXY_COROUTINES
+
+#include <cstddef>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/noncopyable.hpp>
+
+
+namespace tcp_proxy
+{
+   // A timer that never expires, which signal() cancels to resume the
+   // coroutines waiting on it. Wakeups may be spurious; a coroutine checks
+   // what it waits for again each time it is resumed.
+   class wakeup : private boost::noncopyable
+   {
+   public:
+
+      explicit wakeup(boost::asio::io_service& io_service)
+      : timer_(io_service, boost::asio::steady_timer::time_point::max()),
+        waiting_(0)
+      {}
+
+      boost::asio::awaitable<void> wait()
+      {
+         boost::system::error_code ec;
+
+         ++waiting_;
+         co_await timer_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+         --waiting_;
+      }
+
+      // Cancelling the timer takes the reactor's lock, so it is only done
+      // for a coroutine that is actually waiting.
+      void signal()
+      {
+         if (waiting_ != 0)
+         {
+            timer_.cancel();
+         }
+      }
+
+   private:
+
+      boost::asio::steady_timer timer_;
+      std::size_t waiting_;
+   };
+}
+
+#endif
+
+#endif
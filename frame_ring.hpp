@@ -0,0 +1,323 @@
+//
+// frame_ring.hpp
+// ~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+
+
+#ifndef INCLUDE_FRAME_RING_HPP
+#define INCLUDE_FRAME_RING_HPP
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "buffer_pool.hpp"
+
+
+namespace tcp_proxy
+{
+   // Receive ring for terminator delimited or length prefixed frames. A
+   // length prefix is the payload length as a LEB128 varint, least
+   // significant 7 bits first. Socket reads land
+   // directly in the free space of the ring (as a scatter read when it wraps)
+   // and frames are handed out as views into the ring, so they can be decoded
+   // in place. A frame may straddle the end of the ring, in which case its
+   // view has two segments. The ring's storage comes from the loop's buffer
+   // pool and is given back whenever the ring is empty. It starts out small
+   // and is grown, up to a maximum, while a partial frame fills it.
+   class frame_ring : private boost::noncopyable
+   {
+   public:
+
+      typedef boost::array<boost::asio::mutable_buffer,2> buffers_type;
+
+      struct frame
+      {
+         const unsigned char* first;
+         std::size_t first_length;
+         const unsigned char* second;
+         std::size_t second_length;
+
+         // Bytes of terminator or length prefix released along with it.
+         std::size_t framing;
+
+         // Length of the frame, excluding the terminator or prefix.
+         std::size_t length() const
+         {
+            return first_length + second_length;
+         }
+      };
+
+      frame_ring(buffer_pool& pool,
+                 std::size_t initial_capacity,
+                 std::size_t max_capacity,
+                 unsigned char terminator)
+      : pool_(pool),
+        initial_capacity_(buffer_pool::capacity(initial_capacity)),
+        max_capacity_(std::max(initial_capacity_, buffer_pool::capacity(max_capacity))),
+        capacity_(initial_capacity_),
+        data_(0),
+        terminator_(terminator),
+        head_(0),
+        size_(0),
+        scanned_(0)
+      {}
+
+      ~frame_ring()
+      {
+         if (data_)
+         {
+            pool_.deallocate(data_, capacity_);
+         }
+      }
+
+      // Free space of the ring, for the next read.
+      buffers_type prepare()
+      {
+         if (data_ == 0)
+         {
+            data_ = pool_.allocate(capacity_);
+         }
+
+         const std::size_t capacity = capacity_;
+         const std::size_t tail = (head_ + size_) % capacity;
+         const std::size_t free = capacity - size_;
+         const std::size_t first = std::min(free, capacity - tail);
+
+         buffers_type buffers;
+         buffers[0] = boost::asio::buffer(&data_[tail], first);
+         buffers[1] = boost::asio::buffer(&data_[0], free - first);
+         return buffers;
+      }
+
+      void commit(std::size_t length)
+      {
+         size_ += length;
+      }
+
+      // Looks for the next complete frame. The frame stays valid until it is
+      // released with consume().
+      bool next_frame(frame& f)
+      {
+         const std::size_t capacity = capacity_;
+
+         while (scanned_ < size_)
+         {
+            const std::size_t start = (head_ + scanned_) % capacity;
+            const std::size_t length = std::min(size_ - scanned_, capacity - start);
+            const void* found = std::memchr(&data_[start], terminator_, length);
+
+            if (found == 0)
+            {
+               scanned_ += length;
+               continue;
+            }
+
+            const std::size_t frame_length =
+               scanned_ + (static_cast<const unsigned char*>(found) - &data_[start]);
+
+            f.first = &data_[head_];
+            f.first_length = std::min(frame_length, capacity - head_);
+            f.second = &data_[0];
+            f.second_length = frame_length - f.first_length;
+            f.framing = 1;
+            return true;
+         }
+
+         return false;
+      }
+
+      // Looks for the next complete length prefixed frame. length is set to
+      // the payload length as soon as the prefix has arrived, 0 before, and
+      // to max_prefixed_length if the prefix is malformed, so that an
+      // oversized frame can be refused without waiting for it.
+      bool next_prefixed_frame(frame& f, std::size_t& length)
+      {
+         length = 0;
+         std::size_t header = 0;
+         std::size_t value = 0;
+
+         for ( ; ; ++header)
+         {
+            if (header == max_prefix_length)
+            {
+               length = max_prefixed_length;
+               return false;
+            }
+
+            if (header == size_)
+            {
+               return false;
+            }
+
+            const unsigned char byte = data_[(head_ + header) % capacity_];
+            value |= static_cast<std::size_t>(byte & 0x7f) << (7 * header);
+
+            if ((byte & 0x80) == 0)
+            {
+               ++header;
+               break;
+            }
+         }
+
+         length = value;
+
+         if (size_ - header < value)
+         {
+            return false;
+         }
+
+         const std::size_t start = (head_ + header) % capacity_;
+
+         f.first = &data_[start];
+         f.first_length = std::min(value, capacity_ - start);
+         f.second = &data_[0];
+         f.second_length = value - f.first_length;
+         f.framing = header;
+         return true;
+      }
+
+      // Releases a frame returned by next_frame() or next_prefixed_frame(),
+      // and its terminator or prefix.
+      void consume(const frame& f)
+      {
+         discard(f.length() + f.framing);
+      }
+
+      // Releases length bytes from the front of the ring.
+      void discard(std::size_t length)
+      {
+         head_ = (head_ + length) % capacity_;
+         size_ -= length;
+         scanned_ -= std::min(scanned_, length);
+      }
+
+      // The first length bytes received, as a frame without a terminator:
+      // the start of one that next_frame() hasn't found the end of. Valid
+      // until they are released with discard().
+      void peek(frame& f, std::size_t length) const
+      {
+         f.first = &data_[head_];
+         f.first_length = std::min(length, capacity_ - head_);
+         f.second = &data_[0];
+         f.second_length = length - f.first_length;
+         f.framing = 0;
+      }
+
+      // First byte received and not yet consumed; the ring must not be
+      // empty.
+      unsigned char front() const
+      {
+         return data_[head_];
+      }
+
+      // Bytes of prefix written by write_prefix() for length.
+      static std::size_t prefix_length(std::size_t length)
+      {
+         std::size_t n = 1;
+
+         while (length >= 0x80)
+         {
+            length >>= 7;
+            ++n;
+         }
+
+         return n;
+      }
+
+      // Writes the length prefix for a payload of length bytes, returning
+      // the bytes written.
+      static std::size_t write_prefix(unsigned char* out, std::size_t length)
+      {
+         std::size_t n = 0;
+
+         while (length >= 0x80)
+         {
+            out[n++] = static_cast<unsigned char>(length | 0x80);
+            length >>= 7;
+         }
+
+         out[n++] = static_cast<unsigned char>(length);
+         return n;
+      }
+
+      // Payloads of prefixed frames are limited to 32 bits.
+      enum { max_prefix_length = 5 };
+      static const std::size_t max_prefixed_length = 0xffffffffu;
+
+      // Gives the storage back to the pool if there is no partial frame.
+      void release_if_empty()
+      {
+         if (size_ == 0 && data_)
+         {
+            pool_.deallocate(data_, capacity_);
+            data_ = 0;
+            head_ = 0;
+            scanned_ = 0;
+            capacity_ = initial_capacity_;
+         }
+      }
+
+      // Moves the contents to a larger buffer, with at least as much free
+      // space as is used. Returns false if the ring is already at its
+      // maximum size.
+      bool grow()
+      {
+         if (capacity_ >= max_capacity_)
+         {
+            return false;
+         }
+
+         const std::size_t capacity =
+            std::min(max_capacity_, buffer_pool::capacity(std::max(2 * size_, capacity_ + 1)));
+         unsigned char* const data = pool_.allocate(capacity);
+
+         if (data_)
+         {
+            const std::size_t first = std::min(size_, capacity_ - head_);
+            std::memcpy(data, data_ + head_, first);
+            std::memcpy(data + first, data_, size_ - first);
+            pool_.deallocate(data_, capacity_);
+         }
+
+         data_ = data;
+         capacity_ = capacity;
+         head_ = 0;
+         return true;
+      }
+
+      std::size_t capacity() const
+      {
+         return capacity_;
+      }
+
+      // Bytes received but not yet consumed.
+      std::size_t size() const
+      {
+         return size_;
+      }
+
+   private:
+
+      buffer_pool& pool_;
+      std::size_t initial_capacity_;
+      std::size_t max_capacity_;
+      std::size_t capacity_;
+      unsigned char* data_;
+      unsigned char terminator_;
+      std::size_t head_;
+      std::size_t size_;
+
+      // Bytes from head_ known not to contain a terminator.
+      std::size_t scanned_;
+   };
+}
+
+#endif
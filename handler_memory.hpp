@@ -0,0 +1,227 @@
+//
+// handler_memory.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Completion handlers for the operations a bridge re-arms for every chunk,
+// which neither allocate nor touch an atomic reference count.
+//
+// Each kind of operation an object keeps outstanding, at most one at a
+// time, gets a handler_memory block inside the object, sized for it, which
+// Asio is given through the handler's associated allocator for the
+// operation it queues. An operation that doesn't fit, or a second one while
+// the block is taken, goes to the heap instead.
+//
+// The handlers hold a plain pointer to their owner and count themselves in
+// it. The owner keeps a single shared_ptr to itself while any of them is
+// alive, so that copying a handler, which C++98 Asio does at every layer,
+// is an increment on the owner's thread rather than an atomic one. All the
+// handlers of an owner are made, copied and destroyed on its loop's thread.
+//
+
+
+#ifndef INCLUDE_HANDLER_MEMORY_HPP
+#define INCLUDE_HANDLER_MEMORY_HPP
+
+
+#include <cstddef>
+#include <new>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+
+
+namespace tcp_proxy
+{
+   template <std::size_t BlockSize>
+   class handler_memory : private boost::noncopyable
+   {
+   public:
+
+      enum { block_size = BlockSize };
+
+      handler_memory()
+      : in_use_(false)
+      {}
+
+      void* allocate(std::size_t size)
+      {
+         if (!in_use_ && size <= block_size)
+         {
+            in_use_ = true;
+            return storage_.address();
+         }
+
+         return ::operator new(size);
+      }
+
+      void deallocate(void* pointer)
+      {
+         if (pointer == storage_.address())
+         {
+            in_use_ = false;
+         }
+         else
+         {
+            ::operator delete(pointer);
+         }
+      }
+
+   private:
+
+      boost::aligned_storage<block_size> storage_;
+      bool in_use_;
+   };
+
+   // Allocator over a handler_memory, as Asio rebinds it for its operations.
+   template <typename T, typename Memory>
+   class handler_allocator
+   {
+   public:
+
+      typedef T value_type;
+
+      template <typename U>
+      struct rebind
+      {
+         typedef handler_allocator<U, Memory> other;
+      };
+
+      explicit handler_allocator(Memory& memory)
+      : memory_(&memory)
+      {}
+
+      template <typename U>
+      handler_allocator(const handler_allocator<U, Memory>& other)
+      : memory_(other.memory_)
+      {}
+
+      T* allocate(std::size_t n) const
+      {
+         return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+      }
+
+      void deallocate(T* pointer, std::size_t) const
+      {
+         memory_->deallocate(pointer);
+      }
+
+      bool operator==(const handler_allocator& other) const
+      {
+         return memory_ == other.memory_;
+      }
+
+      bool operator!=(const handler_allocator& other) const
+      {
+         return memory_ != other.memory_;
+      }
+
+   private:
+
+      template <typename U, typename M> friend class handler_allocator;
+
+      Memory* memory_;
+   };
+
+   // Base of an object that hands out owned_handlers. Derived is also an
+   // enable_shared_from_this<Derived>.
+   template <typename Derived>
+   class handler_owner
+   {
+   public:
+
+      handler_owner()
+      : handlers_(0)
+      {}
+
+      void retain_handler()
+      {
+         if (handlers_++ == 0)
+         {
+            self_ = static_cast<Derived*>(this)->shared_from_this();
+         }
+      }
+
+      // May destroy the owner.
+      void release_handler()
+      {
+         if (--handlers_ == 0)
+         {
+            boost::shared_ptr<Derived> self;
+            self.swap(self_);
+         }
+      }
+
+   private:
+
+      std::size_t handlers_;
+      boost::shared_ptr<Derived> self_;
+   };
+
+   // Calls a member function of its owner with the completion's arguments,
+   // or with a default error_code when posted.
+   template <typename Owner, typename Function, typename Memory>
+   class owned_handler
+   {
+   public:
+
+      typedef handler_allocator<void, Memory> allocator_type;
+
+      owned_handler(Owner& owner, Function function, Memory& memory)
+      : owner_(&owner),
+        function_(function),
+        memory_(&memory)
+      {
+         owner_->retain_handler();
+      }
+
+      owned_handler(const owned_handler& other)
+      : owner_(other.owner_),
+        function_(other.function_),
+        memory_(other.memory_)
+      {
+         owner_->retain_handler();
+      }
+
+      ~owned_handler()
+      {
+         owner_->release_handler();
+      }
+
+      allocator_type get_allocator() const
+      {
+         return allocator_type(*memory_);
+      }
+
+      void operator()() const
+      {
+         (owner_->*function_)(boost::system::error_code());
+      }
+
+      void operator()(const boost::system::error_code& error) const
+      {
+         (owner_->*function_)(error);
+      }
+
+      void operator()(const boost::system::error_code& error, std::size_t bytes_transferred) const
+      {
+         (owner_->*function_)(error, bytes_transferred);
+      }
+
+   private:
+
+      owned_handler& operator=(const owned_handler&);
+
+      Owner* owner_;
+      Function function_;
+      Memory* memory_;
+   };
+}
+
+#endif
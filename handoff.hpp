@@ -0,0 +1,174 @@
+//
+// handoff.hpp
+// ~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Passing the listening sockets to a newer process over a Unix socket, so
+// that the proxy can be upgraded without refusing a connection or closing
+// a bridge.
+//
+// The running process listens on the handoff path. A new process started
+// with the same path connects to it and is sent the descriptors of the
+// listening sockets in one SCM_RIGHTS message, whose payload has a byte
+// for each saying what the socket is for. Both processes accept from the
+// same sockets until the new one, set up, answers with one byte; only then
+// does the old one stop accepting and wait for its bridges to finish. If
+// the new process goes away before it answers, the old one carries on.
+//
+// POSIX only; elsewhere TCP_PROXY_HANDOFF is left undefined.
+//
+
+
+#ifndef INCLUDE_HANDOFF_HPP
+#define INCLUDE_HANDOFF_HPP
+
+
+#include <boost/asio.hpp>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+#define TCP_PROXY_HANDOFF
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+namespace tcp_proxy
+{
+   namespace handoff
+   {
+      enum { max_sockets = 64 };
+
+      // What each socket handed over is for.
+      const char client_listener = 'c';
+      const char metrics_listener = 'm';
+
+      // The new process's answer once it is accepting.
+      const char ready = 'r';
+
+      inline bool send(int channel, const std::vector<int>& fds, const std::string& kinds)
+      {
+         if (fds.empty() || fds.size() > max_sockets || fds.size() != kinds.size())
+         {
+            return false;
+         }
+
+         std::vector<char> payload(kinds.begin(), kinds.end());
+         iovec iov;
+         iov.iov_base = &payload[0];
+         iov.iov_len = payload.size();
+
+         std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+         msghdr message;
+         std::memset(&message, 0, sizeof(message));
+         message.msg_iov = &iov;
+         message.msg_iovlen = 1;
+         message.msg_control = &control[0];
+         message.msg_controllen = control.size();
+
+         cmsghdr* const header = CMSG_FIRSTHDR(&message);
+         header->cmsg_level = SOL_SOCKET;
+         header->cmsg_type = SCM_RIGHTS;
+         header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+         std::memcpy(CMSG_DATA(header), &fds[0], sizeof(int) * fds.size());
+
+         ssize_t n;
+
+         do
+         {
+            n = ::sendmsg(channel, &message, 0);
+         }
+         while (n < 0 && errno == EINTR);
+
+         return n == static_cast<ssize_t>(payload.size());
+      }
+
+      // Blocks until the sockets arrive. The descriptors received are the
+      // caller's to close, even when it returns false.
+      inline bool receive(int channel, std::vector<int>& fds, std::string& kinds)
+      {
+         char payload[max_sockets];
+         iovec iov;
+         iov.iov_base = payload;
+         iov.iov_len = sizeof(payload);
+
+         std::vector<char> control(CMSG_SPACE(sizeof(int) * max_sockets));
+         msghdr message;
+         std::memset(&message, 0, sizeof(message));
+         message.msg_iov = &iov;
+         message.msg_iovlen = 1;
+         message.msg_control = &control[0];
+         message.msg_controllen = control.size();
+
+         ssize_t n;
+
+         do
+         {
+            n = ::recvmsg(channel, &message, 0);
+         }
+         while (n < 0 && errno == EINTR);
+
+         fds.clear();
+         kinds.clear();
+
+         for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != 0; header = CMSG_NXTHDR(&message, header))
+         {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+               const std::size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+               const std::size_t first = fds.size();
+               fds.resize(first + count);
+               std::memcpy(&fds[first], CMSG_DATA(header), sizeof(int) * count);
+            }
+         }
+
+         if (n <= 0 || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+         {
+            return false;
+         }
+
+         kinds.assign(payload, static_cast<std::size_t>(n));
+         return kinds.size() == fds.size();
+      }
+
+      inline void close_all(std::vector<int>& fds)
+      {
+         for (std::size_t i = 0; i < fds.size(); ++i)
+         {
+            ::close(fds[i]);
+         }
+
+         fds.clear();
+      }
+
+      // Protocol of a listening socket, for assigning it to an acceptor.
+      inline boost::asio::ip::tcp protocol_of(int fd)
+      {
+         sockaddr_storage address;
+         socklen_t length = sizeof(address);
+
+         if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) == 0 &&
+             address.ss_family == AF_INET6)
+         {
+            return boost::asio::ip::tcp::v6();
+         }
+
+         return boost::asio::ip::tcp::v4();
+      }
+   }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+//
+// memory_budget.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Bytes of buffers queued by every bridge of every loop, held against one
+// limit. Bridges add a chunk's buffer when they queue it and take it off
+// once it has been written; while the total is over the limit, a bridge
+// that already has something queued stops reading until its own writes
+// drain it. A bridge with nothing queued may always read one chunk, so
+// nobody waits for a wakeup from another loop, and the queued total stays
+// within the limit plus a chunk per direction of every bridge.
+//
+
+
+#ifndef INCLUDE_MEMORY_BUDGET_HPP
+#define INCLUDE_MEMORY_BUDGET_HPP
+
+
+#include <cstddef>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+
+namespace tcp_proxy
+{
+   class memory_budget : private boost::noncopyable
+   {
+   public:
+
+      // A limit of 0 never pauses anyone; the usage is still kept.
+      explicit memory_budget(std::size_t limit)
+      : limit_(limit),
+        used_(0)
+      {}
+
+      void add(std::size_t bytes)
+      {
+         used_.fetch_add(bytes, boost::memory_order_relaxed);
+      }
+
+      void remove(std::size_t bytes)
+      {
+         used_.fetch_sub(bytes, boost::memory_order_relaxed);
+      }
+
+      bool exceeded() const
+      {
+         return limit_ != 0 && used() > limit_;
+      }
+
+      std::size_t used() const
+      {
+         return used_.load(boost::memory_order_relaxed);
+      }
+
+      std::size_t limit() const
+      {
+         return limit_;
+      }
+
+   private:
+
+      std::size_t limit_;
+      boost::atomic<std::size_t> used_;
+   };
+}
+
+#endif
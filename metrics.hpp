@@ -0,0 +1,404 @@
+//
+// metrics.hpp
+// ~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Counters and latency histograms updated from the bridges' handlers, and
+// their rendering in the Prometheus text exposition format.
+//
+// Every I/O loop owns one registry and only that loop's thread updates it,
+// so the updates are relaxed atomic adds on cache lines no other thread
+// writes to. A scrape reads all the registries and sums them.
+//
+
+
+#ifndef INCLUDE_METRICS_HPP
+#define INCLUDE_METRICS_HPP
+
+
+#include <algorithm>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+
+namespace metrics
+{
+   typedef boost::uint64_t value_type;
+
+   // Nanoseconds from a monotonic clock.
+   inline value_type now()
+   {
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return static_cast<value_type>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+   }
+
+   class counter : private boost::noncopyable
+   {
+   public:
+
+      counter()
+      : value_(0)
+      {}
+
+      void add(value_type n = 1)
+      {
+         value_.fetch_add(n, boost::memory_order_relaxed);
+      }
+
+      value_type value() const
+      {
+         return value_.load(boost::memory_order_relaxed);
+      }
+
+   private:
+
+      boost::atomic<value_type> value_;
+   };
+
+   // Durations in power of two buckets, from 64ns up to about 17s. Longer
+   // ones are only in the count, which is the +Inf bucket.
+   class histogram : private boost::noncopyable
+   {
+   public:
+
+      enum {
+         min_shift = 6,
+         bucket_count = 29
+      };
+
+      histogram()
+      : count_(0),
+        sum_(0)
+      {
+         for (std::size_t i = 0; i < bucket_count; ++i)
+         {
+            buckets_[i] = 0;
+         }
+      }
+
+      void observe(value_type nanoseconds)
+      {
+         const std::size_t b = bucket(nanoseconds);
+
+         if (b < bucket_count)
+         {
+            buckets_[b].fetch_add(1, boost::memory_order_relaxed);
+         }
+
+         count_.fetch_add(1, boost::memory_order_relaxed);
+         sum_.fetch_add(nanoseconds, boost::memory_order_relaxed);
+      }
+
+      value_type bucket_value(std::size_t i) const
+      {
+         return buckets_[i].load(boost::memory_order_relaxed);
+      }
+
+      value_type count() const
+      {
+         return count_.load(boost::memory_order_relaxed);
+      }
+
+      value_type sum() const
+      {
+         return sum_.load(boost::memory_order_relaxed);
+      }
+
+      // Upper bound of bucket i, in nanoseconds.
+      static value_type upper_bound(std::size_t i)
+      {
+         return static_cast<value_type>(1) << (min_shift + i);
+      }
+
+   private:
+
+      // Smallest bucket whose upper bound is at least nanoseconds, or
+      // bucket_count for none.
+      static std::size_t bucket(value_type nanoseconds)
+      {
+         if (nanoseconds <= upper_bound(0))
+         {
+            return 0;
+         }
+
+         std::size_t bits = 0;
+
+         for (value_type n = nanoseconds - 1; n != 0; n >>= 1)
+         {
+            ++bits;
+         }
+
+         return std::min<std::size_t>(bits - min_shift, bucket_count);
+      }
+
+      boost::atomic<value_type> buckets_[bucket_count];
+      boost::atomic<value_type> count_;
+      boost::atomic<value_type> sum_;
+   };
+
+   // Measures the time from construction to the observe call.
+   class stopwatch
+   {
+   public:
+
+      stopwatch()
+      : start_(now())
+      {}
+
+      void observe(histogram& h) const
+      {
+         h.observe(now() - start_);
+      }
+
+   private:
+
+      value_type start_;
+   };
+
+   struct registry : private boost::noncopyable
+   {
+      counter bridges_accepted;
+      counter upstream_connect_failures;
+      counter upstream_pool_hits;
+      counter upstream_pool_misses;
+
+      counter plaintext_bytes_read;
+      counter plaintext_bytes_written;
+      counter ciphertext_bytes_read;
+      counter ciphertext_bytes_written;
+
+      // Pass-through bridges
+      counter upstream_bytes_relayed;
+      counter downstream_bytes_relayed;
+
+      counter frames_encoded;
+      counter frames_decoded;
+      counter encode_errors;
+      counter decode_errors;
+
+      // Bridges closed or connects given up on by their timeouts.
+      counter connect_timeouts;
+      counter idle_timeouts;
+      counter write_timeouts;
+
+      // Times a direction stopped reading, at its high watermark, because
+      // the memory budget was spent or to keep to its byte rate.
+      counter watermark_pauses;
+      counter budget_pauses;
+      counter rate_pauses;
+
+      // Clients turned away by the admission limits.
+      counter rejected_max_bridges;
+      counter rejected_per_source;
+      counter rejected_rate;
+
+      // Chunk bytes given to the compressor, and the bytes it produced.
+      counter compression_bytes_in;
+      counter compression_bytes_out;
+
+      // Streams opened over mux tunnels, and tunnels lost with their
+      // streams.
+      counter mux_streams;
+      counter mux_tunnel_failures;
+
+      histogram upstream_connect_time;
+      histogram encode_time;
+      histogram decode_time;
+   };
+
+   namespace details
+   {
+      inline void write_header(std::ostream& out,
+                               const char* name,
+                               const char* type,
+                               const char* help)
+      {
+         out << "# HELP " << name << ' ' << help << '\n'
+             << "# TYPE " << name << ' ' << type << '\n';
+      }
+
+      inline void write_counter(std::ostream& out,
+                                const std::vector<const registry*>& registries,
+                                counter registry::* member,
+                                const char* name,
+                                const char* labels = 0)
+      {
+         value_type total = 0;
+
+         for (std::size_t i = 0; i < registries.size(); ++i)
+         {
+            total += (registries[i]->*member).value();
+         }
+
+         out << name;
+
+         if (labels)
+         {
+            out << '{' << labels << '}';
+         }
+
+         out << ' ' << total << '\n';
+      }
+
+      inline void write_seconds(std::ostream& out, value_type nanoseconds)
+      {
+         out << nanoseconds / 1000000000u << '.';
+
+         std::string digits(9, '0');
+         value_type rest = nanoseconds % 1000000000u;
+
+         for (std::size_t i = digits.size(); i-- > 0; rest /= 10)
+         {
+            digits[i] = static_cast<char>('0' + rest % 10);
+         }
+
+         out << digits;
+      }
+
+      inline void write_histogram(std::ostream& out,
+                                  const std::vector<const registry*>& registries,
+                                  histogram registry::* member,
+                                  const char* name,
+                                  const char* help)
+      {
+         write_header(out, name, "histogram", help);
+
+         value_type cumulative = 0;
+
+         for (std::size_t b = 0; b < histogram::bucket_count; ++b)
+         {
+            for (std::size_t i = 0; i < registries.size(); ++i)
+            {
+               cumulative += (registries[i]->*member).bucket_value(b);
+            }
+
+            out << name << "_bucket{le=\"";
+            write_seconds(out, histogram::upper_bound(b));
+            out << "\"} " << cumulative << '\n';
+         }
+
+         value_type count = 0;
+         value_type sum = 0;
+
+         for (std::size_t i = 0; i < registries.size(); ++i)
+         {
+            count += (registries[i]->*member).count();
+            sum += (registries[i]->*member).sum();
+         }
+
+         // Observations made while the buckets were being read may be in
+         // either total but not the other; keep the two consistent.
+         count = std::max(count, cumulative);
+
+         out << name << "_bucket{le=\"+Inf\"} " << count << '\n'
+             << name << "_sum ";
+         write_seconds(out, sum);
+         out << '\n'
+             << name << "_count " << count << '\n';
+      }
+   }
+
+   // Writes the sum of the registries in the Prometheus text format. The
+   // number of active bridges and the bytes queued against the memory
+   // budget are gauges kept by the caller.
+   inline void write_prometheus(std::ostream& out,
+                                const std::vector<const registry*>& registries,
+                                value_type active_bridges,
+                                value_type queued_bytes,
+                                value_type memory_budget)
+   {
+      using namespace details;
+
+      write_header(out, "tcpproxy_bridges_accepted_total", "counter", "Connections accepted.");
+      write_counter(out, registries, &registry::bridges_accepted, "tcpproxy_bridges_accepted_total");
+
+      write_header(out, "tcpproxy_bridges_active", "gauge", "Bridges currently open.");
+      out << "tcpproxy_bridges_active " << active_bridges << '\n';
+
+      write_header(out, "tcpproxy_timeouts_total", "counter", "Connects and bridges that timed out, by kind.");
+      write_counter(out, registries, &registry::connect_timeouts, "tcpproxy_timeouts_total", "kind=\"connect\"");
+      write_counter(out, registries, &registry::idle_timeouts, "tcpproxy_timeouts_total", "kind=\"idle\"");
+      write_counter(out, registries, &registry::write_timeouts, "tcpproxy_timeouts_total", "kind=\"write\"");
+
+      write_header(out, "tcpproxy_queued_bytes", "gauge", "Bytes of buffers queued by all bridges.");
+      out << "tcpproxy_queued_bytes " << queued_bytes << '\n';
+
+      write_header(out, "tcpproxy_memory_budget_bytes", "gauge", "Queued bytes allowed before reads pause (0: no limit).");
+      out << "tcpproxy_memory_budget_bytes " << memory_budget << '\n';
+
+      write_header(out, "tcpproxy_read_pauses_total", "counter", "Times a bridge direction paused reading, by reason.");
+      write_counter(out, registries, &registry::watermark_pauses, "tcpproxy_read_pauses_total", "reason=\"watermark\"");
+      write_counter(out, registries, &registry::budget_pauses, "tcpproxy_read_pauses_total", "reason=\"budget\"");
+      write_counter(out, registries, &registry::rate_pauses, "tcpproxy_read_pauses_total", "reason=\"rate\"");
+
+      write_header(out, "tcpproxy_connections_rejected_total", "counter", "Clients turned away by the admission limits, by limit.");
+      write_counter(out, registries, &registry::rejected_max_bridges, "tcpproxy_connections_rejected_total", "limit=\"max_bridges\"");
+      write_counter(out, registries, &registry::rejected_per_source, "tcpproxy_connections_rejected_total", "limit=\"per_source\"");
+      write_counter(out, registries, &registry::rejected_rate, "tcpproxy_connections_rejected_total", "limit=\"rate\"");
+
+      write_header(out, "tcpproxy_upstream_connect_failures_total", "counter", "Failed connects to the remote server.");
+      write_counter(out, registries, &registry::upstream_connect_failures, "tcpproxy_upstream_connect_failures_total");
+
+      write_header(out, "tcpproxy_upstream_pool_hits_total", "counter", "Bridges given an established upstream connection.");
+      write_counter(out, registries, &registry::upstream_pool_hits, "tcpproxy_upstream_pool_hits_total");
+
+      write_header(out, "tcpproxy_upstream_pool_misses_total", "counter", "Bridges that found the upstream pool empty.");
+      write_counter(out, registries, &registry::upstream_pool_misses, "tcpproxy_upstream_pool_misses_total");
+
+      write_header(out, "tcpproxy_bytes_read_total", "counter", "Bytes read, by socket.");
+      write_counter(out, registries, &registry::plaintext_bytes_read, "tcpproxy_bytes_read_total", "socket=\"plaintext\"");
+      write_counter(out, registries, &registry::ciphertext_bytes_read, "tcpproxy_bytes_read_total", "socket=\"ciphertext\"");
+
+      write_header(out, "tcpproxy_bytes_written_total", "counter", "Bytes written, by socket.");
+      write_counter(out, registries, &registry::plaintext_bytes_written, "tcpproxy_bytes_written_total", "socket=\"plaintext\"");
+      write_counter(out, registries, &registry::ciphertext_bytes_written, "tcpproxy_bytes_written_total", "socket=\"ciphertext\"");
+
+      write_header(out, "tcpproxy_bytes_relayed_total", "counter", "Bytes forwarded untransformed, by direction.");
+      write_counter(out, registries, &registry::upstream_bytes_relayed, "tcpproxy_bytes_relayed_total", "direction=\"upstream\"");
+      write_counter(out, registries, &registry::downstream_bytes_relayed, "tcpproxy_bytes_relayed_total", "direction=\"downstream\"");
+
+      write_header(out, "tcpproxy_frames_encoded_total", "counter", "Frames encoded.");
+      write_counter(out, registries, &registry::frames_encoded, "tcpproxy_frames_encoded_total");
+
+      write_header(out, "tcpproxy_frames_decoded_total", "counter", "Frames decoded.");
+      write_counter(out, registries, &registry::frames_decoded, "tcpproxy_frames_decoded_total");
+
+      write_header(out, "tcpproxy_encode_errors_total", "counter", "Chunks that failed to encode.");
+      write_counter(out, registries, &registry::encode_errors, "tcpproxy_encode_errors_total");
+
+      write_header(out, "tcpproxy_decode_errors_total", "counter", "Frames that were invalid or too long.");
+      write_counter(out, registries, &registry::decode_errors, "tcpproxy_decode_errors_total");
+
+      write_header(out, "tcpproxy_compression_bytes_total", "counter", "Bytes into and out of the compressor.");
+      write_counter(out, registries, &registry::compression_bytes_in, "tcpproxy_compression_bytes_total", "stage=\"in\"");
+      write_counter(out, registries, &registry::compression_bytes_out, "tcpproxy_compression_bytes_total", "stage=\"out\"");
+
+      write_header(out, "tcpproxy_mux_streams_total", "counter", "Streams opened over mux tunnels.");
+      write_counter(out, registries, &registry::mux_streams, "tcpproxy_mux_streams_total");
+
+      write_header(out, "tcpproxy_mux_tunnel_failures_total", "counter", "Mux tunnels that failed, closing their streams.");
+      write_counter(out, registries, &registry::mux_tunnel_failures, "tcpproxy_mux_tunnel_failures_total");
+
+      write_histogram(out, registries, &registry::upstream_connect_time,
+                      "tcpproxy_upstream_connect_seconds", "Time to connect to the remote server.");
+      write_histogram(out, registries, &registry::encode_time,
+                      "tcpproxy_frame_encode_seconds", "Time to encode one frame.");
+      write_histogram(out, registries, &registry::decode_time,
+                      "tcpproxy_frame_decode_seconds", "Time to decode one frame.");
+   }
+}
+
+#endif
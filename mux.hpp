@@ -0,0 +1,129 @@
+//
+// mux.hpp
+// ~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Wire format of a multiplexed tunnel, which carries many client streams
+// over one connection between an encode and a decode proxy. A tunnel
+// opens with the mux preamble byte, followed by binary frames (and with
+// ChaCha20 the nonce frame first). Every frame's payload starts with a
+// header of the frame type and the stream ID, a LEB128 varint:
+//
+//    open    the encode end starts a stream, for which the decode end
+//            connects to the remote server
+//    data    a chunk of the stream, compressed when compression is on
+//    close   the sender is done with the stream and has forgotten it
+//    window  a varint of bytes the sender has written out since its last
+//            window frame, which the peer may send on the stream again
+//    end     the sender's side of the stream has ended, and no data
+//            follows; the peer shuts its socket down for sending once it
+//            has written what came before, and the stream stays open the
+//            other way until that side ends too
+//
+// Each end may have at most the peer's window of data in flight on each
+// stream, so a stream whose peer is slow to read stalls on its own,
+// without holding up the others. Each end announces the window its streams
+// give in a window frame for stream 0, which follows the preamble (and the
+// nonce); streams don't send until it has arrived. Stream IDs are never
+// reused within a tunnel, so frames for a stream that has been closed are
+// dropped.
+//
+
+
+#ifndef INCLUDE_MUX_HPP
+#define INCLUDE_MUX_HPP
+
+
+#include <cstddef>
+
+#include <boost/cstdint.hpp>
+
+
+namespace tcp_proxy
+{
+   namespace mux
+   {
+      typedef boost::uint64_t stream_id;
+
+      enum frame_type
+      {
+         frame_open   = 1,
+         frame_data   = 2,
+         frame_close  = 3,
+         frame_window = 4,
+         frame_end    = 5
+      };
+
+      // Stream 0 stands for the tunnel itself; streams are numbered from 1.
+      const stream_id tunnel_stream = 0;
+
+      // First byte of a tunnel, which starts neither a Base64 line nor a
+      // binary stream.
+      const unsigned char preamble = 1;
+
+      enum {
+         max_varint_length = 10,
+         max_header_length = 1 + max_varint_length
+      };
+
+      inline std::size_t write_varint(unsigned char* out, boost::uint64_t value)
+      {
+         std::size_t n = 0;
+
+         while (value >= 0x80)
+         {
+            out[n++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+         }
+
+         out[n++] = static_cast<unsigned char>(value);
+         return n;
+      }
+
+      // Reads a varint from the front of length bytes. Returns the bytes
+      // it took, or 0 if it is malformed or cut short.
+      inline std::size_t read_varint(const unsigned char* in, std::size_t length, boost::uint64_t& value)
+      {
+         value = 0;
+
+         for (std::size_t n = 0; n < length && n < max_varint_length; ++n)
+         {
+            value |= static_cast<boost::uint64_t>(in[n] & 0x7f) << (7 * n);
+
+            if ((in[n] & 0x80) == 0)
+            {
+               return n + 1;
+            }
+         }
+
+         return 0;
+      }
+
+      inline std::size_t write_header(unsigned char* out, frame_type type, stream_id id)
+      {
+         out[0] = static_cast<unsigned char>(type);
+         return 1 + write_varint(out + 1, id);
+      }
+
+      // Parses the header at the front of a frame's payload. Returns the
+      // bytes it took, or 0 if it is malformed.
+      inline std::size_t read_header(const unsigned char* in, std::size_t length,
+                                     frame_type& type, stream_id& id)
+      {
+         if (length < 2 || in[0] < frame_open || in[0] > frame_end)
+         {
+            return 0;
+         }
+
+         type = static_cast<frame_type>(in[0]);
+         const std::size_t n = read_varint(in + 1, length - 1, id);
+         return (n == 0) ? 0 : 1 + n;
+      }
+   }
+}
+
+#endif
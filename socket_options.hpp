@@ -0,0 +1,191 @@
+//
+// socket_options.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// TCP options for the sockets of one side of the bridges: the accepted
+// client connections (downstream) or the connections to the remote
+// servers (upstream).
+//
+// Buffer sizes are set on the listening socket, which accepted sockets
+// inherit them from, and on an upstream socket before it connects, since
+// the kernel picks the window scale during the handshake. Everything else
+// is set once the connection is up. TCP_QUICKACK and TCP_CORK are Linux
+// only; the kernel drops out of quick ack mode by itself, so the bridge
+// sets TCP_QUICKACK again after every read.
+//
+
+
+#ifndef INCLUDE_SOCKET_OPTIONS_HPP
+#define INCLUDE_SOCKET_OPTIONS_HPP
+
+
+#include <cstddef>
+#include <string>
+
+#include <boost/asio.hpp>
+
+
+namespace tcp_proxy
+{
+   struct socket_options
+   {
+      socket_options()
+      : nodelay(true),
+        send_buffer(0),
+        receive_buffer(0),
+        keepalive_idle(0),
+        keepalive_interval(0),
+        keepalive_count(0),
+        quickack(false),
+        cork(false)
+      {}
+
+      // Send every frame as soon as it is written, rather than waiting for
+      // the ACK of what is in flight.
+      bool nodelay;
+
+      // SO_SNDBUF and SO_RCVBUF (0: the system's default, which it tunes).
+      std::size_t send_buffer;
+      std::size_t receive_buffer;
+
+      // Seconds of silence before keepalive probes start (0: no probes),
+      // seconds between probes and unanswered probes before the connection
+      // is dropped (0: the system's default).
+      std::size_t keepalive_idle;
+      std::size_t keepalive_interval;
+      std::size_t keepalive_count;
+
+      // ACK every segment at once instead of delaying the ACKs, and only
+      // send full segments, holding back a partial one for up to 200ms.
+      bool quickack;
+      bool cork;
+   };
+
+   // Options this platform has, for option parsing.
+   inline bool socket_option_supported(const std::string& name)
+   {
+      if (name == "nodelay"        || name == "send_buffer"    ||
+          name == "receive_buffer" || name == "keepalive_idle")
+      {
+         return true;
+      }
+   #ifdef TCP_KEEPINTVL
+      else if (name == "keepalive_interval")
+      {
+         return true;
+      }
+   #endif
+   #ifdef TCP_KEEPCNT
+      else if (name == "keepalive_count")
+      {
+         return true;
+      }
+   #endif
+   #ifdef TCP_QUICKACK
+      else if (name == "quickack")
+      {
+         return true;
+      }
+   #endif
+   #ifdef TCP_CORK
+      else if (name == "cork")
+      {
+         return true;
+      }
+   #endif
+
+      return false;
+   }
+
+   namespace details
+   {
+      template <int Level, int Name, typename Socket>
+      inline void set_integer(Socket& socket, std::size_t value, boost::system::error_code& ec)
+      {
+         socket.set_option(boost::asio::detail::socket_option::integer<Level, Name>(static_cast<int>(value)), ec);
+      }
+   }
+
+   // Buffer sizes, for a listening socket or a socket that is yet to
+   // connect.
+   template <typename Socket>
+   inline void apply_buffer_options(Socket& socket, const socket_options& options, boost::system::error_code& ec)
+   {
+      if (options.send_buffer && !ec)
+      {
+         socket.set_option(boost::asio::socket_base::send_buffer_size(static_cast<int>(options.send_buffer)), ec);
+      }
+
+      if (options.receive_buffer && !ec)
+      {
+         socket.set_option(boost::asio::socket_base::receive_buffer_size(static_cast<int>(options.receive_buffer)), ec);
+      }
+   }
+
+   // The options of a connection that is up. A socket whose peer has
+   // already gone may refuse them, which the bridge finds out from its
+   // first read or write anyway.
+   inline void apply_socket_options(boost::asio::ip::tcp::socket& socket, const socket_options& options)
+   {
+      boost::system::error_code ec;
+
+      socket.set_option(boost::asio::ip::tcp::no_delay(options.nodelay), ec);
+
+      if (options.keepalive_idle)
+      {
+         socket.set_option(boost::asio::socket_base::keep_alive(true), ec);
+
+      #if defined(TCP_KEEPIDLE)
+         details::set_integer<IPPROTO_TCP, TCP_KEEPIDLE>(socket, options.keepalive_idle, ec);
+      #elif defined(TCP_KEEPALIVE)
+         details::set_integer<IPPROTO_TCP, TCP_KEEPALIVE>(socket, options.keepalive_idle, ec);
+      #endif
+
+      #ifdef TCP_KEEPINTVL
+         if (options.keepalive_interval)
+         {
+            details::set_integer<IPPROTO_TCP, TCP_KEEPINTVL>(socket, options.keepalive_interval, ec);
+         }
+      #endif
+
+      #ifdef TCP_KEEPCNT
+         if (options.keepalive_count)
+         {
+            details::set_integer<IPPROTO_TCP, TCP_KEEPCNT>(socket, options.keepalive_count, ec);
+         }
+      #endif
+      }
+
+   #ifdef TCP_QUICKACK
+      if (options.quickack)
+      {
+         details::set_integer<IPPROTO_TCP, TCP_QUICKACK>(socket, 1, ec);
+      }
+   #endif
+
+   #ifdef TCP_CORK
+      if (options.cork)
+      {
+         details::set_integer<IPPROTO_TCP, TCP_CORK>(socket, 1, ec);
+      }
+   #endif
+   }
+
+   // Puts the socket back into quick ack mode after a read.
+   inline void rearm_quickack(boost::asio::ip::tcp::socket& socket)
+   {
+   #ifdef TCP_QUICKACK
+      boost::system::error_code ec;
+      details::set_integer<IPPROTO_TCP, TCP_QUICKACK>(socket, 1, ec);
+   #else
+      (void)socket;
+   #endif
+   }
+}
+
+#endif
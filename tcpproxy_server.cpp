@@ -46,18 +46,61 @@
 //
 
 
+#include <algorithm>
+#include <csignal>
 #include <cstdlib>
 #include <cstddef>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
+#include <boost/array.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "TurboBase64/turbob64.h"
+#include "admission.hpp"
+#include "affinity.hpp"
+#include "backends.hpp"
+#include "buffer_pool.hpp"
+#include "chacha20.hpp"
+#include "compression.hpp"
+#include "coroutines.hpp"
+#include "frame_ring.hpp"
+#include "handler_memory.hpp"
+#include "handoff.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "mux.hpp"
+#include "socket_options.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+#include "upstream_pool.hpp"
+#include "uring.hpp"
+#include "xorb64.hpp"
+
+// Pass-through bridges move data with splice() where the platform has it.
+#if defined(__linux__) && !defined(TCP_PROXY_NO_SPLICE)
+   #define TCP_PROXY_SPLICE
+   #include <cerrno>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
 
 
 namespace tcp_proxy
@@ -70,416 +113,7317 @@ namespace tcp_proxy
    // meant to encode).
    bool g_encode = false;
 
-   class bridge : public boost::enable_shared_from_this<bridge>
+   // Forward the bytes untouched, in both directions.
+   bool g_passthrough = false;
+
+   enum balance_policy
    {
-   public:
+      balance_round_robin,
+      balance_least_load,
+      // Each acceptor keeps the connections it accepts on its own loop.
+      balance_local
+   };
 
-      typedef ip::tcp::socket socket_type;
-      typedef boost::shared_ptr<bridge> ptr_type;
+   // Wire format of the encoded side. Binary frames are a varint length
+   // and the XORed payload, and a binary stream starts with a preamble byte
+   // that no Base64 line does, so that the receiving end can tell. The
+   // connecting end sends binary frames if told to; the accepting end
+   // answers in whichever framing arrives, if it is allowed binary frames.
+   enum framing_type
+   {
+      framing_base64,
+      framing_binary,
+
+      // A bridge's framing while it waits for the peer's first byte.
+      framing_pending
+   };
+
+   // What hides the payload of every frame. ChaCha20 streams are keyed
+   // from a key file both ends share; each end opens the stream it sends
+   // with a frame carrying a fresh nonce, which is sent in the clear.
+   enum cipher_type
+   {
+      cipher_xor,
+      cipher_chacha20
+   };
+
+   enum io_engine_type
+   {
+      io_engine_reactor,
+      io_engine_uring,
+      io_engine_coroutine
+   };
+
+   // A remote server given by host name rather than address.
+   struct server_name
+   {
+      std::string host;
+      unsigned short port;
+   };
+
+   struct config
+   {
+      config()
+      : local_port(0),
+        drain_timeout(0),
+        threads(boost::thread::hardware_concurrency()),
+        balance(balance_round_robin),
+        acceptors(1),
+        pending_accepts(1),
+        chunk_size(8192),
+        max_chunk_size(0),
+        adaptive_chunks(false),
+        max_in_flight(0),
+        low_watermark(0),
+        memory_budget_bytes(0),
+        coalesce_bytes(8192),
+        coalesce_delay(0),
+        buffer_cache(64 * 1024 * 1024),
+        bridge_cache(65536),
+        backend_balance(backend_round_robin),
+        eject_after(3),
+        eject_time(10),
+        dns_refresh(30),
+        upstream_pool(0),
+        upstream_idle_timeout(30),
+        connect_timeout(10),
+        idle_timeout(0),
+        write_timeout(60),
+        framing(framing_base64),
+        compression(compression_off),
+        compression_level(0),
+        cipher(cipher_xor),
+        mux(false),
+        mux_tunnels(1),
+        mux_window(256 * 1024),
+        io_engine(io_engine_reactor),
+        uring_entries(4096),
+        uring_buffers(1024),
+        metrics_port(0),
+        trace_sample(0),
+        trace_buffer(4096)
+      {
+         if (threads == 0)
+         {
+            threads = 1;
+         }
+      }
+
+      // Where clients are accepted, the remote server they are forwarded
+      // to, and encode, decode or passthrough. A forward host given by name
+      // is in forward_name, with its port in forward.
+      std::string local_host;
+      unsigned short local_port;
+      ip::tcp::endpoint forward;
+      std::string forward_name;
+      std::string direction;
+
+      // File of further options, which SIGHUP reads again.
+      std::string config_file;
+
+      // Unix socket a newer process takes the listening sockets over from,
+      // after which this one closes once its bridges have finished, or
+      // drain_timeout seconds later (0: however long they last).
+      std::string handoff_path;
+      std::size_t drain_timeout;
+
+      // Number of I/O loops (one io_service and one thread each).
+      std::size_t threads;
+
+      // How the acceptor picks the loop for a new bridge.
+      balance_policy balance;
+
+      // Number of listening sockets bound to the local port. More than one
+      // uses SO_REUSEPORT, with the acceptors spread over the loops.
+      std::size_t acceptors;
+
+      // CPUs the loops are pinned to, loop i to cpus[i % cpus.size()];
+      // empty, the loops are not pinned.
+      std::vector<int> cpus;
+
+      // Number of async_accept operations kept outstanding per acceptor.
+      std::size_t pending_accepts;
 
-      bridge(boost::asio::io_service& ios)
-      : downstream_socket_(ios),
-        upstream_socket_  (ios)
+      // Clients let in, and the byte rate of their bridges.
+      admission_limits limits;
+
+      // TCP options of the accepted client connections and of the
+      // connections to the remote servers.
+      socket_options downstream_options;
+      socket_options upstream_options;
+
+      // Bytes read from the plaintext socket at a time, each becoming one
+      // frame. Adaptive chunks start at chunk_size and are resized to what
+      // the reads deliver, up to max_chunk_size. The peer must be given the
+      // same max_chunk_size, since that is also the largest binary or
+      // compressed frame decoded. A max_chunk_size of 0 means the same as
+      // chunk_size.
+      std::size_t chunk_size;
+      std::size_t max_chunk_size;
+      bool adaptive_chunks;
+
+      // Bytes per direction that may be read and transformed ahead of the
+      // write to the other side. A bound of 0 means two chunks. Once a
+      // direction reaches it, its reads stay paused until its writes have
+      // drained it to low_watermark, 0 meaning half of max_in_flight.
+      std::size_t max_in_flight;
+      std::size_t low_watermark;
+
+      // Bytes of queued chunks all bridges together may hold before those
+      // with something queued stop reading (0: no limit).
+      std::size_t memory_budget_bytes;
+
+      // Encoded frames are held back for up to coalesce_delay microseconds
+      // while less than coalesce_bytes is queued, so that they go out in
+      // fewer writes. A delay of 0 writes them as soon as possible.
+      std::size_t coalesce_bytes;
+      std::size_t coalesce_delay;
+
+      // Bytes of free buffers, and number of free bridge blocks, each loop
+      // keeps for reuse instead of returning them to the heap.
+      std::size_t buffer_cache;
+      std::size_t bridge_cache;
+
+      // Remote servers in addition to the forward host, by address and by
+      // name.
+      std::vector<ip::tcp::endpoint> backends;
+      std::vector<server_name> backend_names;
+
+      // How a remote server is picked for each bridge, and how many connect
+      // failures in a row take a server out of the rotation for how many
+      // seconds. An eject_after of 0 never ejects.
+      backend_policy backend_balance;
+      std::size_t eject_after;
+      std::size_t eject_time;
+
+      // Seconds between lookups of the servers given by name; 0 looks them
+      // up once, at startup or when they are added.
+      std::size_t dns_refresh;
+
+      // Connections to the remote server each loop keeps established ahead
+      // of the clients that will use them, and the seconds an unused one is
+      // kept before it is replaced. A pool of 0 connects per client.
+      std::size_t upstream_pool;
+      std::size_t upstream_idle_timeout;
+
+      // Seconds a bridge may take to connect to the remote server, go
+      // without reading from either side, or wait on a write before it is
+      // closed (0: no limit). A timed out connect is retried like a failed
+      // one.
+      std::size_t connect_timeout;
+      std::size_t idle_timeout;
+      std::size_t write_timeout;
+
+      // Framing of the encoded side, which both ends must be given.
+      framing_type framing;
+
+      // Codec chunks are compressed with before they are framed, its level
+      // (0: the codec's default) and, for zstd, a trained dictionary. Both
+      // ends must have compression on, with the same dictionary if any.
+      compression_type compression;
+      std::size_t compression_level;
+      std::string compression_dictionary;
+
+      // Cipher applied to the framed data, and the file of the ChaCha20
+      // key, which both ends must be given.
+      cipher_type cipher;
+      std::string cipher_key_file;
+
+      // Carry the clients' streams over a few shared tunnels between the
+      // encode and decode ends, both of which must have mux on. The encode
+      // end keeps mux_tunnels tunnels per loop; mux_window is the bytes
+      // each stream may have in flight in each direction.
+      bool mux;
+      std::size_t mux_tunnels;
+      std::size_t mux_window;
+
+      // How the bridges' sockets are read and written: asio's reactor,
+      // io_uring with multishot receives into uring_buffers chunk sized
+      // buffers per loop, registered with the kernel, or coroutines over
+      // the reactor. uring_entries is the submission queue size of each
+      // loop's ring.
+      io_engine_type io_engine;
+      std::size_t uring_entries;
+      std::size_t uring_buffers;
+
+      // Address of the HTTP metrics endpoint; a port of 0 disables it.
+      std::string metrics_host;
+      unsigned short metrics_port;
+
+      // One bridge in trace_sample is traced (0: none), and each loop keeps
+      // the last trace_buffer records for GET /traces.
+      std::size_t trace_sample;
+      std::size_t trace_buffer;
+   };
+
+   // Free list of equally sized blocks, from which the bridges of one loop
+   // are allocated so that connection churn does not go through malloc.
+   // Blocks are taken by an acceptor's thread and returned on the bridge's
+   // loop, hence the lock; both happen once per connection.
+   class slab : private boost::noncopyable
+   {
+   public:
+
+      explicit slab(std::size_t max_cached_blocks)
+      : max_cached_blocks_(max_cached_blocks),
+        block_size_(0)
       {}
 
-      socket_type& downstream_socket()
+      ~slab()
       {
-         // Client socket
-         return downstream_socket_;
+         for (std::size_t i = 0; i < free_.size(); ++i)
+         {
+            ::operator delete(free_[i]);
+         }
       }
 
-      socket_type& upstream_socket()
+      void* allocate(std::size_t size)
       {
-         // Remote server socket
-         return upstream_socket_;
+         {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            if (block_size_ == 0)
+            {
+               block_size_ = size;
+            }
+
+            if (size == block_size_ && !free_.empty())
+            {
+               void* block = free_.back();
+               free_.pop_back();
+               return block;
+            }
+         }
+
+         return ::operator new(size);
       }
 
-      socket_type& ciphertext_socket()
+      void deallocate(void* block, std::size_t size)
       {
-         return g_encode ? upstream_socket_ : downstream_socket_;
+         {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            if (size == block_size_ && free_.size() < max_cached_blocks_)
+            {
+               free_.push_back(block);
+               return;
+            }
+         }
+
+         ::operator delete(block);
       }
 
-      socket_type& plaintext_socket()
+   private:
+
+      std::size_t max_cached_blocks_;
+      std::size_t block_size_;
+      std::vector<void*> free_;
+      boost::mutex mutex_;
+   };
+
+   // Allocator over a slab, for boost::allocate_shared.
+   template <typename T>
+   class slab_allocator
+   {
+   public:
+
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef std::size_t size_type;
+      typedef std::ptrdiff_t difference_type;
+
+      template <typename U>
+      struct rebind
       {
-         return g_encode ? downstream_socket_ : upstream_socket_;
+         typedef slab_allocator<U> other;
+      };
+
+      explicit slab_allocator(slab& s)
+      : slab_(&s)
+      {}
+
+      template <typename U>
+      slab_allocator(const slab_allocator<U>& other)
+      : slab_(other.slab_)
+      {}
+
+      pointer allocate(size_type n, const void* = 0)
+      {
+         return static_cast<pointer>(slab_->allocate(n * sizeof(T)));
       }
 
-      void start(const std::string& upstream_host, unsigned short upstream_port)
+      void deallocate(pointer p, size_type n)
       {
-         // Attempt connection to remote server (upstream side)
-         upstream_socket_.async_connect(
-              ip::tcp::endpoint(
-                   boost::asio::ip::address::from_string(upstream_host),
-                   upstream_port),
-              boost::bind(&bridge::handle_upstream_connect,
-                   shared_from_this(),
-                   boost::asio::placeholders::error));
+         slab_->deallocate(p, n * sizeof(T));
       }
 
-      void handle_upstream_connect(const boost::system::error_code& error)
+      void construct(pointer p, const T& value)
       {
-         if (!error)
-         {
-            boost::asio::async_read_until(
-                 ciphertext_socket(),
-                 ciphertext_buffer_,
-                 b64_terminator,
-                 boost::bind(&bridge::handle_ciphertext_read,
-                      shared_from_this(),
-                      boost::asio::placeholders::error,
-                      boost::asio::placeholders::bytes_transferred));
+         ::new(static_cast<void*>(p)) T(value);
+      }
 
-            plaintext_socket().async_read_some(
-                 boost::asio::buffer(plaintext_data_,max_data_length),
-                 boost::bind(&bridge::handle_plaintext_read,
-                      shared_from_this(),
-                      boost::asio::placeholders::error,
-                      boost::asio::placeholders::bytes_transferred));
-         }
-         else
-         {
-            std::cerr << "upstream connect fail" << error << "\n";
-            close();
-         }
+      void destroy(pointer p)
+      {
+         p->~T();
       }
 
-   private:
-      static const char b64_terminator = '\n';
+      size_type max_size() const
+      {
+         return static_cast<size_type>(-1) / sizeof(T);
+      }
 
-      bool encrypt(unsigned char* const data,
-                   const size_t length,
-                   unsigned char* const processed,
-                   size_t& processed_length)
+      pointer address(reference r) const
       {
-      #ifdef PRINT_DATA
-         std::cout << "Received " << std::string((const char*)data, length) << "\n";
-      #endif
-         for (size_t i = 0; i < length; ++i)
-         {
-            data[i] ^= kKey;
-         }
-         processed_length = tb64enc(data, length, processed);
-         if (processed_length <= 0)
-         {
-            return false;
-         }
-         processed[processed_length] = b64_terminator;
-         ++processed_length;
-      #ifdef PRINT_DATA
-         std::cout << "Send " << std::string((const char*)processed, processed_length) << "\n";
-      #endif
-         return true;
+         return &r;
       }
 
-      bool decrypt(unsigned char* const data,
-                   size_t length,
-                   unsigned char* const processed,
-                   size_t& processed_length)
+      const_pointer address(const_reference r) const
       {
-      #ifdef PRINT_DATA
-         std::cout << "Received " << std::string((const char*)data, length) << "\n";
-      #endif
-         if (length == 0)
-         {
-            return false;
-         }
-         --length;
-         if (data[length] != b64_terminator)
-         {
-            return false;
-         }
-         processed_length = tb64dec(data, length, processed);
-         if (processed_length <= 0)
-         {
-            return false;
-         }
-         for (size_t i = 0; i < processed_length; ++i)
-         {
-            processed[i] ^= kKey;
-         }
-      #ifdef PRINT_DATA
-         std::cout << "Send " << std::string((const char*)processed, processed_length) << "\n";
-      #endif
-         return true;
+         return &r;
+      }
+
+      template <typename U>
+      bool operator==(const slab_allocator<U>& other) const
+      {
+         return slab_ == other.slab_;
       }
 
+      template <typename U>
+      bool operator!=(const slab_allocator<U>& other) const
+      {
+         return slab_ != other.slab_;
+      }
 
-      /*
-         Section A: Remote Server --> Proxy --> Client
-         Process data recieved from remote sever then send to client.
-      */
+      slab* slab_;
+   };
 
-      // Read from remote server complete, now send data to client
-      void handle_ciphertext_read(const boost::system::error_code& error,
-                                  const size_t& bytes_transferred)
+   class mux_pool;
+
+   // A set of single-threaded event loops. Every bridge is bound to exactly
+   // one loop for its whole life, so its handlers never run concurrently and
+   // need no locking. The acceptor picks the loop for each new bridge.
+   class io_service_pool : private boost::noncopyable
+   {
+   public:
+
+      struct worker : private boost::noncopyable
       {
-         if (!error)
+         worker(const config& config, memory_budget& budget, int cpu)
+         : settings(config),
+           cpu(cpu),
+           budget(budget),
+           buffers(config.buffer_cache),
+           bridges(config.bridge_cache),
+           work(io_service),
+           timers(io_service, timer_tick_milliseconds),
+           traces(config.trace_sample ? config.trace_buffer : 0),
+           traced_bridges(0),
+           active_bridges(0),
+           upstreams_stopped(false)
          {
-            size_t bytes_to_send;
-            if (bytes_transferred > max_encoded_data_length)
+         #ifdef TCP_PROXY_IO_URING
+            if (config.io_engine == io_engine_uring)
             {
-               std::cerr << "ciphertext is too long\n";
-               close();
+               ring.reset(new uring(io_service, buffers,
+                                    static_cast<unsigned>(config.uring_entries),
+                                    config.uring_buffers,
+                                    config.chunk_size));
             }
-            if (!std::istream(&ciphertext_buffer_).read((char*)ciphertext_data_, bytes_transferred))
+         #endif
+         }
+
+         // The pool for a remote server, made on first use of a server
+         // added, or put in another's place, since the loop last caught up
+         // with the set.
+         upstream_pool& upstream(backend_set& backends, const backend& target)
+         {
+            if (target.index() >= upstreams.size() ||
+                &upstreams[target.index()]->target() != &target)
             {
-               std::cerr << "consume ciphertext fail\n";
-               close();
+               sync_upstreams(backends);
             }
-            else if (!decrypt(ciphertext_data_,bytes_transferred,ciphertext_decoded_data_,bytes_to_send))
+
+            return *upstreams[target.index()];
+         }
+
+         // Makes the pools of the servers added to the set, points those of
+         // servers replaced at the new ones, and stops or starts again those
+         // of servers retired or brought back. None is started again once
+         // the upstreams are stopped. From the loop's thread, or before it
+         // runs.
+         void sync_upstreams(backend_set& backends)
+         {
+            for (std::size_t i = upstreams.size(); i < backends.size(); ++i)
             {
-               std::cerr << "decrypt fail " << std::string((const char*)ciphertext_data_, bytes_transferred) << "\n";
-               close();
+               upstreams.push_back(boost::shared_ptr<upstream_pool>(
+                    new upstream_pool(io_service, backends, backends.get(i),
+                                      settings.upstream_pool, settings.upstream_idle_timeout,
+                                      settings.upstream_options)));
             }
-            else
+
+            for (std::size_t i = 0; i < upstreams.size(); ++i)
             {
-               async_write(plaintext_socket(),
-                    boost::asio::buffer(ciphertext_decoded_data_,bytes_to_send),
-                    boost::bind(&bridge::handle_plaintext_write,
-                         shared_from_this(),
-                         boost::asio::placeholders::error));
+               if (&upstreams[i]->target() != &backends.get(i))
+               {
+                  upstreams[i]->stop();
+                  upstreams[i]->retarget(backends.get(i));
+               }
+
+               if (backends.get(i).retired() || upstreams_stopped)
+               {
+                  upstreams[i]->stop();
+               }
+               else
+               {
+                  upstreams[i]->start();
+               }
             }
          }
-         else
+
+         // Id of a new bridge to trace, or 0 for one not sampled. Called
+         // from the accepting loop's thread, which may be another loop's.
+         metrics::value_type sample_trace()
          {
-            if (error != boost::asio::error::eof &&
-                error != boost::asio::error::operation_aborted &&
-                error != boost::asio::error::connection_reset)
+            if (!traces.enabled())
             {
-               std::cerr << "ciphertext read fail " << error << "\n";
+               return 0;
             }
-            close();
-         }
-      }
 
-      // Write to client complete, Async read from remote server
-      void handle_plaintext_write(const boost::system::error_code& error)
-      {
-         if (!error)
-         {
-            boost::asio::async_read_until(
-                 ciphertext_socket(),
-                 ciphertext_buffer_,
-                 b64_terminator,
-                 boost::bind(&bridge::handle_ciphertext_read,
-                      shared_from_this(),
-                      boost::asio::placeholders::error,
-                      boost::asio::placeholders::bytes_transferred));
+            const metrics::value_type n = traced_bridges.fetch_add(1, boost::memory_order_relaxed) + 1;
+
+            if (n % settings.trace_sample != 0)
+            {
+               return 0;
+            }
+
+            return n / settings.trace_sample;
          }
-         else
+
+         // Keeps no connections ready once the clients go to a newer
+         // process.
+         void stop_upstreams()
          {
-            if (error != boost::asio::error::connection_reset)
+            upstreams_stopped = true;
+
+            for (std::size_t i = 0; i < upstreams.size(); ++i)
             {
-               std::cerr << "plaintext write fail " << error << "\n";
+               upstreams[i]->stop();
             }
-            close();
          }
-      }
-      // *** End Of Section A ***
 
+         const config& settings;
 
-      /*
-         Section B: Client --> Proxy --> Remove Server
-         Process data recieved from client then write to remove server.
-      */
+         // CPU the loop is pinned to, or -1.
+         int cpu;
 
-      // Read from client complete, now send data to remote server
-      void handle_plaintext_read(const boost::system::error_code& error,
-                                 const size_t& bytes_transferred)
+         // Shared by every loop.
+         memory_budget& budget;
+
+         // Declared ahead of the io_service so that they outlive the
+         // bridges destroyed along with its pending handlers.
+         buffer_pool buffers;
+         slab bridges;
+
+         // Only updated from this loop's thread.
+         metrics::registry metrics;
+
+         boost::asio::io_service io_service;
+         boost::asio::io_service::work work;
+
+         // The bridges' timeouts, which need no finer resolution.
+         enum { timer_tick_milliseconds = 100 };
+         timer_wheel timers;
+
+      #ifdef TCP_PROXY_IO_URING
+         // Null unless the bridges use io_uring.
+         boost::shared_ptr<uring> ring;
+      #endif
+
+         // Null unless compression is on.
+         boost::shared_ptr<tcp_proxy::compressor> compression;
+
+         // Null unless the frames are encrypted with ChaCha20, and the
+         // source of the nonces the bridges open their streams with.
+         boost::shared_ptr<const chacha20::key> cipher_key;
+         chacha20::stream nonces;
+
+         // One pool per remote server, by backend index, for the servers
+         // the loop has caught up with.
+         std::vector<boost::shared_ptr<upstream_pool> > upstreams;
+
+         // Null unless this is the encode end of mux tunnels.
+         boost::shared_ptr<mux_pool> mux;
+
+         // Finished traces of the sampled bridges, and the bridges counted
+         // towards the next sample, by every acceptor.
+         metrics::trace_ring traces;
+         boost::atomic<metrics::value_type> traced_bridges;
+
+         boost::atomic<std::size_t> active_bridges;
+
+         // Set by stop_upstreams(), for good.
+         bool upstreams_stopped;
+      };
+
+      explicit io_service_pool(const config& config)
+      : budget_(config.memory_budget_bytes),
+        policy_(config.balance),
+        next_(0)
       {
-         if (!error)
+         for (std::size_t i = 0; i < config.threads; ++i)
          {
-            bool result;
-            size_t bytes_to_send;
-            result = encrypt(plaintext_data_,bytes_transferred,plaintext_encoded_data_,bytes_to_send);
-            if (!result)
+            if (config.cpus.empty())
             {
-               std::cerr << "encrypt fail " << std::string((const char*)plaintext_data_, bytes_transferred) << "\n";
-               close();
+               workers_.push_back(boost::shared_ptr<worker>(new worker(config, budget_, -1)));
             }
             else
             {
-               async_write(ciphertext_socket(),
-                     boost::asio::buffer(plaintext_encoded_data_,bytes_to_send),
-                     boost::bind(&bridge::handle_ciphertext_write,
-                           shared_from_this(),
-                           boost::asio::placeholders::error));
+               workers_.push_back(make_pinned_worker(config, config.cpus[i % config.cpus.size()]));
             }
          }
-         else
-         {
-            if (error != boost::asio::error::eof &&
-                error != boost::asio::error::operation_aborted &&
-                error != boost::asio::error::connection_reset)
-            {
-               std::cerr << "plaintext read fail " << error << "\n";
-            }
-            close();
-         }
       }
 
-      // Write to remote server complete, Async read from client
-      void handle_ciphertext_write(const boost::system::error_code& error)
+      std::size_t size() const
       {
-         if (!error)
+         return workers_.size();
+      }
+
+      worker& get_worker(std::size_t i)
+      {
+         return *workers_[i % workers_.size()];
+      }
+
+      // Loop that the next bridge accepted on the given loop should be
+      // bound to.
+      worker& next_worker(worker& accepting)
+      {
+         if (policy_ == balance_local)
          {
-            plaintext_socket().async_read_some(
-                 boost::asio::buffer(plaintext_data_,max_data_length),
-                 boost::bind(&bridge::handle_plaintext_read,
-                      shared_from_this(),
-                      boost::asio::placeholders::error,
-                      boost::asio::placeholders::bytes_transferred));
+            return accepting;
          }
-         else
+
+         if (policy_ == balance_least_load)
          {
-            if (error != boost::asio::error::connection_reset)
+            std::size_t best = 0;
+
+            for (std::size_t i = 1; i < workers_.size(); ++i)
             {
-               std::cerr << "ciphertext write fail " << error << "\n";
+               if (workers_[i]->active_bridges < workers_[best]->active_bridges)
+               {
+                  best = i;
+               }
             }
-            close();
+
+            return *workers_[best];
          }
+
+         return *workers_[next_++ % workers_.size()];
       }
-      // *** End Of Section B ***
 
-      void close()
+      // Runs every loop on its own thread and blocks until all have stopped.
+      void run()
       {
-         boost::mutex::scoped_lock lock(mutex_);
+         boost::thread_group threads;
 
-         if (downstream_socket_.is_open())
+         for (std::size_t i = 0; i < workers_.size(); ++i)
          {
-            downstream_socket_.close();
+            threads.create_thread(
+                 boost::bind(&io_service_pool::run_worker, workers_[i]));
          }
 
-         if (upstream_socket_.is_open())
+         threads.join_all();
+      }
+
+      void stop()
+      {
+         for (std::size_t i = 0; i < workers_.size(); ++i)
          {
-            upstream_socket_.close();
+            workers_[i]->io_service.stop();
          }
       }
 
-      socket_type downstream_socket_;
-      socket_type upstream_socket_;
+      void stop_upstreams()
+      {
+         for (std::size_t i = 0; i < workers_.size(); ++i)
+         {
+            workers_[i]->io_service.post(
+                 boost::bind(&worker::stop_upstreams, workers_[i].get()));
+         }
+      }
 
-      enum {
-         max_data_length = 8192, //8KB
-         max_encoded_data_length = TB64ENCLEN(max_data_length) + 1
-      };
-      boost::asio::streambuf ciphertext_buffer_;
-      unsigned char plaintext_data_[max_data_length];
-      unsigned char plaintext_encoded_data_[max_encoded_data_length];
-      unsigned char ciphertext_data_[max_encoded_data_length];
-      unsigned char ciphertext_decoded_data_[max_data_length];
+      // Safe to call from any thread, like write_metrics().
+      std::size_t active_bridges() const
+      {
+         std::size_t total = 0;
 
-      boost::mutex mutex_;
+         for (std::size_t i = 0; i < workers_.size(); ++i)
+         {
+            total += workers_[i]->active_bridges;
+         }
 
-   public:
+         return total;
+      }
 
-      class acceptor
+      // Renders every loop's metrics summed together. Safe to call from
+      // any thread.
+      void write_metrics(std::ostream& out) const
       {
-      public:
+         std::vector<const metrics::registry*> registries;
+         metrics::value_type active_bridges = 0;
 
-         acceptor(boost::asio::io_service& io_service,
-                  const std::string& local_host, unsigned short local_port,
-                  const std::string& upstream_host, unsigned short upstream_port)
-         : io_service_(io_service),
-           localhost_address(boost::asio::ip::address_v4::from_string(local_host)),
-           acceptor_(io_service_,ip::tcp::endpoint(localhost_address,local_port)),
-           upstream_port_(upstream_port),
-           upstream_host_(upstream_host)
-         {}
+         for (std::size_t i = 0; i < workers_.size(); ++i)
+         {
+            registries.push_back(&workers_[i]->metrics);
+            active_bridges += workers_[i]->active_bridges;
+         }
 
-         bool accept_connections()
+         metrics::write_prometheus(out, registries, active_bridges,
+                                   budget_.used(), budget_.limit());
+      }
+
+      // Every loop's traces, by loop. Safe to call from any thread.
+      void write_traces(std::ostream& out) const
+      {
+         std::vector<metrics::trace_record> records;
+
+         for (std::size_t i = 0; i < workers_.size(); ++i)
          {
-            try
-            {
-               session_ = boost::shared_ptr<bridge>(new bridge(io_service_));
+            const std::size_t first = records.size();
+            workers_[i]->traces.copy(records);
 
-               acceptor_.async_accept(session_->downstream_socket(),
-                    boost::bind(&acceptor::handle_accept,
-                         this,
-                         boost::asio::placeholders::error));
-            }
-            catch(std::exception& e)
+            for (std::size_t r = first; r < records.size(); ++r)
             {
-               std::cerr << "acceptor exception: " << e.what() << std::endl;
-               return false;
+               records[r].loop = i;
             }
+         }
 
-            return true;
+         metrics::write_traces(out, records);
+      }
+
+   private:
+
+      // A pinned loop's worker is built on its CPU, so that its buffers,
+      // slab and metrics come from the memory of the CPU's node.
+      boost::shared_ptr<worker> make_pinned_worker(const config& config, int cpu)
+      {
+         boost::shared_ptr<worker> w;
+         std::string error;
+
+         boost::thread builder(boost::bind(&io_service_pool::build_worker, this,
+                                           boost::cref(config), cpu,
+                                           boost::ref(w), boost::ref(error)));
+         builder.join();
+
+         if (!error.empty())
+         {
+            throw std::runtime_error(error);
          }
 
-      private:
+         return w;
+      }
 
-         void handle_accept(const boost::system::error_code& error)
+      void build_worker(const config& config, int cpu, boost::shared_ptr<worker>& w, std::string& error)
+      {
+      #ifdef TCP_PROXY_AFFINITY
+         if (!affinity::pin_thread(cpu))
          {
-            if (!error)
-            {
-               session_->start(upstream_host_,upstream_port_);
+            std::ostringstream message;
+            message << "cannot pin a loop to CPU " << cpu;
+            error = message.str();
+            return;
+         }
+      #endif
 
-               if (!accept_connections())
-               {
-                  std::cerr << "Failure during call to accept." << std::endl;
-               }
-            }
-            else
+         try
+         {
+            w.reset(new worker(config, budget_, cpu));
+         }
+         catch (std::exception& e)
+         {
+            error = e.what();
+         }
+      }
+
+      static void run_worker(boost::shared_ptr<worker> w)
+      {
+         try
+         {
+         #ifdef TCP_PROXY_AFFINITY
+            if (w->cpu >= 0 && !affinity::pin_thread(w->cpu))
             {
-               std::cerr << "Error: " << error.message() << std::endl;
+               std::cerr << "cannot pin a loop to CPU " << w->cpu << std::endl;
             }
+         #endif
+
+            w->io_service.run();
          }
+         catch(std::exception& e)
+         {
+            std::cerr << "io_service exception: " << e.what() << std::endl;
+         }
+      }
 
-         boost::asio::io_service& io_service_;
-         ip::address_v4 localhost_address;
-         ip::tcp::acceptor acceptor_;
-         ptr_type session_;
-         unsigned short upstream_port_;
-         std::string upstream_host_;
+      // Outlives the workers, whose bridges give their bytes back to it.
+      memory_budget budget_;
+      std::vector<boost::shared_ptr<worker> > workers_;
+      balance_policy policy_;
+      boost::atomic<std::size_t> next_;
+   };
+
+   // One direction of a bridge: chunks that have been read and transformed
+   // but not yet written out. The next read is posted as soon as a chunk has
+   // been queued, so reading overlaps with the write of earlier chunks, until
+   // the queued bytes reach the high watermark, or the loops' memory budget
+   // is spent. Reading then stays paused until the writes have drained the
+   // queue to the low watermark, and to nothing while the budget is still
+   // spent. Everything queued when a write starts goes out in that one
+   // gather write.
+   class pipeline : private boost::noncopyable
+   {
+   public:
+
+      typedef std::vector<boost::asio::const_buffer> buffers_type;
+
+      pipeline(io_service_pool::worker& worker, const config& config)
+      : reading(false),
+        writing(false),
+        read_eof(false),
+        pool_(worker.buffers),
+        budget_(worker.budget),
+        metrics_(worker.metrics),
+        high_watermark_(config.max_in_flight),
+        low_watermark_(config.low_watermark),
+        queued_bytes_(0),
+        paused_(false),
+        prepared_(0),
+        prepared_capacity_(0)
+      {}
+
+      ~pipeline()
+      {
+         for (std::size_t i = 0; i < queue_.size(); ++i)
+         {
+            budget_.remove(queue_[i].capacity);
+            pool_.deallocate(queue_[i].data, queue_[i].capacity);
+         }
+
+         if (prepared_)
+         {
+            pool_.deallocate(prepared_, prepared_capacity_);
+         }
+      }
+
+      // Buffer of at least capacity bytes into which the next chunk is
+      // written.
+      unsigned char* prepare(std::size_t capacity)
+      {
+         if (prepared_ && prepared_capacity_ < capacity)
+         {
+            pool_.deallocate(prepared_, prepared_capacity_);
+            prepared_ = 0;
+         }
+
+         if (prepared_ == 0)
+         {
+            prepared_capacity_ = buffer_pool::capacity(capacity);
+            prepared_ = pool_.allocate(prepared_capacity_);
+         }
+
+         return prepared_;
+      }
+
+      // Queues the chunk last returned by prepare().
+      void commit(std::size_t length)
+      {
+         const chunk c = { prepared_, prepared_capacity_, length };
+         queue_.push_back(c);
+         queued_bytes_ += length;
+         budget_.add(c.capacity);
+         prepared_ = 0;
+
+         if (paused_)
+         {
+            return;
+         }
+
+         if (queued_bytes_ >= high_watermark_)
+         {
+            paused_ = true;
+            metrics_.watermark_pauses.add();
+         }
+         else if (budget_.exceeded())
+         {
+            paused_ = true;
+            metrics_.budget_pauses.add();
+         }
+      }
+
+      bool empty() const
+      {
+         return queue_.empty();
+      }
+
+      // Reading is paused.
+      bool full() const
+      {
+         return paused_;
+      }
+
+      std::size_t queued_bytes() const
+      {
+         return queued_bytes_;
+      }
+
+      // Gathers the queued chunks (up to max_gather of them) for one write.
+      const buffers_type& begin_write()
+      {
+         writing = true;
+         write_buffers_.clear();
+
+         for (std::size_t i = 0; i < queue_.size() && i < max_gather; ++i)
+         {
+            write_buffers_.push_back(
+                 boost::asio::const_buffer(queue_[i].data, queue_[i].length));
+         }
+
+         return write_buffers_;
+      }
+
+      // The buffers gathered by the last begin_write(), until end_write().
+      const buffers_type& write_buffers() const
+      {
+         return write_buffers_;
+      }
+
+      // Releases the chunks written by the last begin_write().
+      void end_write()
+      {
+         writing = false;
+
+         for (std::size_t i = 0; i < write_buffers_.size(); ++i)
+         {
+            queued_bytes_ -= queue_.front().length;
+            budget_.remove(queue_.front().capacity);
+            pool_.deallocate(queue_.front().data, queue_.front().capacity);
+            queue_.pop_front();
+         }
+
+         write_buffers_.clear();
+
+         if (paused_ && queued_bytes_ <= low_watermark_ &&
+             (queue_.empty() || !budget_.exceeded()))
+         {
+            paused_ = false;
+         }
+      }
+
+      // A read is outstanding on the source socket.
+      bool reading;
+
+      // A gather write is outstanding on the sink socket.
+      bool writing;
+
+      // The source socket has been shut down by the peer; the end of the
+      // stream is passed on once the queued chunks have been written.
+      bool read_eof;
+
+   private:
+
+      // Same as the iovec limit asio uses for a single send.
+      enum { max_gather = 64 };
+
+      struct chunk
+      {
+         unsigned char* data;
+         std::size_t capacity;
+         std::size_t length;
       };
 
+      buffer_pool& pool_;
+      memory_budget& budget_;
+      metrics::registry& metrics_;
+      std::size_t high_watermark_;
+      std::size_t low_watermark_;
+      std::size_t queued_bytes_;
+      bool paused_;
+      std::deque<chunk> queue_;
+      unsigned char* prepared_;
+      std::size_t prepared_capacity_;
+      buffers_type write_buffers_;
    };
-}
-
-void usage()
-{
-   std::cerr << "usage: tcpproxy_server <local host ip> <local port> <forward host ip> <forward port> (encode|decode)" << std::endl;
-   std::exit(1);
-}
 
-int main(int argc, char* argv[])
-{
-   if (argc != 6)
+   // A connection between an encode and a decode proxy that carries the
+   // streams of many clients (see mux.hpp). Everything the streams send is
+   // framed, compressed and enciphered into the one queue of the tunnel, in
+   // the order it is sent. A stream that finds the queue full waits for
+   // its turn; waiting streams are resumed in the order they started to
+   // wait, so that each gets a chunk in before any gets a second. Frames
+   // received are decoded and handed to their streams as they arrive.
+   // Streams never stop the tunnel from reading, since no stream may have
+   // more than its window in flight.
+   class mux_tunnel : public boost::enable_shared_from_this<mux_tunnel>
    {
-      usage();
-   }
+   public:
 
-   const unsigned short local_port   = static_cast<unsigned short>(::atoi(argv[2]));
-   const unsigned short forward_port = static_cast<unsigned short>(::atoi(argv[4]));
-   const std::string local_host      = argv[1];
-   const std::string forward_host    = argv[3];
-   const std::string direction       = argv[5];
+      typedef ip::tcp::socket socket_type;
+      typedef boost::shared_ptr<mux_tunnel> ptr_type;
 
-   if (direction == "encode")
-   {
-      tcp_proxy::g_encode = true;
-   }
-   else if (direction == "decode")
-   {
-      tcp_proxy::g_encode = false;
-   }
-   else
-   {
-      usage();
-   }
+      // What the tunnel sees of a stream. The tunnel holds on to each
+      // stream from the time it is attached until it is detached, or the
+      // tunnel closes.
+      class stream : private boost::noncopyable
+      {
+      public:
 
-   boost::asio::io_service ios;
+         stream()
+         : id_(0),
+           attached_(false),
+           waiting_(false)
+         {}
 
-   try
-   {
-      tcp_proxy::bridge::acceptor acceptor(ios,
-                                           local_host, local_port,
-                                           forward_host, forward_port);
+         virtual ~stream()
+         {}
+
+         mux::stream_id id() const
+         {
+            return id_;
+         }
+
+         bool attached() const
+         {
+            return attached_;
+         }
+
+         // Room for the next chunk received for the stream, which is then
+         // queued with received(). Returns false if the peer has sent more
+         // than the window.
+         virtual unsigned char* prepare(std::size_t capacity) = 0;
+         virtual bool received(std::size_t length) = 0;
+
+         // The peer has written out bytes that the stream may send again.
+         virtual void window(std::size_t bytes) = 0;
+
+         // The peer's side of the stream has ended; no more is received.
+         virtual void peer_ended() = 0;
+
+         // The peer has detached the stream; the tunnel has forgotten it.
+         virtual void peer_closed() = 0;
+
+         // The tunnel has failed and forgotten the stream.
+         virtual void tunnel_closed() = 0;
+
+         // The tunnel's queue has room for the stream to send again.
+         virtual void resume() = 0;
+
+      private:
+
+         friend class mux_tunnel;
+
+         mux::stream_id id_;
+         bool attached_;
+         bool waiting_;
+      };
+
+      typedef boost::shared_ptr<stream> stream_ptr;
+
+      mux_tunnel(io_service_pool::worker& worker, const config& config, backend_set& backends)
+      : worker_(worker),
+        config_(config),
+        backends_(backends),
+        backend_(0),
+        socket_(worker.io_service),
+        max_payload_length_(mux::max_header_length + config.max_chunk_size +
+                            (config.compression != compression_off ? 1 : 0)),
+        max_chunk_size_(config.max_chunk_size),
+        xor_key_(config.cipher == cipher_xor ? kKey : 0),
+        ring_(worker.buffers,
+              2 * config.chunk_size,
+              2 * (max_payload_length_ + frame_ring::max_prefix_length),
+              0),
+        out_(worker, config),
+        connect_started_(0),
+        connected_(false),
+        closed_(false),
+        preamble_received_(false),
+        peer_window_(0),
+        next_id_(1)
+      {}
+
+      ~mux_tunnel()
+      {
+         if (backend_)
+         {
+            --backend_->active;
+         }
+      }
+
+      boost::asio::io_service& io_service()
+      {
+         return worker_.io_service;
+      }
+
+      socket_type& socket()
+      {
+         return socket_;
+      }
+
+      bool closed() const
+      {
+         return closed_;
+      }
+
+      bool connected() const
+      {
+         return connected_;
+      }
+
+      std::size_t streams() const
+      {
+         return streams_.size();
+      }
+
+      // The connecting end: dials a decode proxy. Streams may be attached
+      // right away, their frames are sent once the tunnel is up.
+      void connect(backend& target)
+      {
+         backend_ = &target;
+         ++backend_->active;
+
+         send_header();
 
-      acceptor.accept_connections();
+         boost::system::error_code ec;
+         socket_.open(target.endpoint().protocol(), ec);
+         apply_buffer_options(socket_, config_.upstream_options, ec);
+
+         connect_started_ = metrics::now();
+
+         socket_.async_connect(target.endpoint(),
+              boost::bind(&mux_tunnel::handle_connect,
+                   shared_from_this(),
+                   boost::asio::placeholders::error));
+      }
+
+      // The accepting end: the encode proxy has connected.
+      void start_accepted()
+      {
+         send_header();
+         start();
+      }
+
+      // The connecting end gives each stream the next ID.
+      void attach(const stream_ptr& s)
+      {
+         attach(s, next_id_++);
+         send_control(mux::frame_open, *s);
+      }
+
+      // Tells the peer that the stream's side has ended, keeping it
+      // attached for what the peer still sends.
+      void end(stream& s)
+      {
+         if (s.attached_)
+         {
+            send_control(mux::frame_end, s);
+         }
+      }
+
+      // Forgets the stream, telling the peer unless it has already
+      // forgotten it.
+      void detach(stream& s, bool notify)
+      {
+         if (!s.attached_)
+         {
+            return;
+         }
+
+         if (s.waiting_)
+         {
+            waiting_.erase(std::find(waiting_.begin(), waiting_.end(), &s));
+            s.waiting_ = false;
+         }
+
+         if (notify)
+         {
+            send_control(mux::frame_close, s);
+         }
+
+         // The caller holds a reference of its own.
+         s.attached_ = false;
+         streams_.erase(s.id_);
+      }
+
+      // The queue is over its watermark, or the memory budget is spent.
+      bool full() const
+      {
+         return out_.full();
+      }
+
+      // Resumes the stream once the queue has room.
+      void wait(stream& s)
+      {
+         if (!s.waiting_)
+         {
+            s.waiting_ = true;
+            waiting_.push_back(&s);
+         }
+      }
+
+      void send_data(stream& s, const unsigned char* data, std::size_t length)
+      {
+         if (!s.attached_ || closed_)
+         {
+            return;
+         }
+
+         const metrics::stopwatch transform_time;
+
+         // Compressed into a scratch buffer, which is then framed.
+         const unsigned char* chunk = data;
+         std::size_t chunk_length = length;
+         unsigned char* packed = 0;
+         std::size_t packed_capacity = 0;
+
+         if (worker_.compression)
+         {
+            packed_capacity = worker_.compression->bound(length);
+            packed = worker_.buffers.allocate(packed_capacity);
+            chunk_length = worker_.compression->compress(data, length, packed);
+            chunk = packed;
+            metrics().compression_bytes_in.add(length);
+            metrics().compression_bytes_out.add(chunk_length);
+         }
+
+         unsigned char header[mux::max_header_length];
+         const std::size_t header_length = mux::write_header(header, mux::frame_data, s.id_);
+         queue_frame(header, header_length, chunk, chunk_length);
+
+         if (packed)
+         {
+            worker_.buffers.deallocate(packed, packed_capacity);
+         }
+
+         transform_time.observe(metrics().encode_time);
+         flush();
+      }
+
+      void send_window(stream& s, std::size_t bytes)
+      {
+         if (!s.attached_ || closed_)
+         {
+            return;
+         }
+
+         unsigned char body[mux::max_varint_length];
+         const std::size_t body_length = mux::write_varint(body, bytes);
+
+         unsigned char header[mux::max_header_length];
+         const std::size_t header_length = mux::write_header(header, mux::frame_window, s.id_);
+         queue_frame(header, header_length, body, body_length);
+         flush();
+      }
+
+      // Closes the connection and every stream on it.
+      void close()
+      {
+         if (closed_)
+         {
+            return;
+         }
+
+         closed_ = true;
+
+         boost::system::error_code ec;
+         socket_.close(ec);
+
+         stream_map streams;
+         streams.swap(streams_);
+         waiting_.clear();
+
+         for (stream_map::iterator i = streams.begin(); i != streams.end(); ++i)
+         {
+            i->second->attached_ = false;
+            i->second->waiting_ = false;
+            i->second->tunnel_closed();
+         }
+      }
+
+   private:
+
+      typedef boost::unordered_map<mux::stream_id, stream_ptr> stream_map;
+
+      metrics::registry& metrics()
+      {
+         return worker_.metrics;
+      }
+
+      // A stream may send once the peer's window is known.
+      void attach(const stream_ptr& s, mux::stream_id id)
+      {
+         s->id_ = id;
+         s->attached_ = true;
+         streams_[id] = s;
+         metrics().mux_streams.add();
+
+         if (peer_window_)
+         {
+            s->window(peer_window_);
+         }
+      }
+
+      // An open, end or close frame, which carries no body.
+      void send_control(mux::frame_type type, const stream& s)
+      {
+         if (closed_)
+         {
+            return;
+         }
+
+         unsigned char header[mux::max_header_length];
+         const std::size_t header_length = mux::write_header(header, type, s.id_);
+         queue_frame(header, header_length, 0, 0);
+         flush();
+      }
+
+      // Opens a stream the peer has asked for; defined after mux_stream.
+      void open_stream(mux::stream_id id);
+
+      void handle_connect(const boost::system::error_code& error)
+      {
+         const metrics::value_type connect_time = metrics::now() - connect_started_;
+         metrics().upstream_connect_time.observe(connect_time);
+
+         if (closed_)
+         {
+            return;
+         }
+
+         if (error)
+         {
+            std::cerr << "mux tunnel connect fail " << backend_->endpoint() << " " << error << "\n";
+            metrics().upstream_connect_failures.add();
+            backends_.connect_failed(*backend_);
+            fail();
+            return;
+         }
+
+         backends_.connect_succeeded(*backend_, connect_time);
+         apply_socket_options(socket_, config_.upstream_options);
+         start();
+      }
+
+      void start()
+      {
+         connected_ = true;
+
+         boost::system::error_code ec;
+         socket_.non_blocking(true, ec);
+
+         read();
+         flush();
+      }
+
+      void fail()
+      {
+         metrics().mux_tunnel_failures.add();
+         close();
+      }
+
+      // The preamble, and with ChaCha20 a frame of the nonce the rest is
+      // enciphered with, as a bridge's binary stream starts; then the
+      // window the streams of this end give.
+      void send_header()
+      {
+         *out_.prepare(1) = mux::preamble;
+         out_.commit(1);
+
+         if (worker_.cipher_key)
+         {
+            unsigned char nonce[chacha20::nonce_size];
+            worker_.nonces.generate(nonce, sizeof(nonce));
+            queue_frame(nonce, sizeof(nonce), 0, 0);
+            cipher_out_.reset(*worker_.cipher_key, nonce);
+         }
+
+         unsigned char body[mux::max_varint_length];
+         const std::size_t body_length = mux::write_varint(body, config_.mux_window);
+
+         unsigned char header[mux::max_header_length];
+         const std::size_t header_length = mux::write_header(header, mux::frame_window, mux::tunnel_stream);
+         queue_frame(header, header_length, body, body_length);
+      }
+
+      void encipher(const unsigned char* in, std::size_t length, unsigned char* out)
+      {
+         if (cipher_out_.keyed())
+         {
+            cipher_out_.apply(in, length, out);
+         }
+         else
+         {
+            xorb64::xorcopy(in, length, out, xor_key_);
+         }
+      }
+
+      // Frames the header and body, which go out enciphered in that order.
+      void queue_frame(const unsigned char* header, std::size_t header_length,
+                       const unsigned char* body, std::size_t body_length)
+      {
+         const std::size_t length = header_length + body_length;
+         unsigned char* const out = out_.prepare(frame_ring::prefix_length(length) + length);
+         std::size_t n = frame_ring::write_prefix(out, length);
+
+         encipher(header, header_length, out + n);
+         n += header_length;
+         encipher(body, body_length, out + n);
+         n += body_length;
+
+         out_.commit(n);
+         metrics().frames_encoded.add();
+      }
+
+      void flush()
+      {
+         if (!connected_ || closed_ || out_.writing || out_.empty())
+         {
+            return;
+         }
+
+         async_write(socket_,
+              out_.begin_write(),
+              boost::bind(&mux_tunnel::handle_write,
+                   shared_from_this(),
+                   boost::asio::placeholders::error,
+                   boost::asio::placeholders::bytes_transferred));
+      }
+
+      void handle_write(const boost::system::error_code& error, const size_t& bytes_transferred)
+      {
+         out_.end_write();
+         metrics().ciphertext_bytes_written.add(bytes_transferred);
+
+         if (closed_)
+         {
+            return;
+         }
+
+         if (error)
+         {
+            if (error != boost::asio::error::connection_reset &&
+                error != boost::asio::error::operation_aborted)
+            {
+               std::cerr << "mux tunnel write fail " << error << "\n";
+            }
+
+            fail();
+            return;
+         }
+
+         flush();
+
+         if (!out_.full() && !waiting_.empty())
+         {
+            std::deque<stream*> waiting;
+            waiting.swap(waiting_);
+
+            for (std::size_t i = 0; i < waiting.size(); ++i)
+            {
+               waiting[i]->waiting_ = false;
+               waiting[i]->resume();
+            }
+         }
+      }
+
+      void read()
+      {
+         io_service().post(
+              boost::bind(&mux_tunnel::handle_readable,
+                   shared_from_this(),
+                   boost::system::error_code()));
+      }
+
+      void handle_readable(const boost::system::error_code& error)
+      {
+         if (closed_)
+         {
+            return;
+         }
+
+         boost::system::error_code ec = error;
+         std::size_t bytes_transferred = 0;
+
+         if (!ec)
+         {
+            bytes_transferred = socket_.read_some(ring_.prepare(), ec);
+         }
+
+         if (ec == boost::asio::error::would_block)
+         {
+            ring_.release_if_empty();
+
+            socket_.async_wait(socket_type::wait_read,
+                 boost::bind(&mux_tunnel::handle_readable,
+                      shared_from_this(),
+                      boost::asio::placeholders::error));
+            return;
+         }
+
+         if (ec)
+         {
+            if (ec != boost::asio::error::eof &&
+                ec != boost::asio::error::operation_aborted &&
+                ec != boost::asio::error::connection_reset)
+            {
+               std::cerr << "mux tunnel read fail " << ec << "\n";
+            }
+
+            fail();
+            return;
+         }
+
+         metrics().ciphertext_bytes_read.add(bytes_transferred);
+         ring_.commit(bytes_transferred);
+
+         if (process_frames())
+         {
+            ring_.release_if_empty();
+            read();
+         }
+      }
+
+      // Returns false if the tunnel had to be closed.
+      bool process_frames()
+      {
+         if (!preamble_received_)
+         {
+            if (ring_.size() == 0)
+            {
+               return true;
+            }
+
+            if (ring_.front() != mux::preamble)
+            {
+               std::cerr << "not a mux tunnel\n";
+               metrics().decode_errors.add();
+               fail();
+               return false;
+            }
+
+            ring_.discard(1);
+            preamble_received_ = true;
+         }
+
+         frame_ring::frame frame;
+         std::size_t length;
+
+         for ( ; ; )
+         {
+            const bool complete = ring_.next_prefixed_frame(frame, length);
+
+            if (length > max_payload_length_)
+            {
+               std::cerr << "mux frame is too long\n";
+               metrics().decode_errors.add();
+               fail();
+               return false;
+            }
+
+            if (!complete)
+            {
+               if (ring_.size() > ring_.capacity() / 2)
+               {
+                  ring_.grow();
+               }
+
+               return true;
+            }
+
+            const metrics::stopwatch transform_time;
+
+            if (!process_frame(frame))
+            {
+               metrics().decode_errors.add();
+               fail();
+               return false;
+            }
+
+            ring_.consume(frame);
+
+            if (closed_)
+            {
+               return false;
+            }
+
+            transform_time.observe(metrics().decode_time);
+            metrics().frames_decoded.add();
+         }
+      }
+
+      // Deciphers length bytes of the frame from offset on into out. The
+      // frame may straddle the end of the ring.
+      void decipher(const frame_ring::frame& frame, std::size_t offset, std::size_t length,
+                    unsigned char* out)
+      {
+         if (offset < frame.first_length)
+         {
+            const std::size_t n = std::min(length, frame.first_length - offset);
+            decipher(frame.first + offset, n, out);
+            out += n;
+            length -= n;
+            offset += n;
+         }
+
+         decipher(frame.second + (offset - frame.first_length), length, out);
+      }
+
+      void decipher(const unsigned char* in, std::size_t length, unsigned char* out)
+      {
+         if (length == 0)
+         {
+            return;
+         }
+
+         if (cipher_in_.keyed())
+         {
+            cipher_in_.apply(in, length, out);
+         }
+         else
+         {
+            xorb64::xorcopy(in, length, out, xor_key_);
+         }
+      }
+
+      // The header is deciphered first, then the body straight into where
+      // it goes. Returns false if the frame is invalid.
+      bool process_frame(const frame_ring::frame& frame)
+      {
+         const std::size_t length = frame.length();
+         unsigned char header[mux::max_header_length];
+         const std::size_t peeked = std::min<std::size_t>(length, sizeof(header));
+         const std::size_t split = std::min(peeked, frame.first_length);
+
+         std::memcpy(header, frame.first, split);
+
+         if (peeked > split)
+         {
+            std::memcpy(header + split, frame.second, peeked - split);
+         }
+
+         decipher(header, peeked, header);
+
+         // With ChaCha20 the first frame is the peer's nonce.
+         if (worker_.cipher_key && !cipher_in_.keyed())
+         {
+            if (length != chacha20::nonce_size)
+            {
+               std::cerr << "cipher nonce fail\n";
+               return false;
+            }
+
+            cipher_in_.reset(*worker_.cipher_key, header);
+            return true;
+         }
+
+         mux::frame_type type;
+         mux::stream_id id;
+         const std::size_t header_length = mux::read_header(header, peeked, type, id);
+
+         if (header_length == 0)
+         {
+            std::cerr << "mux frame fail\n";
+            return false;
+         }
+
+         const stream_map::iterator i = streams_.find(id);
+         const stream_ptr s = (i != streams_.end()) ? i->second : stream_ptr();
+         const std::size_t body_length = length - header_length;
+
+         if (type == mux::frame_data)
+         {
+            return receive_data(frame, header, header_length, peeked, s);
+         }
+
+         // Control frames carry at most a varint.
+         unsigned char body[mux::max_varint_length];
+
+         if (body_length > sizeof(body))
+         {
+            std::cerr << "mux frame fail\n";
+            return false;
+         }
+
+         std::memcpy(body, header + header_length, peeked - header_length);
+         decipher(frame, peeked, length - peeked, body + (peeked - header_length));
+
+         switch (type)
+         {
+            case mux::frame_open   :
+            {
+               // Only the accepting end is opened streams.
+               if (g_encode || s)
+               {
+                  std::cerr << "mux open fail " << id << "\n";
+                  return false;
+               }
+
+               open_stream(id);
+               return true;
+            }
+
+            case mux::frame_end    :
+            {
+               if (s)
+               {
+                  s->peer_ended();
+               }
+
+               return true;
+            }
+
+            case mux::frame_close  :
+            {
+               if (s)
+               {
+                  s->attached_ = false;
+
+                  if (s->waiting_)
+                  {
+                     waiting_.erase(std::find(waiting_.begin(), waiting_.end(), s.get()));
+                     s->waiting_ = false;
+                  }
+
+                  streams_.erase(i);
+                  s->peer_closed();
+               }
+
+               return true;
+            }
+
+            case mux::frame_window :
+            {
+               boost::uint64_t bytes = 0;
+
+               if (mux::read_varint(body, body_length, bytes) == 0 || bytes == 0)
+               {
+                  std::cerr << "mux window fail\n";
+                  return false;
+               }
+
+               if (id == mux::tunnel_stream)
+               {
+                  return set_peer_window(static_cast<std::size_t>(bytes));
+               }
+
+               if (s)
+               {
+                  s->window(static_cast<std::size_t>(bytes));
+               }
+
+               return true;
+            }
+
+            default : return false;
+         }
+      }
+
+      // The window the peer's streams give, sent once at the start of the
+      // tunnel, is every stream's initial credit.
+      bool set_peer_window(std::size_t bytes)
+      {
+         if (peer_window_)
+         {
+            std::cerr << "mux window fail\n";
+            return false;
+         }
+
+         peer_window_ = bytes;
+
+         for (stream_map::iterator i = streams_.begin(); i != streams_.end(); ++i)
+         {
+            i->second->window(peer_window_);
+         }
+
+         return true;
+      }
+
+      // A chunk is deciphered into the stream's queue, or with compression
+      // on into a scratch buffer that is decompressed into it. A chunk for
+      // a stream that has been closed is deciphered all the same, to keep
+      // the keystream in step, and dropped.
+      bool receive_data(const frame_ring::frame& frame,
+                        const unsigned char* header, std::size_t header_length,
+                        std::size_t peeked, const stream_ptr& s)
+      {
+         const std::size_t length = frame.length();
+         const std::size_t body_length = length - header_length;
+         const bool scratch = !s || worker_.compression;
+         unsigned char* const body = scratch ? worker_.buffers.allocate(body_length + 1)
+                                             : s->prepare(body_length);
+
+         std::memcpy(body, header + header_length, peeked - header_length);
+         decipher(frame, peeked, length - peeked, body + (peeked - header_length));
+
+         bool result = true;
+
+         if (s && !worker_.compression)
+         {
+            result = s->received(body_length);
+         }
+         else if (s)
+         {
+            std::size_t chunk_length = 0;
+            result = worker_.compression->decompress(body, body_length,
+                                                     s->prepare(max_chunk_size_),
+                                                     max_chunk_size_,
+                                                     chunk_length);
+
+            if (!result)
+            {
+               std::cerr << "decompress fail\n";
+            }
+            else
+            {
+               result = s->received(chunk_length);
+            }
+         }
+
+         if (scratch)
+         {
+            worker_.buffers.deallocate(body, body_length + 1);
+         }
+
+         return result;
+      }
+
+      io_service_pool::worker& worker_;
+      const config& config_;
+      backend_set& backends_;
+      backend* backend_;
+      socket_type socket_;
+
+      // Frames carry a header and at most the largest chunk, plus the
+      // compression flag.
+      std::size_t max_payload_length_;
+      std::size_t max_chunk_size_;
+
+      // As in a bridge's binary stream.
+      unsigned char xor_key_;
+      chacha20::stream cipher_in_;
+      chacha20::stream cipher_out_;
+      frame_ring ring_;
+      pipeline out_;
+
+      metrics::value_type connect_started_;
+      bool connected_;
+      bool closed_;
+      bool preamble_received_;
+      std::size_t peer_window_;
+      mux::stream_id next_id_;
+      stream_map streams_;
+      std::deque<stream*> waiting_;
+   };
+
+   // The tunnels of one loop of the encode end, kept connected to the
+   // decode proxies. A tunnel that fails is replaced by the next round of
+   // maintenance, once a second, so that an unreachable proxy isn't
+   // hammered.
+   class mux_pool : private boost::noncopyable
+   {
+   public:
+
+      mux_pool(io_service_pool::worker& worker, const config& config, backend_set& backends)
+      : worker_(worker),
+        config_(config),
+        backends_(backends),
+        tunnels_(config.mux_tunnels),
+        maintenance_timer_(worker.io_service)
+      {}
+
+      ~mux_pool()
+      {
+         for (std::size_t i = 0; i < tunnels_.size(); ++i)
+         {
+            if (tunnels_[i])
+            {
+               tunnels_[i]->close();
+            }
+         }
+      }
+
+      // Must be called from the loop's thread, or before the loop runs.
+      void start()
+      {
+         refill();
+         schedule_maintenance();
+      }
+
+      // The tunnel with the fewest streams, preferring those that are up.
+      // Null if every tunnel has failed.
+      mux_tunnel::ptr_type choose()
+      {
+         mux_tunnel::ptr_type best;
+
+         for (std::size_t i = 0; i < tunnels_.size(); ++i)
+         {
+            const mux_tunnel::ptr_type& t = tunnels_[i];
+
+            if (!t || t->closed())
+            {
+               continue;
+            }
+
+            if (!best ||
+                (t->connected() && !best->connected()) ||
+                (t->connected() == best->connected() && t->streams() < best->streams()))
+            {
+               best = t;
+            }
+         }
+
+         return best;
+      }
+
+   private:
+
+      void refill()
+      {
+         for (std::size_t i = 0; i < tunnels_.size(); ++i)
+         {
+            if (!tunnels_[i] || tunnels_[i]->closed())
+            {
+               tunnels_[i] = boost::make_shared<mux_tunnel>(boost::ref(worker_),
+                                                            boost::cref(config_),
+                                                            boost::ref(backends_));
+               tunnels_[i]->connect(backends_.choose());
+            }
+         }
+      }
+
+      void schedule_maintenance()
+      {
+         maintenance_timer_.expires_from_now(boost::posix_time::seconds(1));
+         maintenance_timer_.async_wait(
+              boost::bind(&mux_pool::handle_maintenance,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      void handle_maintenance(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         refill();
+         schedule_maintenance();
+      }
+
+      io_service_pool::worker& worker_;
+      const config& config_;
+      backend_set& backends_;
+      std::vector<mux_tunnel::ptr_type> tunnels_;
+      boost::asio::deadline_timer maintenance_timer_;
+   };
+
+   // One client's stream over a mux tunnel: the client's connection at the
+   // encode end, the connection to the remote server at the decode end.
+   // It reads chunks into the tunnel for as long as the peer's window has
+   // room, and writes what the tunnel hands it, giving the window back as
+   // the writes complete. A side that reaches the end of its socket is
+   // passed on as an end frame, and the other end shuts its socket down
+   // for sending once it has written what came before, keeping the stream
+   // open for the reply; the stream closes when both sides have ended.
+   // When either end closes, the other closes once what it has queued has
+   // been written.
+   class mux_stream : public mux_tunnel::stream,
+                      public boost::enable_shared_from_this<mux_stream>
+   {
+   public:
+
+      typedef ip::tcp::socket socket_type;
+      typedef boost::shared_ptr<mux_stream> ptr_type;
+
+      mux_stream(io_service_pool::worker& worker, const config& config)
+      : worker_(worker),
+        socket_(worker.io_service),
+        upstream_options_(config.upstream_options),
+        out_(worker, config),
+        read_size_(config.chunk_size),
+        window_(config.mux_window),
+        credit_(0),
+        written_(0),
+        reading_(false),
+        connected_(false),
+        ended_(false),
+        peer_ended_(false),
+        shut_down_(false),
+        draining_(false),
+        closed_(false),
+        backends_(0),
+        backend_(0),
+        connect_attempts_(0),
+        connect_started_(0)
+      {
+         ++worker_.active_bridges;
+      }
+
+      ~mux_stream()
+      {
+         if (backend_)
+         {
+            --backend_->active;
+         }
+
+         --worker_.active_bridges;
+      }
+
+      boost::asio::io_service& io_service()
+      {
+         return worker_.io_service;
+      }
+
+      socket_type& socket()
+      {
+         return socket_;
+      }
+
+      admission::ticket& ticket()
+      {
+         return ticket_;
+      }
+
+      // The encode end: a client has connected, open a stream for it on
+      // the least busy tunnel.
+      void start()
+      {
+         metrics().bridges_accepted.add();
+         tunnel_ = worker_.mux->choose();
+
+         if (!tunnel_)
+         {
+            std::cerr << "no mux tunnel\n";
+            close();
+            return;
+         }
+
+         tunnel_->attach(shared_from_this());
+         connected();
+      }
+
+      // The decode end: the peer has opened the stream, which the tunnel
+      // has attached, and it is connected to a remote server.
+      void open(const mux_tunnel::ptr_type& tunnel, backend_set& backends)
+      {
+         tunnel_ = tunnel;
+         backends_ = &backends;
+         connect(backends.choose());
+      }
+
+      virtual unsigned char* prepare(std::size_t capacity)
+      {
+         return out_.prepare(capacity);
+      }
+
+      virtual bool received(std::size_t length)
+      {
+         out_.commit(length);
+
+         if (out_.queued_bytes() > window_)
+         {
+            std::cerr << "mux window overrun " << id() << "\n";
+            return false;
+         }
+
+         if (connected_ && !out_.writing)
+         {
+            write();
+         }
+
+         return true;
+      }
+
+      virtual void window(std::size_t bytes)
+      {
+         credit_ += bytes;
+         read();
+      }
+
+      virtual void peer_ended()
+      {
+         peer_ended_ = true;
+         shut_down_if_written();
+      }
+
+      virtual void peer_closed()
+      {
+         if (out_.writing || !out_.empty())
+         {
+            draining_ = true;
+         }
+         else
+         {
+            close();
+         }
+      }
+
+      virtual void tunnel_closed()
+      {
+         close();
+      }
+
+      virtual void resume()
+      {
+         read();
+      }
+
+   private:
+
+      metrics::registry& metrics()
+      {
+         return worker_.metrics;
+      }
+
+      // As a bridge connects, retrying once on another server.
+      void connect(backend& target)
+      {
+         backend_ = &target;
+         ++backend_->active;
+         ++connect_attempts_;
+
+         upstream_pool& pool = worker_.upstream(*backends_, target);
+
+         if (pool.acquire(socket_, target))
+         {
+            metrics().upstream_pool_hits.add();
+            connected();
+            return;
+         }
+         else if (pool.enabled())
+         {
+            metrics().upstream_pool_misses.add();
+         }
+
+         boost::system::error_code ec;
+         socket_.open(target.endpoint().protocol(), ec);
+         apply_buffer_options(socket_, upstream_options_, ec);
+
+         connect_started_ = metrics::now();
+
+         socket_.async_connect(target.endpoint(),
+              boost::bind(&mux_stream::handle_connect,
+                   shared_from_this(),
+                   boost::asio::placeholders::error));
+      }
+
+      void handle_connect(const boost::system::error_code& error)
+      {
+         const metrics::value_type connect_time = metrics::now() - connect_started_;
+         metrics().upstream_connect_time.observe(connect_time);
+
+         if (closed_)
+         {
+            return;
+         }
+
+         if (!error)
+         {
+            backends_->connect_succeeded(*backend_, connect_time);
+            apply_socket_options(socket_, upstream_options_);
+            connected();
+            return;
+         }
+
+         std::cerr << "upstream connect fail " << backend_->endpoint() << " " << error << "\n";
+         metrics().upstream_connect_failures.add();
+         backends_->connect_failed(*backend_);
+
+         if (connect_attempts_ < max_connect_attempts && backends_->size() > 1)
+         {
+            boost::system::error_code ec;
+            socket_.close(ec);
+
+            backend& failed = *backend_;
+            --failed.active;
+            connect(backends_->choose(&failed));
+         }
+         else
+         {
+            close();
+         }
+      }
+
+      void connected()
+      {
+         connected_ = true;
+
+         boost::system::error_code ec;
+         socket_.non_blocking(true, ec);
+
+         read();
+
+         if (!out_.empty() && !out_.writing)
+         {
+            write();
+         }
+         else
+         {
+            shut_down_if_written();
+         }
+      }
+
+      // Reads while the window has room and the tunnel's queue isn't full.
+      void read()
+      {
+         if (reading_ || closed_ || ended_ || draining_ || !connected_ || credit_ == 0 || !attached())
+         {
+            return;
+         }
+
+         if (tunnel_->full())
+         {
+            tunnel_->wait(*this);
+            return;
+         }
+
+         reading_ = true;
+
+         io_service().post(
+              boost::bind(&mux_stream::handle_readable,
+                   shared_from_this(),
+                   boost::system::error_code()));
+      }
+
+      void handle_readable(const boost::system::error_code& error)
+      {
+         if (closed_)
+         {
+            return;
+         }
+
+         const std::size_t read_size = std::min(read_size_, credit_);
+         unsigned char* const data = worker_.buffers.allocate(read_size);
+         boost::system::error_code ec = error;
+         std::size_t bytes_transferred = 0;
+
+         if (!ec)
+         {
+            bytes_transferred = socket_.read_some(boost::asio::buffer(data, read_size), ec);
+         }
+
+         if (ec == boost::asio::error::would_block)
+         {
+            worker_.buffers.deallocate(data, read_size);
+
+            socket_.async_wait(socket_type::wait_read,
+                 boost::bind(&mux_stream::handle_readable,
+                      shared_from_this(),
+                      boost::asio::placeholders::error));
+            return;
+         }
+
+         reading_ = false;
+
+         if (!ec)
+         {
+            metrics().plaintext_bytes_read.add(bytes_transferred);
+            credit_ -= bytes_transferred;
+            tunnel_->send_data(*this, data, bytes_transferred);
+         }
+
+         worker_.buffers.deallocate(data, read_size);
+
+         if (ec == boost::asio::error::eof && attached())
+         {
+            ended_ = true;
+            tunnel_->end(*this);
+
+            if (shut_down_)
+            {
+               close();
+            }
+
+            return;
+         }
+
+         if (ec)
+         {
+            if (ec != boost::asio::error::eof &&
+                ec != boost::asio::error::operation_aborted &&
+                ec != boost::asio::error::connection_reset)
+            {
+               std::cerr << "plaintext read fail " << ec << "\n";
+            }
+
+            close();
+            return;
+         }
+
+         read();
+      }
+
+      void write()
+      {
+         async_write(socket_,
+              out_.begin_write(),
+              boost::bind(&mux_stream::handle_write,
+                   shared_from_this(),
+                   boost::asio::placeholders::error,
+                   boost::asio::placeholders::bytes_transferred));
+      }
+
+      // Gives the peer its window back in halves, so as not to send a
+      // window frame for every chunk.
+      void handle_write(const boost::system::error_code& error, const size_t& bytes_transferred)
+      {
+         out_.end_write();
+         metrics().plaintext_bytes_written.add(bytes_transferred);
+
+         if (closed_)
+         {
+            return;
+         }
+
+         if (error)
+         {
+            if (error != boost::asio::error::connection_reset &&
+                error != boost::asio::error::operation_aborted)
+            {
+               std::cerr << "plaintext write fail " << error << "\n";
+            }
+
+            close();
+            return;
+         }
+
+         written_ += bytes_transferred;
+
+         if (written_ >= window_ / 2 && attached())
+         {
+            tunnel_->send_window(*this, written_);
+            written_ = 0;
+         }
+
+         if (!out_.empty())
+         {
+            write();
+         }
+         else if (draining_)
+         {
+            close();
+         }
+         else
+         {
+            shut_down_if_written();
+         }
+      }
+
+      // Passes the peer's end on to the socket once everything before it
+      // is written.
+      void shut_down_if_written()
+      {
+         if (!peer_ended_ || shut_down_ || closed_ || !connected_ || out_.writing || !out_.empty())
+         {
+            return;
+         }
+
+         shut_down_ = true;
+
+         boost::system::error_code ec;
+         socket_.shutdown(socket_type::shutdown_send, ec);
+
+         if (ended_)
+         {
+            close();
+         }
+      }
+
+      void close()
+      {
+         if (closed_)
+         {
+            return;
+         }
+
+         closed_ = true;
+
+         if (tunnel_)
+         {
+            tunnel_->detach(*this, true);
+         }
+
+         boost::system::error_code ec;
+         socket_.close(ec);
+      }
+
+      io_service_pool::worker& worker_;
+      socket_type socket_;
+      const socket_options& upstream_options_;
+      mux_tunnel::ptr_type tunnel_;
+
+      // Data from the tunnel waiting to be written to the socket, which
+      // the peer's window keeps within window_.
+      pipeline out_;
+      std::size_t read_size_;
+
+      // The window this end gives, bytes the stream may still send before
+      // the peer gives window back, and bytes written out since the stream
+      // last gave window back.
+      std::size_t window_;
+      std::size_t credit_;
+      std::size_t written_;
+
+      bool reading_;
+      bool connected_;
+
+      // This end's socket has been read to the end, which the peer has
+      // been told; the peer's side has ended, and the socket has been shut
+      // down for sending since.
+      bool ended_;
+      bool peer_ended_;
+      bool shut_down_;
+
+      // The peer has closed the stream, which closes once its queue is
+      // written.
+      bool draining_;
+      bool closed_;
+
+      enum { max_connect_attempts = 2 };
+
+      backend_set* backends_;
+      backend* backend_;
+      std::size_t connect_attempts_;
+      metrics::value_type connect_started_;
+
+      // The encode end's place under the admission limits.
+      admission::ticket ticket_;
+   };
+
+   void mux_tunnel::open_stream(mux::stream_id id)
+   {
+      const mux_stream::ptr_type s(boost::make_shared<mux_stream>(boost::ref(worker_), boost::cref(config_)));
+      attach(s, id);
+      s->open(shared_from_this(), backends_);
+   }
+
+   class bridge : public boost::enable_shared_from_this<bridge>,
+                  public handler_owner<bridge>
+   {
+   public:
+
+      typedef ip::tcp::socket socket_type;
+      typedef boost::shared_ptr<bridge> ptr_type;
+
+      // Blocks for the handlers re-armed for every chunk. A wait on a socket
+      // takes 136 bytes and async_write() of the gathered chunks 488, with
+      // Boost 1.74 on x86-64.
+      typedef handler_memory<192> read_memory;
+      typedef handler_memory<576> write_memory;
+
+      bridge(io_service_pool::worker& worker, const config& config)
+      : worker_(worker),
+        downstream_socket_(worker.io_service),
+        upstream_socket_  (worker.io_service),
+        read_size_(config.chunk_size),
+        min_read_size_(config.adaptive_chunks ? std::min<std::size_t>(config.chunk_size,min_adaptive_read_size)
+                                              : config.chunk_size),
+        max_read_size_(config.adaptive_chunks ? config.max_chunk_size : config.chunk_size),
+        small_reads_(0),
+        max_frame_length_(encoded_length(max_payload_length(config))),
+        max_payload_length_(max_payload_length(config)),
+        max_chunk_size_(config.max_chunk_size),
+        framing_in_(config.framing == framing_binary ? framing_pending : framing_base64),
+        framing_out_(config.framing == framing_binary && !g_encode ? framing_pending : config.framing),
+        xor_key_(config.cipher == cipher_xor ? kKey : 0),
+        ciphertext_ring_(worker.buffers,
+                         2 * encoded_length(config.chunk_size),
+                         2 * max_frame_length_,
+                         b64_terminator),
+        plaintext_out_ (worker,config),
+        ciphertext_out_(worker,config),
+        coalesce_bytes_(config.coalesce_bytes),
+        coalesce_delay_(config.coalesce_delay),
+        coalesce_timer_(worker.io_service),
+        coalescing_(false),
+        backends_(0),
+        backend_(0),
+        connect_attempts_(0),
+        connect_started_(0),
+        first_upstream_write_(0),
+        first_upstream_byte_(false),
+        connect_ticks_(worker.timers.ticks(config.connect_timeout)),
+        idle_ticks_(worker.timers.ticks(config.idle_timeout)),
+        write_ticks_(worker.timers.ticks(config.write_timeout)),
+        timeout_(*this, &bridge::handle_timeout),
+        connecting_(false),
+        connect_timed_out_(false),
+        connect_tick_(0),
+        last_activity_(0),
+        plaintext_write_since_(0),
+        ciphertext_write_since_(0),
+        upstream_options_(config.upstream_options),
+        downstream_quickack_(config.downstream_options.quickack),
+        upstream_quickack_(config.upstream_options.quickack),
+        upstream_rate_(0, 0),
+        downstream_rate_(0, 0),
+        throttle_(*this, &bridge::handle_throttle),
+        trace_id_(g_passthrough ? 0 : worker.sample_trace())
+      #ifdef TCP_PROXY_SPLICE
+        ,splicing_(false)
+      #endif
+      #ifdef TCP_PROXY_IO_URING
+        ,max_in_flight_(config.max_in_flight)
+      #endif
+      #ifdef TCP_PROXY_COROUTINES
+        ,coroutines_(config.io_engine == io_engine_coroutine)
+        ,upstream_wakeup_(worker.io_service)
+        ,downstream_wakeup_(worker.io_service)
+      #endif
+      {
+         throttled_[relay_upstream] = false;
+         throttled_[relay_downstream] = false;
+         ended_[relay_upstream] = false;
+         ended_[relay_downstream] = false;
+         trace_stages_[relay_upstream] = trace_idle;
+         trace_stages_[relay_downstream] = trace_idle;
+
+      #ifdef TCP_PROXY_IO_URING
+         init_uring();
+      #endif
+         ++worker_.active_bridges;
+      }
+
+      ~bridge()
+      {
+      #ifdef TCP_PROXY_SPLICE
+         close_pipes();
+      #endif
+
+         if (backend_)
+         {
+            --backend_->active;
+         }
+
+         --worker_.active_bridges;
+      }
+
+      boost::asio::io_service& io_service()
+      {
+         return worker_.io_service;
+      }
+
+      socket_type& downstream_socket()
+      {
+         // Client socket
+         return downstream_socket_;
+      }
+
+      socket_type& upstream_socket()
+      {
+         // Remote server socket
+         return upstream_socket_;
+      }
+
+      admission::ticket& ticket()
+      {
+         return ticket_;
+      }
+
+      // Before the bridge starts.
+      void limit_rate(std::size_t rate, std::size_t burst)
+      {
+         upstream_rate_ = byte_bucket(rate, burst);
+         downstream_rate_ = byte_bucket(rate, burst);
+      }
+
+      socket_type& ciphertext_socket()
+      {
+         return g_encode ? upstream_socket_ : downstream_socket_;
+      }
+
+      socket_type& plaintext_socket()
+      {
+         return g_encode ? downstream_socket_ : upstream_socket_;
+      }
+
+      void start(backend_set& backends)
+      {
+         metrics().bridges_accepted.add();
+         backends_ = &backends;
+         connect(backends.choose());
+      }
+
+      // Attempt connection to remote server (upstream side), or take an
+      // established one if the loop's pool for that server has one
+      void connect(backend& target)
+      {
+         backend_ = &target;
+         ++backend_->active;
+         ++connect_attempts_;
+
+         connecting_ = true;
+         connect_timed_out_ = false;
+
+         if (connect_ticks_)
+         {
+            connect_tick_ = timers().now();
+            timers().schedule(timeout_, connect_tick_ + connect_ticks_);
+         }
+
+         upstream_pool& pool = worker_.upstream(*backends_, target);
+
+         if (pool.acquire(upstream_socket_, target))
+         {
+            metrics().upstream_pool_hits.add();
+            upstream_connected();
+            return;
+         }
+         else if (pool.enabled())
+         {
+            metrics().upstream_pool_misses.add();
+         }
+
+         connect_started_ = metrics::now();
+
+         if (!upstream_socket_.is_open())
+         {
+            // Buffer sizes only shape the window if set before the handshake
+            boost::system::error_code ec;
+            upstream_socket_.open(target.endpoint().protocol(), ec);
+            apply_buffer_options(upstream_socket_, upstream_options_, ec);
+         }
+
+         upstream_socket_.async_connect(
+              target.endpoint(),
+              boost::bind(&bridge::handle_upstream_connect,
+                   shared_from_this(),
+                   boost::asio::placeholders::error));
+      }
+
+      void handle_upstream_connect(const boost::system::error_code& error)
+      {
+         const metrics::value_type connect_time = metrics::now() - connect_started_;
+         metrics().upstream_connect_time.observe(connect_time);
+
+         if (!error)
+         {
+            backends_->connect_succeeded(*backend_, connect_time);
+            apply_socket_options(upstream_socket_, upstream_options_);
+            upstream_connected();
+         }
+         else if (error != boost::asio::error::operation_aborted || connect_timed_out_)
+         {
+            if (connect_timed_out_)
+            {
+               std::cerr << "upstream connect timeout " << backend_->endpoint() << "\n";
+            }
+            else
+            {
+               std::cerr << "upstream connect fail " << backend_->endpoint() << " " << error << "\n";
+            }
+
+            metrics().upstream_connect_failures.add();
+            backends_->connect_failed(*backend_);
+
+            // Give the client one more try, on another server
+            if (connect_attempts_ < max_connect_attempts && backends_->size() > 1 && downstream_socket_.is_open())
+            {
+               boost::system::error_code ec;
+               upstream_socket_.close(ec);
+
+               backend& failed = *backend_;
+               --failed.active;
+               connect(backends_->choose(&failed));
+            }
+            else
+            {
+               close();
+            }
+         }
+         else
+         {
+            close();
+         }
+      }
+
+      void upstream_connected()
+      {
+         connecting_ = false;
+         touch();
+         schedule_timeout();
+
+         // Reads are done by hand once a socket is readable, so that no
+         // buffer is held while waiting for data.
+         downstream_socket_.non_blocking(true);
+         upstream_socket_.non_blocking(true);
+
+         if (g_passthrough)
+         {
+            start_relay();
+            return;
+         }
+
+      #ifdef TCP_PROXY_COROUTINES
+         if (coroutines_)
+         {
+            start_coroutines();
+         }
+      #endif
+
+         if (framing_out_ != framing_pending)
+         {
+            send_stream_header();
+         }
+
+         read_ciphertext();
+
+         if (framing_out_ != framing_pending)
+         {
+            read_plaintext();
+         }
+      }
+
+   private:
+      static const char b64_terminator = '\n';
+      static const unsigned char binary_preamble = 0;
+
+      metrics::registry& metrics()
+      {
+         return worker_.metrics;
+      }
+
+      bool encrypt(unsigned char* const data,
+                   const size_t length,
+                   unsigned char* const processed,
+                   size_t& processed_length)
+      {
+      #ifdef PRINT_DATA
+         std::cout << "Received " << std::string((const char*)data, length) << "\n";
+      #endif
+         if (cipher_out_.keyed())
+         {
+            cipher_out_.apply(data, length, data);
+         }
+
+         processed_length = xorb64::xorb64enc(data, length, processed, xor_key_);
+         if (processed_length <= 0)
+         {
+            return false;
+         }
+         processed[processed_length] = b64_terminator;
+         ++processed_length;
+      #ifdef PRINT_DATA
+         std::cout << "Send " << std::string((const char*)processed, processed_length) << "\n";
+      #endif
+         return true;
+      }
+
+      // Binary frame of the length prefix and the enciphered data.
+      bool encrypt_binary(const unsigned char* const data,
+                          const size_t length,
+                          unsigned char* const processed,
+                          size_t& processed_length)
+      {
+         processed_length = frame_ring::write_prefix(processed, length);
+
+         if (cipher_out_.keyed())
+         {
+            cipher_out_.apply(data, length, processed + processed_length);
+         }
+         else
+         {
+            xorb64::xorcopy(data, length, processed + processed_length, xor_key_);
+         }
+
+         processed_length += length;
+         return true;
+      }
+
+      static std::size_t binary_frame_length(std::size_t length)
+      {
+         return frame_ring::prefix_length(length) + length;
+      }
+
+      // Decodes a frame that may straddle the end of the receive ring. The
+      // segments are decoded separately; a group of 4 characters split
+      // across them is decoded from a copy. Unless the frame is complete,
+      // it is the start of one and may not be padded.
+      bool decrypt(const frame_ring::frame& frame,
+                   const bool complete,
+                   unsigned char* const processed,
+                   size_t& processed_length)
+      {
+      #ifdef PRINT_DATA
+         std::cout << "Received " << std::string((const char*)frame.first, frame.first_length)
+                                  << std::string((const char*)frame.second, frame.second_length) << "\n";
+      #endif
+         processed_length = 0;
+
+         if (frame.length() == 0 || frame.length() % 4 != 0)
+         {
+            return false;
+         }
+
+         const size_t split = frame.first_length % 4;
+         const size_t first_length = frame.first_length - split;
+
+         if (!decrypt_part(frame.first, first_length, complete && frame.length() == first_length,
+                           processed, processed_length))
+         {
+            return false;
+         }
+
+         const unsigned char* second = frame.second;
+         size_t second_length = frame.second_length;
+
+         if (split != 0)
+         {
+            unsigned char quad[4];
+            std::memcpy(quad, frame.first + first_length, split);
+            std::memcpy(quad + split, second, 4 - split);
+            second += 4 - split;
+            second_length -= 4 - split;
+
+            if (!decrypt_part(quad, 4, complete && second_length == 0, processed, processed_length))
+            {
+               return false;
+            }
+         }
+
+         if (!decrypt_part(second, second_length, complete, processed, processed_length))
+         {
+            return false;
+         }
+
+         if (cipher_in_.keyed())
+         {
+            cipher_in_.apply(processed, processed_length, processed);
+         }
+      #ifdef PRINT_DATA
+         std::cout << "Send " << std::string((const char*)processed, processed_length) << "\n";
+      #endif
+         return true;
+      }
+
+      // Decodes one part of a frame, appending to processed. Padding is only
+      // accepted in the last part, as it would be when decoding in one go.
+      bool decrypt_part(const unsigned char* const data,
+                        const size_t length,
+                        const bool last,
+                        unsigned char* const processed,
+                        size_t& processed_length)
+      {
+         if (length == 0)
+         {
+            return true;
+         }
+
+         const size_t decoded = xorb64::xorb64dec(data, length, processed + processed_length, xor_key_);
+
+         if (decoded == 0 || (!last && decoded != length / 4 * 3))
+         {
+            return false;
+         }
+
+         processed_length += decoded;
+         return true;
+      }
+
+
+      // The payload of a binary frame, which may straddle the end of the
+      // receive ring.
+      void decrypt_binary(const frame_ring::frame& frame, unsigned char* const processed)
+      {
+         if (cipher_in_.keyed())
+         {
+            cipher_in_.apply(frame.first, frame.first_length, processed);
+            cipher_in_.apply(frame.second, frame.second_length, processed + frame.first_length);
+         }
+         else
+         {
+            xorb64::xorcopy(frame.first, frame.first_length, processed, xor_key_);
+            xorb64::xorcopy(frame.second, frame.second_length, processed + frame.first_length, xor_key_);
+         }
+      }
+
+
+      /*
+         Section A: Remote Server --> Proxy --> Client
+         Process data recieved from remote sever then send to client.
+      */
+
+      // Reads are first tried straight away, from a posted handler so that
+      // a busy bridge doesn't starve the others on its loop, and only wait
+      // for readiness when there is nothing to read.
+      void read_ciphertext()
+      {
+         if (throttled(direction_of(ciphertext_socket())))
+         {
+            return;
+         }
+
+         plaintext_out_.reading = true;
+
+      #ifdef TCP_PROXY_IO_URING
+         if (worker_.ring)
+         {
+            schedule_uring_drain(uring_ciphertext);
+            return;
+         }
+      #endif
+
+      #ifdef TCP_PROXY_COROUTINES
+         if (coroutines_)
+         {
+            wake(direction_of(ciphertext_socket()));
+            return;
+         }
+      #endif
+
+         io_service().post(
+              handler(&bridge::handle_ciphertext_readable,
+                   read_memory_[direction_of(ciphertext_socket())]));
+      }
+
+      // Remote server may have data, read it into the receive ring, which
+      // is only backed by a buffer while it holds data
+      void handle_ciphertext_readable(const boost::system::error_code& error)
+      {
+         if (error || !ciphertext_socket().is_open())
+         {
+            handle_ciphertext_read(error ? error : boost::asio::error::operation_aborted, 0);
+            return;
+         }
+
+         boost::system::error_code ec;
+         const size_t bytes_transferred = ciphertext_socket().read_some(ciphertext_ring_.prepare(), ec);
+         keep_quickack(ciphertext_socket());
+
+         if (ec == boost::asio::error::would_block)
+         {
+            ciphertext_ring_.release_if_empty();
+
+            ciphertext_socket().async_wait(socket_type::wait_read,
+                 handler(&bridge::handle_ciphertext_readable,
+                      read_memory_[direction_of(ciphertext_socket())]));
+            return;
+         }
+
+         handle_ciphertext_read(ec, bytes_transferred);
+      }
+
+      // Read from remote server complete, queue the complete frames for the
+      // client and keep reading unless the queue is full
+      void handle_ciphertext_read(const boost::system::error_code& error,
+                                  const size_t& bytes_transferred)
+      {
+         plaintext_out_.reading = false;
+
+         if (!error)
+         {
+            touch();
+            metrics().ciphertext_bytes_read.add(bytes_transferred);
+            charge(direction_of(ciphertext_socket()), bytes_transferred);
+            trace_read(direction_of(ciphertext_socket()), bytes_transferred);
+
+            if (g_encode)
+            {
+               upstream_read_completed();
+            }
+
+            ciphertext_ring_.commit(bytes_transferred);
+
+            if (process_ciphertext() && !plaintext_out_.full())
+            {
+               read_ciphertext();
+            }
+         }
+         else
+         {
+            if (error != boost::asio::error::eof &&
+                error != boost::asio::error::operation_aborted &&
+                error != boost::asio::error::connection_reset)
+            {
+               std::cerr << "ciphertext read fail " << error << "\n";
+            }
+
+            if (error == boost::asio::error::eof)
+            {
+               plaintext_out_.read_eof = true;
+
+               if (plaintext_out_.empty())
+               {
+                  end_direction(direction_of(ciphertext_socket()));
+               }
+            }
+            else
+            {
+               close();
+            }
+         }
+      }
+
+      // Decodes the frames waiting in the receive ring, until the queue to
+      // the client is full. Returns false if the bridge had to be closed.
+      bool process_ciphertext()
+      {
+         if (framing_in_ == framing_pending)
+         {
+            if (ciphertext_ring_.size() == 0)
+            {
+               return true;
+            }
+
+            negotiate_framing();
+         }
+
+         if (!(framing_in_ == framing_binary ? decode_binary_frames() : decode_base64_frames()))
+         {
+            return false;
+         }
+
+         ciphertext_ring_.release_if_empty();
+
+         if (!plaintext_out_.writing && !plaintext_out_.empty())
+         {
+            write_plaintext();
+         }
+
+         return true;
+      }
+
+      // The peer's first byte tells its framing. The accepting end answers
+      // in the same framing, and only now starts reading plaintext.
+      void negotiate_framing()
+      {
+         if (ciphertext_ring_.front() == binary_preamble)
+         {
+            ciphertext_ring_.discard(1);
+            framing_in_ = framing_binary;
+         }
+         else
+         {
+            framing_in_ = framing_base64;
+         }
+
+         if (framing_out_ == framing_pending)
+         {
+            framing_out_ = framing_in_;
+            send_stream_header();
+            read_plaintext();
+         }
+      }
+
+      // What the ciphertext sent starts with, ahead of the first frame: the
+      // binary preamble, and with ChaCha20 a frame of the nonce the stream
+      // is keyed with from then on.
+      void send_stream_header()
+      {
+         if (framing_out_ == framing_binary)
+         {
+            *ciphertext_out_.prepare(1) = binary_preamble;
+            ciphertext_out_.commit(1);
+         }
+
+         if (worker_.cipher_key)
+         {
+            unsigned char nonce[chacha20::nonce_size];
+            worker_.nonces.generate(nonce, sizeof(nonce));
+
+            size_t bytes_to_send;
+
+            if (framing_out_ == framing_binary)
+            {
+               encrypt_binary(nonce, sizeof(nonce), ciphertext_out_.prepare(binary_frame_length(sizeof(nonce))), bytes_to_send);
+            }
+            else
+            {
+               encrypt(nonce, sizeof(nonce), ciphertext_out_.prepare(encoded_length(sizeof(nonce))), bytes_to_send);
+            }
+
+            ciphertext_out_.commit(bytes_to_send);
+            cipher_out_.reset(*worker_.cipher_key, nonce);
+         }
+
+         flush_ciphertext();
+      }
+
+      bool decode_base64_frames()
+      {
+         frame_ring::frame frame;
+
+         while (!plaintext_out_.full())
+         {
+            if (!ciphertext_ring_.next_frame(frame))
+            {
+               if (decodes_frame_starts())
+               {
+                  return decode_frame_start();
+               }
+
+               // Whatever is in the ring is the start of a single frame.
+               if (ciphertext_ring_.size() >= max_frame_length_)
+               {
+                  std::cerr << "ciphertext is too long\n";
+                  metrics().decode_errors.add();
+                  close();
+                  return false;
+               }
+
+               // Keep room to receive the rest of a long frame.
+               if (ciphertext_ring_.size() > ciphertext_ring_.capacity() / 2)
+               {
+                  ciphertext_ring_.grow();
+               }
+
+               break;
+            }
+
+            size_t bytes_to_send;
+
+            if (frame.length() >= max_frame_length_ && !decodes_frame_starts())
+            {
+               std::cerr << "ciphertext is too long\n";
+               metrics().decode_errors.add();
+               close();
+               return false;
+            }
+
+            const metrics::stopwatch transform_time;
+            const size_t decoded_capacity = frame.length() / 4 * 3;
+            unsigned char* const decoded = decode_target(decoded_capacity);
+
+            if (!decrypt(frame,true,decoded,bytes_to_send))
+            {
+               std::cerr << "decrypt fail " << std::string((const char*)frame.first, frame.first_length)
+                                            << std::string((const char*)frame.second, frame.second_length) << "\n";
+               release_decoded(decoded, decoded_capacity);
+               metrics().decode_errors.add();
+               close();
+               return false;
+            }
+
+            ciphertext_ring_.consume(frame);
+
+            if (!queue_decoded(decoded, decoded_capacity, bytes_to_send))
+            {
+               return false;
+            }
+
+            transform_time.observe(metrics().decode_time);
+            metrics().frames_decoded.add();
+         }
+
+         return true;
+      }
+
+      // A frame that can be queued in pieces has no length limit: once the
+      // start of one fills half the receive ring, it is decoded and queued
+      // for the client as far as it has arrived. Compressed frames can only
+      // be decompressed whole, and the nonce frame is taken whole.
+      bool decodes_frame_starts() const
+      {
+         return !worker_.compression && (!worker_.cipher_key || cipher_in_.keyed());
+      }
+
+      // The last whole group of 4 characters is kept back, with any part of
+      // the next, for the end of the frame, where padding is allowed.
+      bool decode_frame_start()
+      {
+         const size_t received = ciphertext_ring_.size();
+
+         if (received <= ciphertext_ring_.capacity() / 2 || received < 8)
+         {
+            return true;
+         }
+
+         const size_t length = received / 4 * 4 - 4;
+         frame_ring::frame frame;
+         ciphertext_ring_.peek(frame, length);
+
+         const metrics::stopwatch transform_time;
+         const size_t decoded_capacity = length / 4 * 3;
+         unsigned char* const decoded = decode_target(decoded_capacity);
+         size_t bytes_to_send;
+
+         if (!decrypt(frame,false,decoded,bytes_to_send))
+         {
+            std::cerr << "decrypt fail in the start of a frame\n";
+            metrics().decode_errors.add();
+            close();
+            return false;
+         }
+
+         ciphertext_ring_.discard(length);
+
+         if (!queue_decoded(decoded, decoded_capacity, bytes_to_send))
+         {
+            return false;
+         }
+
+         transform_time.observe(metrics().decode_time);
+         return true;
+      }
+
+      // Binary frames say how long they are, so a frame too long to accept
+      // is refused as soon as its prefix arrives.
+      bool decode_binary_frames()
+      {
+         frame_ring::frame frame;
+         std::size_t length;
+
+         while (!plaintext_out_.full())
+         {
+            const bool complete = ciphertext_ring_.next_prefixed_frame(frame, length);
+
+            if (length > max_payload_length_)
+            {
+               std::cerr << "binary frame is too long\n";
+               metrics().decode_errors.add();
+               close();
+               return false;
+            }
+
+            if (!complete)
+            {
+               if (ciphertext_ring_.size() > ciphertext_ring_.capacity() / 2)
+               {
+                  ciphertext_ring_.grow();
+               }
+
+               break;
+            }
+
+            const metrics::stopwatch transform_time;
+            const size_t decoded_length = frame.length();
+            unsigned char* const decoded = decode_target(decoded_length);
+
+            decrypt_binary(frame, decoded);
+
+            ciphertext_ring_.consume(frame);
+
+            if (!queue_decoded(decoded, decoded_length, decoded_length))
+            {
+               return false;
+            }
+
+            transform_time.observe(metrics().decode_time);
+            metrics().frames_decoded.add();
+         }
+
+         return true;
+      }
+
+      // Frames are decoded straight into the queue for the client, or with
+      // compression on into a scratch buffer that is decompressed into it.
+      unsigned char* decode_target(const size_t capacity)
+      {
+         return worker_.compression ? worker_.buffers.allocate(capacity)
+                                    : plaintext_out_.prepare(capacity);
+      }
+
+      void release_decoded(unsigned char* const decoded, const size_t capacity)
+      {
+         if (worker_.compression)
+         {
+            worker_.buffers.deallocate(decoded, capacity);
+         }
+      }
+
+      // Queues length bytes decoded into a decode_target() buffer. With
+      // ChaCha20 the first frame is the peer's nonce instead.
+      bool queue_decoded(unsigned char* const decoded, const size_t capacity, const size_t length)
+      {
+         if (worker_.cipher_key && !cipher_in_.keyed())
+         {
+            const bool result = (length == chacha20::nonce_size);
+
+            if (result)
+            {
+               cipher_in_.reset(*worker_.cipher_key, decoded);
+            }
+
+            release_decoded(decoded, capacity);
+
+            if (!result)
+            {
+               std::cerr << "cipher nonce fail\n";
+               metrics().decode_errors.add();
+               close();
+            }
+
+            return result;
+         }
+
+         if (!worker_.compression)
+         {
+            plaintext_out_.commit(length);
+            trace_queued(direction_of(ciphertext_socket()));
+            return true;
+         }
+
+         size_t chunk_length = 0;
+         const bool result = worker_.compression->decompress(decoded, length,
+                                                             plaintext_out_.prepare(max_chunk_size_),
+                                                             max_chunk_size_,
+                                                             chunk_length);
+         worker_.buffers.deallocate(decoded, capacity);
+
+         if (!result)
+         {
+            std::cerr << "decompress fail\n";
+            metrics().decode_errors.add();
+            close();
+            return false;
+         }
+
+         plaintext_out_.commit(chunk_length);
+         trace_queued(direction_of(ciphertext_socket()));
+         return true;
+      }
+
+      void write_plaintext()
+      {
+         if (!g_encode)
+         {
+            upstream_write_started();
+         }
+
+         write_started(plaintext_write_since_);
+         trace_write_started(direction_of(ciphertext_socket()));
+
+      #ifdef TCP_PROXY_IO_URING
+         if (worker_.ring)
+         {
+            send_uring(uring_plaintext, plaintext_out_.begin_write());
+            return;
+         }
+      #endif
+
+      #ifdef TCP_PROXY_COROUTINES
+         if (coroutines_)
+         {
+            plaintext_out_.begin_write();
+            wake(direction_of(ciphertext_socket()));
+            return;
+         }
+      #endif
+
+         async_write(plaintext_socket(),
+              plaintext_out_.begin_write(),
+              handler(&bridge::handle_plaintext_write,
+                   write_memory_[direction_of(ciphertext_socket())]));
+      }
+
+      // Write to client complete, write the chunks queued meanwhile and
+      // resume reading from remote server if it was held back by a full queue
+      void handle_plaintext_write(const boost::system::error_code& error,
+                                  const size_t& bytes_transferred)
+      {
+         plaintext_out_.end_write();
+         metrics().plaintext_bytes_written.add(bytes_transferred);
+
+         if (!error)
+         {
+            trace_written(direction_of(ciphertext_socket()));
+
+            // Picks up frames held back in the ring by a full queue and
+            // writes everything queued.
+            if (!process_ciphertext())
+            {
+               return;
+            }
+
+            if (plaintext_out_.empty() && plaintext_out_.read_eof)
+            {
+               end_direction(direction_of(ciphertext_socket()));
+               return;
+            }
+
+            if (!plaintext_out_.reading && !plaintext_out_.read_eof && !plaintext_out_.full())
+            {
+               read_ciphertext();
+            }
+         }
+         else
+         {
+            if (error != boost::asio::error::connection_reset &&
+                error != boost::asio::error::operation_aborted)
+            {
+               std::cerr << "plaintext write fail " << error << "\n";
+            }
+            close();
+         }
+      }
+      // *** End Of Section A ***
+
+
+      /*
+         Section B: Client --> Proxy --> Remove Server
+         Process data recieved from client then write to remove server.
+      */
+
+      void read_plaintext()
+      {
+         if (throttled(direction_of(plaintext_socket())))
+         {
+            return;
+         }
+
+         ciphertext_out_.reading = true;
+
+      #ifdef TCP_PROXY_IO_URING
+         if (worker_.ring)
+         {
+            schedule_uring_drain(uring_plaintext);
+            return;
+         }
+      #endif
+
+      #ifdef TCP_PROXY_COROUTINES
+         if (coroutines_)
+         {
+            wake(direction_of(plaintext_socket()));
+            return;
+         }
+      #endif
+
+         io_service().post(
+              handler(&bridge::handle_plaintext_readable,
+                   read_memory_[direction_of(plaintext_socket())]));
+      }
+
+      // Client may have data, read it into a buffer that is only checked
+      // out for as long as it takes to encode it
+      void handle_plaintext_readable(const boost::system::error_code& error)
+      {
+         if (error || !plaintext_socket().is_open())
+         {
+            handle_plaintext_read(error ? error : boost::asio::error::operation_aborted, 0, 0);
+            return;
+         }
+
+         const size_t read_size = read_size_;
+         unsigned char* const data = worker_.buffers.allocate(read_size);
+         boost::system::error_code ec;
+         const size_t bytes_transferred =
+            plaintext_socket().read_some(boost::asio::buffer(data,read_size), ec);
+         keep_quickack(plaintext_socket());
+
+         if (ec == boost::asio::error::would_block)
+         {
+            worker_.buffers.deallocate(data,read_size);
+
+            plaintext_socket().async_wait(socket_type::wait_read,
+                 handler(&bridge::handle_plaintext_readable,
+                      read_memory_[direction_of(plaintext_socket())]));
+            return;
+         }
+
+         if (!ec)
+         {
+            adapt_read_size(bytes_transferred);
+         }
+
+         handle_plaintext_read(ec, data, bytes_transferred);
+         worker_.buffers.deallocate(data,read_size);
+      }
+
+      // Doubles the read size after a read that filled the buffer, and
+      // halves it after a run of reads that used less than a quarter of it.
+      void adapt_read_size(const size_t bytes_transferred)
+      {
+         if (bytes_transferred == read_size_)
+         {
+            read_size_ = std::min(2 * read_size_, max_read_size_);
+            small_reads_ = 0;
+         }
+         else if (bytes_transferred < read_size_ / 4)
+         {
+            if (++small_reads_ >= small_reads_to_shrink)
+            {
+               read_size_ = std::max(read_size_ / 2, min_read_size_);
+               small_reads_ = 0;
+            }
+         }
+         else
+         {
+            small_reads_ = 0;
+         }
+      }
+
+      // Read from client complete, queue the data for the remote server and
+      // keep reading unless the queue is full
+      void handle_plaintext_read(const boost::system::error_code& error,
+                                 unsigned char* const data,
+                                 const size_t& bytes_transferred)
+      {
+         ciphertext_out_.reading = false;
+
+         if (!error)
+         {
+            touch();
+            metrics().plaintext_bytes_read.add(bytes_transferred);
+            charge(direction_of(plaintext_socket()), bytes_transferred);
+            trace_read(direction_of(plaintext_socket()), bytes_transferred);
+
+            if (!g_encode)
+            {
+               upstream_read_completed();
+            }
+
+            bool result;
+            size_t bytes_to_send;
+            const metrics::stopwatch transform_time;
+
+            // Compressed into a scratch buffer, which is then framed.
+            unsigned char* chunk = data;
+            size_t chunk_length = bytes_transferred;
+            unsigned char* packed = 0;
+            size_t packed_capacity = 0;
+
+            if (worker_.compression)
+            {
+               packed_capacity = worker_.compression->bound(bytes_transferred);
+               packed = worker_.buffers.allocate(packed_capacity);
+               chunk_length = worker_.compression->compress(data, bytes_transferred, packed);
+               chunk = packed;
+               metrics().compression_bytes_in.add(bytes_transferred);
+               metrics().compression_bytes_out.add(chunk_length);
+            }
+
+            if (framing_out_ == framing_binary)
+            {
+               result = encrypt_binary(chunk,chunk_length,ciphertext_out_.prepare(binary_frame_length(chunk_length)),bytes_to_send);
+            }
+            else
+            {
+               result = encrypt(chunk,chunk_length,ciphertext_out_.prepare(encoded_length(chunk_length)),bytes_to_send);
+            }
+
+            if (packed)
+            {
+               worker_.buffers.deallocate(packed, packed_capacity);
+            }
+
+            if (!result)
+            {
+               std::cerr << "encrypt fail " << std::string((const char*)data, bytes_transferred) << "\n";
+               metrics().encode_errors.add();
+               close();
+            }
+            else
+            {
+               transform_time.observe(metrics().encode_time);
+               metrics().frames_encoded.add();
+               ciphertext_out_.commit(bytes_to_send);
+               trace_queued(direction_of(plaintext_socket()));
+               flush_ciphertext();
+
+               if (!ciphertext_out_.full())
+               {
+                  read_plaintext();
+               }
+            }
+         }
+         else
+         {
+            if (error != boost::asio::error::eof &&
+                error != boost::asio::error::operation_aborted &&
+                error != boost::asio::error::connection_reset)
+            {
+               std::cerr << "plaintext read fail " << error << "\n";
+            }
+
+            if (error == boost::asio::error::eof)
+            {
+               ciphertext_out_.read_eof = true;
+
+               if (ciphertext_out_.empty())
+               {
+                  end_direction(direction_of(plaintext_socket()));
+               }
+               else
+               {
+                  flush_ciphertext();
+               }
+            }
+            else
+            {
+               close();
+            }
+         }
+      }
+
+      // Starts a write of the queued frames unless they are being held back
+      // to coalesce with the frames that follow. They are held for at most
+      // coalesce_delay_ and only while less than coalesce_bytes_ is queued.
+      void flush_ciphertext()
+      {
+         if (ciphertext_out_.writing || ciphertext_out_.empty())
+         {
+            return;
+         }
+
+         if (coalesce_delay_ == 0 ||
+             ciphertext_out_.read_eof ||
+             ciphertext_out_.full() ||
+             ciphertext_out_.queued_bytes() >= coalesce_bytes_)
+         {
+            if (coalescing_)
+            {
+               coalesce_timer_.cancel();
+            }
+
+            write_ciphertext();
+         }
+         else if (!coalescing_)
+         {
+            coalescing_ = true;
+
+            coalesce_timer_.expires_from_now(boost::posix_time::microseconds(coalesce_delay_));
+            coalesce_timer_.async_wait(
+                 boost::bind(&bridge::handle_coalesce_timeout,
+                      shared_from_this(),
+                      boost::asio::placeholders::error));
+         }
+      }
+
+      void handle_coalesce_timeout(const boost::system::error_code& error)
+      {
+         coalescing_ = false;
+
+         if (!error && !ciphertext_out_.writing && !ciphertext_out_.empty())
+         {
+            write_ciphertext();
+         }
+      }
+
+      void write_ciphertext()
+      {
+         if (g_encode)
+         {
+            upstream_write_started();
+         }
+
+         write_started(ciphertext_write_since_);
+         trace_write_started(direction_of(plaintext_socket()));
+
+      #ifdef TCP_PROXY_IO_URING
+         if (worker_.ring)
+         {
+            send_uring(uring_ciphertext, ciphertext_out_.begin_write());
+            return;
+         }
+      #endif
+
+      #ifdef TCP_PROXY_COROUTINES
+         if (coroutines_)
+         {
+            ciphertext_out_.begin_write();
+            wake(direction_of(plaintext_socket()));
+            return;
+         }
+      #endif
+
+         async_write(ciphertext_socket(),
+              ciphertext_out_.begin_write(),
+              handler(&bridge::handle_ciphertext_write,
+                   write_memory_[direction_of(plaintext_socket())]));
+      }
+
+      // Write to remote server complete, write the chunks queued meanwhile
+      // and resume reading from client if it was held back by a full queue
+      void handle_ciphertext_write(const boost::system::error_code& error,
+                                  const size_t& bytes_transferred)
+      {
+         ciphertext_out_.end_write();
+         metrics().ciphertext_bytes_written.add(bytes_transferred);
+
+         if (!error)
+         {
+            trace_written(direction_of(plaintext_socket()));
+
+            if (ciphertext_out_.empty() && ciphertext_out_.read_eof)
+            {
+               end_direction(direction_of(plaintext_socket()));
+               return;
+            }
+
+            flush_ciphertext();
+
+            if (!ciphertext_out_.reading && !ciphertext_out_.read_eof && !ciphertext_out_.full())
+            {
+               read_plaintext();
+            }
+         }
+         else
+         {
+            if (error != boost::asio::error::connection_reset &&
+                error != boost::asio::error::operation_aborted)
+            {
+               std::cerr << "ciphertext write fail " << error << "\n";
+            }
+            close();
+         }
+      }
+      // *** End Of Section B ***
+
+      /*
+         Section C: Client <--> Proxy <--> Remote Server, untransformed
+         Each direction moves the bytes from one socket to the other as
+         they are. With splice() they go through a pipe and never enter
+         user space; otherwise they are read into a pool buffer and written
+         back out.
+      */
+
+      enum relay_direction
+      {
+         relay_upstream = 0,   // client to remote server
+         relay_downstream = 1  // remote server to client
+      };
+
+      struct relay
+      {
+         relay()
+         : pipe_bytes(0),
+           buffer(0),
+           buffer_capacity(0),
+           writing(false),
+           write_since(0)
+         {
+            pipe_fds[0] = -1;
+            pipe_fds[1] = -1;
+         }
+
+         // splice(): the pipe, and the bytes it holds
+         int pipe_fds[2];
+         std::size_t pipe_bytes;
+
+         // Fallback: the chunk being written
+         unsigned char* buffer;
+         std::size_t buffer_capacity;
+
+         // Waiting on the sink, since the given tick.
+         bool writing;
+         timer_wheel::tick_type write_since;
+      };
+
+      socket_type& relay_source(std::size_t d)
+      {
+         return (d == relay_upstream) ? downstream_socket_ : upstream_socket_;
+      }
+
+      socket_type& relay_sink(std::size_t d)
+      {
+         return (d == relay_upstream) ? upstream_socket_ : downstream_socket_;
+      }
+
+      void start_relay()
+      {
+      #ifdef TCP_PROXY_SPLICE
+         splicing_ = open_pipes();
+      #endif
+
+         for (std::size_t d = 0; d < 2; ++d)
+         {
+            io_service().post(pump_handler(d));
+         }
+      }
+
+      // Moves what there is in direction d, then waits for the socket that
+      // held it up.
+      void pump(std::size_t d, const boost::system::error_code& error)
+      {
+         if (error || !relay_source(d).is_open())
+         {
+            close();
+            return;
+         }
+
+         if (throttled(d))
+         {
+            return;
+         }
+
+      #ifdef TCP_PROXY_SPLICE
+         if (splicing_)
+         {
+            splice_pump(d);
+            return;
+         }
+      #endif
+
+         copy_pump(d);
+      }
+
+      void pump_upstream(const boost::system::error_code& error)
+      {
+         pump(relay_upstream, error);
+      }
+
+      void pump_downstream(const boost::system::error_code& error)
+      {
+         pump(relay_downstream, error);
+      }
+
+      owned_handler<bridge, void (bridge::*)(const boost::system::error_code&), read_memory>
+      pump_handler(std::size_t d)
+      {
+         return handler((d == relay_upstream) ? &bridge::pump_upstream : &bridge::pump_downstream,
+                        read_memory_[d]);
+      }
+
+      void wait_relay(std::size_t d, socket_type& socket, socket_type::wait_type what)
+      {
+         socket.async_wait(what, pump_handler(d));
+      }
+
+      void relayed(std::size_t d, std::size_t bytes)
+      {
+         touch();
+         charge(d, bytes);
+
+         if (d == relay_upstream)
+         {
+            metrics().upstream_bytes_relayed.add(bytes);
+            upstream_write_started();
+         }
+         else
+         {
+            metrics().downstream_bytes_relayed.add(bytes);
+            upstream_read_completed();
+         }
+      }
+
+   #ifdef TCP_PROXY_SPLICE
+      bool open_pipes()
+      {
+         for (std::size_t d = 0; d < 2; ++d)
+         {
+            if (::pipe2(relay_[d].pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+            {
+               close_pipes();
+               return false;
+            }
+         }
+
+         return true;
+      }
+
+      void close_pipes()
+      {
+         for (std::size_t d = 0; d < 2; ++d)
+         {
+            for (std::size_t i = 0; i < 2; ++i)
+            {
+               if (relay_[d].pipe_fds[i] >= 0)
+               {
+                  ::close(relay_[d].pipe_fds[i]);
+                  relay_[d].pipe_fds[i] = -1;
+               }
+            }
+         }
+      }
+
+      void splice_pump(std::size_t d)
+      {
+         relay& r = relay_[d];
+         const int source = relay_source(d).native_handle();
+         const int sink = relay_sink(d).native_handle();
+         std::size_t moved = 0;
+
+         // Yield to the other bridges on the loop after a burst.
+         while (moved < max_relay_burst)
+         {
+            if (r.pipe_bytes > 0)
+            {
+               const ssize_t n = ::splice(r.pipe_fds[0], 0, sink, 0, r.pipe_bytes,
+                                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+               if (n > 0)
+               {
+                  r.pipe_bytes -= n;
+                  moved += n;
+                  r.writing = false;
+                  relayed(d, n);
+               }
+               else if (n < 0 && errno == EAGAIN)
+               {
+                  if (!r.writing)
+                  {
+                     r.writing = true;
+                     write_started(r.write_since);
+                  }
+
+                  wait_relay(d, relay_sink(d), socket_type::wait_write);
+                  return;
+               }
+               else if (n < 0 && errno == EINTR)
+               {
+                  continue;
+               }
+               else
+               {
+                  relay_failed(errno);
+                  return;
+               }
+            }
+            else
+            {
+               const ssize_t n = ::splice(source, 0, r.pipe_fds[1], 0, max_relay_burst,
+                                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+               if (n > 0)
+               {
+                  r.pipe_bytes += n;
+               }
+               else if (n == 0)
+               {
+                  // End of stream, with everything read written out.
+                  end_direction(d);
+                  return;
+               }
+               else if (errno == EAGAIN)
+               {
+                  wait_relay(d, relay_source(d), socket_type::wait_read);
+                  return;
+               }
+               else if (errno != EINTR)
+               {
+                  relay_failed(errno);
+                  return;
+               }
+            }
+         }
+
+         io_service().post(pump_handler(d));
+      }
+
+      void relay_failed(int error)
+      {
+         if (error != ECONNRESET && error != EPIPE && error != EBADF)
+         {
+            std::cerr << "relay fail " << boost::system::error_code(error, boost::system::system_category()) << "\n";
+         }
+
+         close();
+      }
+   #endif
+
+      void copy_pump(std::size_t d)
+      {
+         relay& r = relay_[d];
+         r.buffer_capacity = read_size_;
+         r.buffer = worker_.buffers.allocate(r.buffer_capacity);
+
+         boost::system::error_code ec;
+         const size_t bytes_transferred =
+            relay_source(d).read_some(boost::asio::buffer(r.buffer, r.buffer_capacity), ec);
+         keep_quickack(relay_source(d));
+
+         if (ec == boost::asio::error::would_block)
+         {
+            release_relay_buffer(r);
+            wait_relay(d, relay_source(d), socket_type::wait_read);
+            return;
+         }
+         else if (ec)
+         {
+            if (ec != boost::asio::error::eof &&
+                ec != boost::asio::error::operation_aborted &&
+                ec != boost::asio::error::connection_reset)
+            {
+               std::cerr << "relay read fail " << ec << "\n";
+            }
+
+            release_relay_buffer(r);
+
+            if (ec == boost::asio::error::eof)
+            {
+               end_direction(d);
+            }
+            else
+            {
+               close();
+            }
+
+            return;
+         }
+
+         r.writing = true;
+         write_started(r.write_since);
+
+         async_write(relay_sink(d),
+              boost::asio::buffer(r.buffer, bytes_transferred),
+              handler((d == relay_upstream) ? &bridge::handle_upstream_relay_write
+                                            : &bridge::handle_downstream_relay_write,
+                      write_memory_[d]));
+      }
+
+      void handle_upstream_relay_write(const boost::system::error_code& error,
+                                       const size_t& bytes_transferred)
+      {
+         handle_relay_write(relay_upstream, error, bytes_transferred);
+      }
+
+      void handle_downstream_relay_write(const boost::system::error_code& error,
+                                         const size_t& bytes_transferred)
+      {
+         handle_relay_write(relay_downstream, error, bytes_transferred);
+      }
+
+      void handle_relay_write(std::size_t d,
+                              const boost::system::error_code& error,
+                              const size_t& bytes_transferred)
+      {
+         release_relay_buffer(relay_[d]);
+         relay_[d].writing = false;
+
+         if (error)
+         {
+            if (error != boost::asio::error::connection_reset &&
+                error != boost::asio::error::operation_aborted)
+            {
+               std::cerr << "relay write fail " << error << "\n";
+            }
+
+            close();
+            return;
+         }
+
+         relayed(d, bytes_transferred);
+         pump(d, error);
+      }
+
+      void release_relay_buffer(relay& r)
+      {
+         if (r.buffer)
+         {
+            worker_.buffers.deallocate(r.buffer, r.buffer_capacity);
+            r.buffer = 0;
+         }
+      }
+      // *** End Of Section C ***
+
+   #ifdef TCP_PROXY_IO_URING
+      /*
+         Section D: io_uring
+         The sockets of Sections A and B are read and written by the loop's
+         ring instead of the reactor. A socket is read by one multishot
+         receive, which stays armed while its queue has room. The data
+         arrives in buffers registered with the kernel; each is queued in
+         the socket's backlog until it has been handed to the same handlers
+         the reactor reads feed, then given back to the ring.
+      */
+
+      enum uring_socket_index
+      {
+         uring_ciphertext = 0,
+         uring_plaintext = 1
+      };
+
+      // A request made for one of the sockets. The bridge is kept alive
+      // until its final completion.
+      class uring_request : public uring::operation
+      {
+      public:
+
+         typedef void (bridge::*handler_type)(std::size_t, int, unsigned);
+
+         uring_request()
+         : armed(false),
+           cancelled(false),
+           owner_(0),
+           handler_(0),
+           index_(0)
+         {}
+
+         void init(bridge* owner, handler_type handler, std::size_t index)
+         {
+            owner_ = owner;
+            handler_ = handler;
+            index_ = index;
+         }
+
+         void arm(const ptr_type& self)
+         {
+            armed = true;
+            cancelled = false;
+            self_ = self;
+         }
+
+         virtual void complete(int result, unsigned flags)
+         {
+            const ptr_type self(self_);
+
+            if (!(flags & IORING_CQE_F_MORE))
+            {
+               armed = false;
+               self_.reset();
+            }
+
+            (owner_->*handler_)(index_, result, flags);
+         }
+
+         bool armed;
+         bool cancelled;
+
+      private:
+
+         bridge* owner_;
+         handler_type handler_;
+         std::size_t index_;
+         ptr_type self_;
+      };
+
+      struct uring_receive
+      {
+         uring_receive()
+         : backlog_bytes(0),
+           ended(false),
+           drain_posted(false)
+         {}
+
+         // Data received and not yet consumed, in a ring buffer or, once
+         // the queue it is for is full, in a copy from the pool.
+         struct received
+         {
+            unsigned id;
+            unsigned char* spilled;
+            std::size_t offset;
+            std::size_t length;
+         };
+
+         uring_request request;
+         std::deque<received> backlog;
+         std::size_t backlog_bytes;
+
+         // The receive ended with end_error, which is reported once the
+         // backlog has been consumed.
+         bool ended;
+         boost::system::error_code end_error;
+
+         bool drain_posted;
+      };
+
+      struct uring_send
+      {
+         uring_request request;
+         std::vector<iovec> iov;
+         std::size_t next_iov;
+         msghdr message;
+         std::size_t total;
+         std::size_t sent;
+      };
+
+      uring& ring()
+      {
+         return *worker_.ring;
+      }
+
+      socket_type& uring_socket(std::size_t d)
+      {
+         return (d == uring_ciphertext) ? ciphertext_socket() : plaintext_socket();
+      }
+
+      // The queue filled from socket d.
+      pipeline& uring_inbound(std::size_t d)
+      {
+         return (d == uring_ciphertext) ? plaintext_out_ : ciphertext_out_;
+      }
+
+      void init_uring()
+      {
+         for (std::size_t d = 0; d < 2; ++d)
+         {
+            uring_receives_[d].request.init(this, &bridge::handle_uring_received, d);
+            uring_sends_[d].request.init(this, &bridge::handle_uring_sent, d);
+         }
+      }
+
+      // Continues a read of socket d: hands the next piece of its backlog
+      // to the read handler, or waits for the receive to deliver more.
+      void schedule_uring_drain(std::size_t d)
+      {
+         uring_receive& r = uring_receives_[d];
+
+         if (!r.drain_posted && uring_inbound(d).reading)
+         {
+            r.drain_posted = true;
+
+            io_service().post(
+                 boost::bind(&bridge::drain_uring_receive,
+                      shared_from_this(),
+                      d));
+         }
+      }
+
+      void drain_uring_receive(std::size_t d)
+      {
+         uring_receive& r = uring_receives_[d];
+         r.drain_posted = false;
+
+         if (!uring_inbound(d).reading)
+         {
+            return;
+         }
+
+         if (!uring_socket(d).is_open())
+         {
+            uring_read_completed(d, boost::asio::error::operation_aborted, 0, 0);
+            return;
+         }
+
+         if (r.backlog.empty())
+         {
+            if (r.ended)
+            {
+               uring_read_completed(d, r.end_error, 0, 0);
+            }
+            else if (!r.request.armed)
+            {
+               r.request.arm(shared_from_this());
+               ring().recv_multishot(uring_socket(d).native_handle(), r.request);
+            }
+
+            return;
+         }
+
+         uring_receive::received& front = r.backlog.front();
+         unsigned char* const data = received_data(front);
+
+         if (d == uring_plaintext)
+         {
+            // Encoded straight out of the ring buffer.
+            const uring_receive::received consumed = front;
+            r.backlog.pop_front();
+            r.backlog_bytes -= consumed.length;
+            uring_read_completed(d, boost::system::error_code(), data, consumed.length);
+            release_received(consumed);
+            spill_if_held_back(d);
+            return;
+         }
+
+         // Ciphertext is copied into the receive ring, where frames can be
+         // split over several reads.
+         const frame_ring::buffers_type buffers = ciphertext_ring_.prepare();
+         std::size_t copied = 0;
+
+         for (std::size_t i = 0; i < buffers.size() && copied < front.length; ++i)
+         {
+            const std::size_t n = std::min(front.length - copied, boost::asio::buffer_size(buffers[i]));
+            std::memcpy(boost::asio::buffer_cast<unsigned char*>(buffers[i]), data + copied, n);
+            copied += n;
+         }
+
+         front.offset += copied;
+         front.length -= copied;
+         r.backlog_bytes -= copied;
+
+         if (front.length == 0)
+         {
+            release_received(front);
+            r.backlog.pop_front();
+         }
+
+         uring_read_completed(d, boost::system::error_code(), 0, copied);
+         spill_if_held_back(d);
+      }
+
+      unsigned char* received_data(const uring_receive::received& data)
+      {
+         return (data.spilled ? data.spilled : ring().buffer(data.id)) + data.offset;
+      }
+
+      void release_received(const uring_receive::received& data)
+      {
+         if (data.spilled)
+         {
+            worker_.buffers.deallocate(data.spilled, data.offset + data.length);
+         }
+         else
+         {
+            ring().recycle(data.id);
+         }
+      }
+
+      // The ring buffers are shared by every bridge on the loop, so a
+      // bridge whose queue is full gives back those it holds, keeping
+      // copies; otherwise bridges waiting on each other could hold all of
+      // them. The receive goes on into the backlog, up to the in-flight
+      // bound, then stops until the queue has room again.
+      void spill_if_held_back(std::size_t d)
+      {
+         if (uring_inbound(d).reading || !uring_socket(d).is_open())
+         {
+            return;
+         }
+
+         uring_receive& r = uring_receives_[d];
+
+         for (std::size_t i = 0; i < r.backlog.size(); ++i)
+         {
+            spill(r.backlog[i]);
+         }
+
+         if (r.backlog_bytes >= max_in_flight_)
+         {
+            cancel_uring(r.request);
+         }
+      }
+
+      void spill(uring_receive::received& data)
+      {
+         if (data.spilled)
+         {
+            return;
+         }
+
+         // Allocated and released with the same size, offset + length.
+         data.spilled = worker_.buffers.allocate(data.length);
+         std::memcpy(data.spilled, ring().buffer(data.id) + data.offset, data.length);
+         ring().recycle(data.id);
+         data.offset = 0;
+      }
+
+      void uring_read_completed(std::size_t d,
+                                const boost::system::error_code& error,
+                                unsigned char* const data,
+                                const size_t bytes_transferred)
+      {
+         if (d == uring_ciphertext)
+         {
+            handle_ciphertext_read(error, bytes_transferred);
+         }
+         else
+         {
+            handle_plaintext_read(error, data, bytes_transferred);
+         }
+      }
+
+      void handle_uring_received(std::size_t d, int result, unsigned flags)
+      {
+         uring_receive& r = uring_receives_[d];
+         const bool open = uring_socket(d).is_open();
+
+         if (uring::has_buffer(flags))
+         {
+            if (result > 0 && open)
+            {
+               uring_receive::received data = { uring::buffer_id(flags), 0, 0, static_cast<std::size_t>(result) };
+
+               if (!uring_inbound(d).reading)
+               {
+                  spill(data);
+               }
+
+               r.backlog.push_back(data);
+               r.backlog_bytes += data.length;
+            }
+            else
+            {
+               ring().recycle(uring::buffer_id(flags));
+            }
+         }
+
+         if (result == 0)
+         {
+            r.ended = true;
+            r.end_error = boost::asio::error::eof;
+         }
+         else if (result == -ENOBUFS)
+         {
+            // Every ring buffer is held by some bridge; resumes once one is
+            // given back.
+            if (!r.request.armed && open && uring_inbound(d).reading)
+            {
+               r.request.arm(shared_from_this());
+               ring().recv_multishot_when_buffers(uring_socket(d).native_handle(), r.request);
+            }
+
+            return;
+         }
+         else if (result < 0 && result != -ECANCELED)
+         {
+            r.ended = true;
+            r.end_error = boost::system::error_code(-result, boost::system::system_category());
+         }
+
+         if (!uring_inbound(d).reading)
+         {
+            if (r.backlog_bytes >= max_in_flight_)
+            {
+               cancel_uring(r.request);
+            }
+
+            return;
+         }
+
+         schedule_uring_drain(d);
+      }
+
+      // Writes the gathered chunks to socket d, resubmitting the remainder
+      // of partial sends.
+      void send_uring(std::size_t d, const pipeline::buffers_type& buffers)
+      {
+         uring_send& s = uring_sends_[d];
+         s.iov.clear();
+         s.next_iov = 0;
+         s.total = 0;
+         s.sent = 0;
+
+         for (std::size_t i = 0; i < buffers.size(); ++i)
+         {
+            iovec v;
+            v.iov_base = const_cast<void*>(boost::asio::buffer_cast<const void*>(buffers[i]));
+            v.iov_len = boost::asio::buffer_size(buffers[i]);
+            s.iov.push_back(v);
+            s.total += v.iov_len;
+         }
+
+         submit_uring_send(d);
+      }
+
+      void submit_uring_send(std::size_t d)
+      {
+         uring_send& s = uring_sends_[d];
+
+         std::memset(&s.message, 0, sizeof(s.message));
+         s.message.msg_iov = &s.iov[s.next_iov];
+         s.message.msg_iovlen = s.iov.size() - s.next_iov;
+
+         s.request.arm(shared_from_this());
+         ring().sendmsg(uring_socket(d).native_handle(), &s.message, s.request);
+      }
+
+      void handle_uring_sent(std::size_t d, int result, unsigned)
+      {
+         uring_send& s = uring_sends_[d];
+         boost::system::error_code error;
+
+         if (result >= 0)
+         {
+            s.sent += static_cast<std::size_t>(result);
+
+            for (std::size_t n = static_cast<std::size_t>(result); n > 0; )
+            {
+               iovec& v = s.iov[s.next_iov];
+               const std::size_t advance = std::min(n, v.iov_len);
+               v.iov_base = static_cast<unsigned char*>(v.iov_base) + advance;
+               v.iov_len -= advance;
+               n -= advance;
+
+               if (v.iov_len == 0)
+               {
+                  ++s.next_iov;
+               }
+            }
+
+            if (s.sent < s.total)
+            {
+               if (uring_socket(d).is_open())
+               {
+                  submit_uring_send(d);
+                  return;
+               }
+
+               error = boost::asio::error::operation_aborted;
+            }
+         }
+         else if (result == -ECANCELED)
+         {
+            error = boost::asio::error::operation_aborted;
+         }
+         else
+         {
+            error = boost::system::error_code(-result, boost::system::system_category());
+         }
+
+         if (d == uring_ciphertext)
+         {
+            handle_ciphertext_write(error, s.sent);
+         }
+         else
+         {
+            handle_plaintext_write(error, s.sent);
+         }
+      }
+
+      void cancel_uring(uring_request& request)
+      {
+         if (request.armed && !request.cancelled)
+         {
+            request.cancelled = true;
+            ring().cancel(request);
+         }
+      }
+
+      // Cancels everything outstanding and gets the cancellations to the
+      // kernel before the sockets are closed.
+      void close_uring()
+      {
+         for (std::size_t d = 0; d < 2; ++d)
+         {
+            uring_receive& r = uring_receives_[d];
+
+            cancel_uring(r.request);
+            cancel_uring(uring_sends_[d].request);
+
+            while (!r.backlog.empty())
+            {
+               release_received(r.backlog.front());
+               r.backlog.pop_front();
+            }
+
+            r.backlog_bytes = 0;
+         }
+
+         ring().flush();
+      }
+      // *** End Of Section D ***
+   #endif
+
+   #ifdef TCP_PROXY_COROUTINES
+      /*
+         Section E: coroutines
+         The sockets of Sections A and B are read and written by four
+         coroutines instead of handlers that re-arm one another: a reader
+         and a writer for each direction, each a loop over its socket. Their
+         completions go to the same handlers as the reactor's, which queue
+         and write what was read, and set the reading and writing flags of
+         the pipelines to say what should happen next; instead of starting
+         the next read or write, they wake the coroutines of the direction.
+         A coroutine with nothing to do parks on its direction's wakeup, and
+         finishes once its socket is closed.
+      */
+
+      // The coroutines hold the bridge for as long as they run.
+      void start_coroutines()
+      {
+         const ptr_type self(shared_from_this());
+
+         boost::asio::co_spawn(io_service(), read_ciphertext_loop(self), boost::asio::detached);
+         boost::asio::co_spawn(io_service(), write_plaintext_loop(self), boost::asio::detached);
+         boost::asio::co_spawn(io_service(), read_plaintext_loop(self), boost::asio::detached);
+         boost::asio::co_spawn(io_service(), write_ciphertext_loop(self), boost::asio::detached);
+      }
+
+      // Resumes the coroutines of direction d.
+      void wake(std::size_t d)
+      {
+         ((d == relay_upstream) ? upstream_wakeup_ : downstream_wakeup_).signal();
+      }
+
+      boost::asio::awaitable<void> park(std::size_t d)
+      {
+         return ((d == relay_upstream) ? upstream_wakeup_ : downstream_wakeup_).wait();
+      }
+
+      // Like the reactor's reads, each read is first tried straight away,
+      // after yielding to the loop's other bridges, and only waits for
+      // readiness when there is nothing to read.
+      boost::asio::awaitable<void> read_ciphertext_loop(ptr_type)
+      {
+         const std::size_t d = direction_of(ciphertext_socket());
+
+         for (;;)
+         {
+            while (ciphertext_socket().is_open() && !plaintext_out_.reading)
+            {
+               co_await park(d);
+            }
+
+            if (!ciphertext_socket().is_open())
+            {
+               co_return;
+            }
+
+            co_await boost::asio::post(io_service(), boost::asio::use_awaitable);
+
+            boost::system::error_code ec(boost::asio::error::operation_aborted);
+            std::size_t bytes_transferred = 0;
+
+            while (ciphertext_socket().is_open())
+            {
+               bytes_transferred = ciphertext_socket().read_some(ciphertext_ring_.prepare(), ec);
+               keep_quickack(ciphertext_socket());
+
+               if (ec != boost::asio::error::would_block)
+               {
+                  break;
+               }
+
+               ciphertext_ring_.release_if_empty();
+
+               co_await ciphertext_socket().async_wait(socket_type::wait_read,
+                    boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+               if (ec)
+               {
+                  break;
+               }
+
+               ec = boost::asio::error::operation_aborted;
+            }
+
+            handle_ciphertext_read(ec, bytes_transferred);
+         }
+      }
+
+      boost::asio::awaitable<void> write_plaintext_loop(ptr_type)
+      {
+         const std::size_t d = direction_of(ciphertext_socket());
+
+         for (;;)
+         {
+            while (plaintext_socket().is_open() && !plaintext_out_.writing)
+            {
+               co_await park(d);
+            }
+
+            if (!plaintext_socket().is_open())
+            {
+               co_return;
+            }
+
+            boost::system::error_code ec;
+            const std::size_t bytes_transferred =
+               co_await boost::asio::async_write(plaintext_socket(),
+                    plaintext_out_.write_buffers(),
+                    boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+            handle_plaintext_write(ec, bytes_transferred);
+         }
+      }
+
+      // The buffer is only checked out for as long as it takes to encode
+      // what was read into it.
+      boost::asio::awaitable<void> read_plaintext_loop(ptr_type)
+      {
+         const std::size_t d = direction_of(plaintext_socket());
+
+         for (;;)
+         {
+            while (plaintext_socket().is_open() && !ciphertext_out_.reading)
+            {
+               co_await park(d);
+            }
+
+            if (!plaintext_socket().is_open())
+            {
+               co_return;
+            }
+
+            co_await boost::asio::post(io_service(), boost::asio::use_awaitable);
+
+            boost::system::error_code ec(boost::asio::error::operation_aborted);
+            std::size_t bytes_transferred = 0;
+            std::size_t read_size = 0;
+            unsigned char* data = 0;
+
+            while (plaintext_socket().is_open())
+            {
+               read_size = read_size_;
+               data = worker_.buffers.allocate(read_size);
+               bytes_transferred = plaintext_socket().read_some(boost::asio::buffer(data,read_size), ec);
+               keep_quickack(plaintext_socket());
+
+               if (ec != boost::asio::error::would_block)
+               {
+                  break;
+               }
+
+               worker_.buffers.deallocate(data,read_size);
+               data = 0;
+
+               co_await plaintext_socket().async_wait(socket_type::wait_read,
+                    boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+               if (ec)
+               {
+                  break;
+               }
+
+               ec = boost::asio::error::operation_aborted;
+            }
+
+            if (!ec)
+            {
+               adapt_read_size(bytes_transferred);
+            }
+
+            handle_plaintext_read(ec, data, bytes_transferred);
+
+            if (data)
+            {
+               worker_.buffers.deallocate(data,read_size);
+            }
+         }
+      }
+
+      boost::asio::awaitable<void> write_ciphertext_loop(ptr_type)
+      {
+         const std::size_t d = direction_of(plaintext_socket());
+
+         for (;;)
+         {
+            while (ciphertext_socket().is_open() && !ciphertext_out_.writing)
+            {
+               co_await park(d);
+            }
+
+            if (!ciphertext_socket().is_open())
+            {
+               co_return;
+            }
+
+            boost::system::error_code ec;
+            const std::size_t bytes_transferred =
+               co_await boost::asio::async_write(ciphertext_socket(),
+                    ciphertext_out_.write_buffers(),
+                    boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+            handle_ciphertext_write(ec, bytes_transferred);
+         }
+      }
+      // *** End Of Section E ***
+   #endif
+
+      void upstream_write_started()
+      {
+         if (first_upstream_write_ == 0)
+         {
+            first_upstream_write_ = metrics::now();
+         }
+      }
+
+      // Replies that come before anything was written are the server
+      // speaking first, and aren't timed.
+      void upstream_read_completed()
+      {
+         if (!first_upstream_byte_ && first_upstream_write_ != 0)
+         {
+            first_upstream_byte_ = true;
+            backend_->observe_latency(metrics::now() - first_upstream_write_);
+         }
+      }
+
+      timer_wheel& timers()
+      {
+         return worker_.timers;
+      }
+
+      // Traffic, which puts the idle timeout off.
+      void touch()
+      {
+         if (idle_ticks_)
+         {
+            last_activity_ = timers().now();
+         }
+      }
+
+      // The kernel leaves quick ack mode on its own after a few segments.
+      void keep_quickack(socket_type& socket)
+      {
+         if (&socket == &downstream_socket_ ? downstream_quickack_ : upstream_quickack_)
+         {
+            rearm_quickack(socket);
+         }
+      }
+
+      void write_started(timer_wheel::tick_type& since)
+      {
+         if (write_ticks_)
+         {
+            since = timers().now();
+
+            if (!timeout_.active() || since + write_ticks_ < timeout_.expiry())
+            {
+               timers().schedule(timeout_, since + write_ticks_);
+            }
+         }
+      }
+
+      // Start of the longest outstanding write, if there is one.
+      bool oldest_write(timer_wheel::tick_type& since) const
+      {
+         const bool writing[] = { plaintext_out_.writing, ciphertext_out_.writing,
+                                  relay_[0].writing, relay_[1].writing };
+         const timer_wheel::tick_type started[] = { plaintext_write_since_, ciphertext_write_since_,
+                                                    relay_[0].write_since, relay_[1].write_since };
+         bool found = false;
+
+         for (std::size_t i = 0; i < sizeof(writing) / sizeof(writing[0]); ++i)
+         {
+            if (writing[i] && (!found || started[i] < since))
+            {
+               since = started[i];
+               found = true;
+            }
+         }
+
+         return found;
+      }
+
+      // Schedules the timeout for the earliest deadline that applies.
+      void schedule_timeout()
+      {
+         timer_wheel::tick_type deadline = 0;
+         timer_wheel::tick_type since;
+
+         if (connecting_)
+         {
+            deadline = connect_ticks_ ? connect_tick_ + connect_ticks_ : 0;
+         }
+         else
+         {
+            if (idle_ticks_)
+            {
+               deadline = last_activity_ + idle_ticks_;
+            }
+
+            if (write_ticks_ && oldest_write(since) && (deadline == 0 || since + write_ticks_ < deadline))
+            {
+               deadline = since + write_ticks_;
+            }
+         }
+
+         if (deadline != 0)
+         {
+            timers().schedule(timeout_, deadline);
+         }
+         else
+         {
+            timeout_.cancel();
+         }
+      }
+
+      // A connect that times out is cancelled, and its handler retries it
+      // like a failed one.
+      void handle_timeout()
+      {
+         const ptr_type self(shared_from_this());
+         const timer_wheel::tick_type now = timers().now();
+         timer_wheel::tick_type since;
+
+         if (connecting_)
+         {
+            if (now >= connect_tick_ + connect_ticks_)
+            {
+               metrics().connect_timeouts.add();
+               connect_timed_out_ = true;
+
+               boost::system::error_code ec;
+               upstream_socket_.cancel(ec);
+               return;
+            }
+         }
+         else if (idle_ticks_ && now >= last_activity_ + idle_ticks_)
+         {
+            metrics().idle_timeouts.add();
+            close();
+            return;
+         }
+         else if (write_ticks_ && oldest_write(since) && now >= since + write_ticks_)
+         {
+            metrics().write_timeouts.add();
+            close();
+            return;
+         }
+
+         schedule_timeout();
+      }
+
+      // A handler for an operation re-armed for every chunk, allocated
+      // from memory (see handler_memory.hpp).
+      template <typename Function, typename Memory>
+      owned_handler<bridge, Function, Memory> handler(Function function, Memory& memory)
+      {
+         return owned_handler<bridge, Function, Memory>(*this, function, memory);
+      }
+
+      // Direction in which the data read from source moves.
+      std::size_t direction_of(const socket_type& source) const
+      {
+         return (&source == &downstream_socket_) ? relay_upstream : relay_downstream;
+      }
+
+      byte_bucket& rate(std::size_t d)
+      {
+         return (d == relay_upstream) ? upstream_rate_ : downstream_rate_;
+      }
+
+      void charge(std::size_t d, std::size_t bytes)
+      {
+         if (rate(d).enabled())
+         {
+            rate(d).take(bytes, metrics::now());
+         }
+      }
+
+      // Tracing (see trace.hpp): a read in direction d starts a record if
+      // the direction isn't following one already, which is stamped again
+      // once the read's data is queued, and when the write that carries it
+      // starts and completes. Everything queued when a write starts goes
+      // out in that write.
+      void trace_read(std::size_t d, std::size_t bytes)
+      {
+         if (trace_id_ && trace_stages_[d] == trace_idle && bytes)
+         {
+            metrics::trace_record& r = traces_[d];
+            r.bridge = trace_id_;
+            r.upstream = (d == relay_upstream);
+            r.bytes = bytes;
+            r.read = metrics::now();
+            trace_stages_[d] = trace_in_transform;
+         }
+      }
+
+      void trace_queued(std::size_t d)
+      {
+         if (trace_stages_[d] == trace_in_transform)
+         {
+            traces_[d].queued = metrics::now();
+            trace_stages_[d] = trace_in_queue;
+         }
+      }
+
+      void trace_write_started(std::size_t d)
+      {
+         if (trace_stages_[d] == trace_in_queue)
+         {
+            traces_[d].write_started = metrics::now();
+            trace_stages_[d] = trace_in_write;
+         }
+      }
+
+      void trace_written(std::size_t d)
+      {
+         if (trace_stages_[d] == trace_in_write)
+         {
+            traces_[d].written = metrics::now();
+            worker_.traces.push(traces_[d]);
+            trace_stages_[d] = trace_idle;
+         }
+      }
+
+      // Whether direction d has read beyond its byte rate, in which case
+      // its next read waits for the throttle entry to resume it.
+      bool throttled(std::size_t d)
+      {
+         if (!rate(d).enabled())
+         {
+            return false;
+         }
+
+         if (throttled_[d])
+         {
+            return true;
+         }
+
+         const metrics::value_type delay = rate(d).delay(metrics::now());
+
+         if (delay == 0)
+         {
+            return false;
+         }
+
+         throttled_[d] = true;
+         metrics().rate_pauses.add();
+
+         const timer_wheel::tick_type expiry = timers().now() + timers().ticks_covering(delay);
+
+         if (!throttle_.active() || expiry < throttle_.expiry())
+         {
+            timers().schedule(throttle_, expiry);
+         }
+
+         throttle_self_ = shared_from_this();
+         return true;
+      }
+
+      // Directions still in debt wait again.
+      void handle_throttle()
+      {
+         ptr_type self;
+         self.swap(throttle_self_);
+
+         for (std::size_t d = 0; d < 2; ++d)
+         {
+            if (throttled_[d])
+            {
+               throttled_[d] = false;
+               resume_read(d);
+            }
+         }
+      }
+
+      void resume_read(std::size_t d)
+      {
+         if (!relay_source(d).is_open())
+         {
+            return;
+         }
+
+         if (g_passthrough)
+         {
+            pump(d, boost::system::error_code());
+         }
+         else if (&relay_source(d) == &ciphertext_socket())
+         {
+            if (!plaintext_out_.reading && !plaintext_out_.read_eof && !plaintext_out_.full())
+            {
+               read_ciphertext();
+            }
+         }
+         else if (!ciphertext_out_.reading && !ciphertext_out_.read_eof && !ciphertext_out_.full())
+         {
+            read_plaintext();
+         }
+      }
+
+      // Direction d has written out everything its source sent before the
+      // end of the stream, which it passes on by shutting the sink down for
+      // sending; the other direction carries on until it ends too, when the
+      // bridge is closed. Like close(), only called on the bridge's loop.
+      void end_direction(std::size_t d)
+      {
+         ended_[d] = true;
+
+         if (ended_[1 - d])
+         {
+            close();
+            return;
+         }
+
+         boost::system::error_code ec;
+         relay_sink(d).shutdown(socket_type::shutdown_send, ec);
+
+         if (ec)
+         {
+            close();
+         }
+      }
+
+      // Only ever called from handlers on this bridge's own loop, so there
+      // is no concurrent access to the sockets to guard against.
+      void close()
+      {
+         timeout_.cancel();
+         throttle_.cancel();
+         throttle_self_.reset();
+
+         if (coalescing_)
+         {
+            coalesce_timer_.cancel();
+         }
+
+      #ifdef TCP_PROXY_IO_URING
+         if (worker_.ring)
+         {
+            close_uring();
+         }
+      #endif
+
+      #ifdef TCP_PROXY_COROUTINES
+         // Parked coroutines find the sockets closed and finish.
+         if (coroutines_)
+         {
+            wake(relay_upstream);
+            wake(relay_downstream);
+         }
+      #endif
+
+         if (downstream_socket_.is_open())
+         {
+            downstream_socket_.close();
+         }
+
+         if (upstream_socket_.is_open())
+         {
+            upstream_socket_.close();
+         }
+      }
+
+      io_service_pool::worker& worker_;
+      socket_type downstream_socket_;
+      socket_type upstream_socket_;
+
+      enum {
+         // Adaptive reads don't shrink below this, the smallest pool buffer.
+         min_adaptive_read_size = 4096,
+         small_reads_to_shrink = 4
+      };
+
+      // Frame length, including the terminator, for length bytes of data.
+      static std::size_t encoded_length(std::size_t length)
+      {
+         return TB64ENCLEN(length) + 1;
+      }
+
+      static std::size_t max_payload_length(const config& config)
+      {
+         return config.max_chunk_size + (config.compression != compression_off ? 1 : 0);
+      }
+
+      // Size of the next read from the plaintext socket. Fixed at the chunk
+      // size unless the chunks are adaptive.
+      std::size_t read_size_;
+      std::size_t min_read_size_;
+      std::size_t max_read_size_;
+      std::size_t small_reads_;
+
+      // Compressed Base64 frames must be shorter than this, which is what
+      // the peer's largest chunk encodes to; others are decoded in pieces.
+      // Binary frames carry at most the largest chunk, plus the compression
+      // flag; a chunk decompresses to at most max_chunk_size_.
+      std::size_t max_frame_length_;
+      std::size_t max_payload_length_;
+      std::size_t max_chunk_size_;
+
+      // Framing of the ciphertext received and sent. The accepting end
+      // doesn't read plaintext until the peer's framing is known.
+      framing_type framing_in_;
+      framing_type framing_out_;
+
+      // Key of the XOR the frame kernels apply, 0 with ChaCha20. The
+      // streams are keyed once their nonce frames have been exchanged;
+      // until then frames pass through them untouched.
+      unsigned char xor_key_;
+      chacha20::stream cipher_in_;
+      chacha20::stream cipher_out_;
+
+      // Sized for two frames of the initial chunk size; grown to hold a
+      // partial frame of up to max_frame_length_ plus as much again for
+      // the next read, unless frames are decoded in pieces.
+      frame_ring ciphertext_ring_;
+
+      // Decoded data waiting to be written to the plaintext socket.
+      pipeline plaintext_out_;
+
+      // Encoded data waiting to be written to the ciphertext socket.
+      pipeline ciphertext_out_;
+
+      std::size_t coalesce_bytes_;
+      std::size_t coalesce_delay_;
+      boost::asio::deadline_timer coalesce_timer_;
+      bool coalescing_;
+
+      enum { max_connect_attempts = 2 };
+
+      backend_set* backends_;
+      backend* backend_;
+      std::size_t connect_attempts_;
+      metrics::value_type connect_started_;
+
+      // Start of the first write to the remote server, until its first
+      // reply, which times the server's first-byte latency.
+      metrics::value_type first_upstream_write_;
+      bool first_upstream_byte_;
+
+      // An entry of the bridge's in its loop's timer wheel, which calls
+      // the handler when it is due.
+      class timeout : public timer_wheel::entry
+      {
+      public:
+
+         typedef void (bridge::*handler_type)();
+
+         timeout(bridge& owner, handler_type handler)
+         : owner_(owner),
+           handler_(handler)
+         {}
+
+         virtual void expired()
+         {
+            (owner_.*handler_)();
+         }
+
+      private:
+
+         bridge& owner_;
+         handler_type handler_;
+      };
+
+      // Timeouts in ticks, 0 for none. Reads and writes only note the
+      // tick they happen at; the deadlines that follow are checked when
+      // the entry, which is due at the earliest of them, expires.
+      timer_wheel::tick_type connect_ticks_;
+      timer_wheel::tick_type idle_ticks_;
+      timer_wheel::tick_type write_ticks_;
+      timeout timeout_;
+      bool connecting_;
+      bool connect_timed_out_;
+      timer_wheel::tick_type connect_tick_;
+      timer_wheel::tick_type last_activity_;
+      timer_wheel::tick_type plaintext_write_since_;
+      timer_wheel::tick_type ciphertext_write_since_;
+
+      // Options an upstream socket is given around its connect, and the
+      // sides whose sockets are put back into quick ack mode after reads.
+      const socket_options& upstream_options_;
+      bool downstream_quickack_;
+      bool upstream_quickack_;
+
+      // Byte rates of the two directions, and the entry that resumes the
+      // directions waiting on them. While it is scheduled it holds the
+      // bridge, since those directions have no handler outstanding.
+      byte_bucket upstream_rate_;
+      byte_bucket downstream_rate_;
+      bool throttled_[2];
+      timeout throttle_;
+      ptr_type throttle_self_;
+
+      // The directions, by relay_direction, whose source has reached the
+      // end of the stream and whose sink has been shut down for sending.
+      bool ended_[2];
+
+      // The client's place under the admission limits.
+      admission::ticket ticket_;
+
+      // Where the handlers of each direction's read (or readiness wait)
+      // and write are allocated, by relay_direction.
+      read_memory read_memory_[2];
+      write_memory write_memory_[2];
+
+      // Traced bridges only: how far the read each direction follows has
+      // got, and its record so far.
+      enum trace_stage
+      {
+         trace_idle,
+         trace_in_transform,
+         trace_in_queue,
+         trace_in_write
+      };
+
+      metrics::value_type trace_id_;
+      trace_stage trace_stages_[2];
+      metrics::trace_record traces_[2];
+
+      // Pass-through only, one per direction.
+      enum { max_relay_burst = 256 * 1024 };
+      relay relay_[2];
+   #ifdef TCP_PROXY_SPLICE
+      bool splicing_;
+   #endif
+
+      // io_uring only, by uring_socket_index.
+   #ifdef TCP_PROXY_IO_URING
+      std::size_t max_in_flight_;
+      uring_receive uring_receives_[2];
+      uring_send uring_sends_[2];
+   #endif
+
+      // Coroutine engine only, one wakeup per direction, shared by its
+      // reader and writer.
+   #ifdef TCP_PROXY_COROUTINES
+      bool coroutines_;
+      wakeup upstream_wakeup_;
+      wakeup downstream_wakeup_;
+   #endif
+
+   public:
+
+      class acceptor
+      {
+      public:
+
+         acceptor(io_service_pool::worker& worker,
+                  io_service_pool& pool,
+                  const config& config,
+                  backend_set& backends,
+                  admission& admission,
+                  const std::string& local_host, unsigned short local_port)
+         : worker_(worker),
+           pool_(pool),
+           backends_(backends),
+           admission_(admission),
+           metrics_(worker.metrics),
+           config_(config),
+           localhost_address(boost::asio::ip::address_v4::from_string(local_host)),
+           acceptor_(worker.io_service),
+           pending_accepts_(config.pending_accepts),
+           retry_timer_(worker.io_service),
+           retrying_(0)
+         {
+            const ip::tcp::endpoint endpoint(localhost_address,local_port);
+
+            acceptor_.open(endpoint.protocol());
+            acceptor_.set_option(ip::tcp::acceptor::reuse_address(true));
+
+            if (config.acceptors > 1)
+            {
+            #ifdef SO_REUSEPORT
+               // Every acceptor binds its own socket to the same port and the
+               // kernel spreads incoming connections across them.
+               acceptor_.set_option(reuse_port(true));
+            #else
+               throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+            #endif
+
+               steer_to_cpu();
+            }
+
+            // Accepted sockets inherit the buffer sizes
+            boost::system::error_code ec;
+            apply_buffer_options(acceptor_, config.downstream_options, ec);
+
+            if (ec)
+            {
+               throw boost::system::system_error(ec);
+            }
+
+            acceptor_.bind(endpoint);
+            acceptor_.listen();
+         }
+
+      #ifdef TCP_PROXY_HANDOFF
+         // Takes over a listening socket from an older process.
+         acceptor(io_service_pool::worker& worker,
+                  io_service_pool& pool,
+                  const config& config,
+                  backend_set& backends,
+                  admission& admission,
+                  int listening_socket)
+         : worker_(worker),
+           pool_(pool),
+           backends_(backends),
+           admission_(admission),
+           metrics_(worker.metrics),
+           config_(config),
+           acceptor_(worker.io_service),
+           pending_accepts_(config.pending_accepts),
+           retry_timer_(worker.io_service),
+           retrying_(0)
+         {
+            acceptor_.assign(handoff::protocol_of(listening_socket), listening_socket);
+
+            if (config.acceptors > 1)
+            {
+               steer_to_cpu();
+            }
+         }
+      #endif
+
+         int native_handle()
+         {
+            return acceptor_.native_handle();
+         }
+
+         // An accept that failed on a connection the client gave up on,
+         // after which the next accept may go ahead at once.
+         static bool transient_accept_error(const boost::system::error_code& error)
+         {
+            return error == boost::asio::error::connection_aborted ||
+                   error == boost::asio::error::connection_reset ||
+                   error == boost::system::errc::protocol_error ||
+                   error == boost::system::errc::operation_not_permitted;
+         }
+
+         // Stops accepting; the outstanding accepts are cancelled.
+         void stop()
+         {
+            boost::system::error_code ec;
+            acceptor_.close(ec);
+            retry_timer_.cancel(ec);
+         }
+
+         bool accept_connections()
+         {
+            for (std::size_t i = 0; i < pending_accepts_; ++i)
+            {
+               if (!accept_connection())
+               {
+                  return false;
+               }
+            }
+
+            return true;
+         }
+
+      private:
+
+      #ifdef SO_REUSEPORT
+         typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+      #endif
+
+         // One of several listeners on a pinned loop takes the connections
+         // whose packets arrive on the loop's CPU, best effort.
+         void steer_to_cpu()
+         {
+         #ifdef TCP_PROXY_AFFINITY
+            if (worker_.cpu >= 0)
+            {
+               affinity::set_incoming_cpu(acceptor_.native_handle(), worker_.cpu);
+            }
+         #endif
+         }
+
+         // Keeps one async_accept outstanding; each accept slot owns the
+         // session waiting for its connection.
+         bool accept_connection()
+         {
+            try
+            {
+               io_service_pool::worker& worker = pool_.next_worker(worker_);
+
+               if (config_.mux && g_encode)
+               {
+                  accept_stream(worker);
+                  return true;
+               }
+               else if (config_.mux)
+               {
+                  accept_tunnel(worker);
+                  return true;
+               }
+
+               ptr_type session(
+                    boost::allocate_shared<bridge>(
+                         slab_allocator<bridge>(worker.bridges),
+                         boost::ref(worker),
+                         boost::cref(config_)));
+
+               acceptor_.async_accept(session->downstream_socket(),
+                    boost::bind(&acceptor::handle_accept,
+                         this,
+                         session,
+                         boost::asio::placeholders::error));
+            }
+            catch(std::exception& e)
+            {
+               std::cerr << "acceptor exception: " << e.what() << std::endl;
+               return false;
+            }
+
+            return true;
+         }
+
+         void handle_accept(ptr_type session, const boost::system::error_code& error)
+         {
+            if (!error && admit(session->downstream_socket(), session->ticket()))
+            {
+               session->limit_rate(admission_.bridge_rate(), admission_.bridge_burst());
+               apply_socket_options(session->downstream_socket(), config_.downstream_options);
+
+               // The accepted socket belongs to the bridge's loop; hand the
+               // rest of the bridge's life over to that loop's thread.
+               session->io_service().post(
+                    boost::bind(&bridge::start,
+                         session,
+                         boost::ref(backends_)));
+            }
+
+            accepted(error);
+         }
+
+         // With mux on, the encode end accepts clients into streams over
+         // its tunnels, and the decode end accepts tunnels.
+         void accept_stream(io_service_pool::worker& worker)
+         {
+            const mux_stream::ptr_type stream(
+                 boost::make_shared<mux_stream>(boost::ref(worker), boost::cref(config_)));
+
+            acceptor_.async_accept(stream->socket(),
+                 boost::bind(&acceptor::handle_accept_stream,
+                      this,
+                      stream,
+                      boost::asio::placeholders::error));
+         }
+
+         void handle_accept_stream(mux_stream::ptr_type stream, const boost::system::error_code& error)
+         {
+            if (!error && admit(stream->socket(), stream->ticket()))
+            {
+               apply_socket_options(stream->socket(), config_.downstream_options);
+               stream->io_service().post(boost::bind(&mux_stream::start, stream));
+            }
+
+            accepted(error);
+         }
+
+         void accept_tunnel(io_service_pool::worker& worker)
+         {
+            const mux_tunnel::ptr_type tunnel(
+                 boost::make_shared<mux_tunnel>(boost::ref(worker), boost::cref(config_), boost::ref(backends_)));
+
+            acceptor_.async_accept(tunnel->socket(),
+                 boost::bind(&acceptor::handle_accept_tunnel,
+                      this,
+                      tunnel,
+                      boost::asio::placeholders::error));
+         }
+
+         void handle_accept_tunnel(mux_tunnel::ptr_type tunnel, const boost::system::error_code& error)
+         {
+            if (!error)
+            {
+               apply_socket_options(tunnel->socket(), config_.downstream_options);
+               tunnel->io_service().post(boost::bind(&mux_tunnel::start_accepted, tunnel));
+            }
+
+            accepted(error);
+         }
+
+         // Closes a client that is over one of the admission limits. The
+         // decode end of mux tunnels only accepts tunnels, which are exempt.
+         bool admit(socket_type& socket, admission::ticket& ticket)
+         {
+            if (!admission_.enabled())
+            {
+               return true;
+            }
+
+            boost::system::error_code ec;
+            const ip::tcp::endpoint peer = socket.remote_endpoint(ec);
+
+            if (!ec)
+            {
+               const admission::verdict verdict = admission_.admit(peer.address().to_v4().to_ulong(), ticket);
+
+               if (verdict == admission::admitted)
+               {
+                  return true;
+               }
+               else if (verdict == admission::over_max_bridges)
+               {
+                  metrics_.rejected_max_bridges.add();
+               }
+               else if (verdict == admission::over_source_limit)
+               {
+                  metrics_.rejected_per_source.add();
+               }
+               else
+               {
+                  metrics_.rejected_rate.add();
+               }
+            }
+
+            socket.close(ec);
+            return false;
+         }
+
+         // Every accept slot is kept: one whose accept failed on a
+         // connection the client gave up on goes straight back to accepting,
+         // and one short of descriptors or memory, or that failed for any
+         // other reason, tries again after a pause rather than spin.
+         void accepted(const boost::system::error_code& error)
+         {
+            if (error == boost::asio::error::operation_aborted || !acceptor_.is_open())
+            {
+               return;
+            }
+
+            if (error && !transient_accept_error(error))
+            {
+               retry_accept(error.message());
+               return;
+            }
+
+            if (!accept_connection())
+            {
+               retry_accept("failure during call to accept");
+            }
+         }
+
+         // Said once for each run of failures.
+         void retry_accept(const std::string& reason)
+         {
+            if (retrying_++ == 0)
+            {
+               std::cerr << "accept fail: " << reason << ", retrying" << std::endl;
+
+               retry_timer_.expires_from_now(boost::posix_time::milliseconds(100));
+               retry_timer_.async_wait(
+                    boost::bind(&acceptor::handle_retry,
+                         this,
+                         boost::asio::placeholders::error));
+            }
+         }
+
+         void handle_retry(const boost::system::error_code& error)
+         {
+            const std::size_t slots = retrying_;
+            retrying_ = 0;
+
+            if (error || !acceptor_.is_open())
+            {
+               return;
+            }
+
+            for (std::size_t i = 0; i < slots; ++i)
+            {
+               if (!accept_connection())
+               {
+                  retry_accept("failure during call to accept");
+               }
+            }
+         }
+
+         // The loop the listening socket is on.
+         io_service_pool::worker& worker_;
+         io_service_pool& pool_;
+         backend_set& backends_;
+         admission& admission_;
+         metrics::registry& metrics_;
+         const config& config_;
+         ip::address_v4 localhost_address;
+         ip::tcp::acceptor acceptor_;
+         std::size_t pending_accepts_;
+
+         // Accept slots waiting to try again.
+         boost::asio::deadline_timer retry_timer_;
+         std::size_t retrying_;
+      };
+
+   };
+
+   // Serves GET /metrics over HTTP from one of the loops. Each request gets
+   // a single response, after which the connection is closed.
+   class metrics_endpoint : private boost::noncopyable
+   {
+   public:
+
+      metrics_endpoint(io_service_pool::worker& worker,
+                       const io_service_pool& pool,
+                       const backend_set& backends,
+                       const std::string& host, unsigned short port)
+      : io_service_(worker.io_service),
+        pool_(pool),
+        backends_(backends),
+        acceptor_(worker.io_service,
+                  ip::tcp::endpoint(boost::asio::ip::address::from_string(host), port)),
+        retry_timer_(worker.io_service),
+        failing_(false)
+      {}
+
+   #ifdef TCP_PROXY_HANDOFF
+      // Takes over a listening socket from an older process.
+      metrics_endpoint(io_service_pool::worker& worker,
+                       const io_service_pool& pool,
+                       const backend_set& backends,
+                       int listening_socket)
+      : io_service_(worker.io_service),
+        pool_(pool),
+        backends_(backends),
+        acceptor_(worker.io_service, handoff::protocol_of(listening_socket), listening_socket),
+        retry_timer_(worker.io_service),
+        failing_(false)
+      {}
+   #endif
+
+      int native_handle()
+      {
+         return acceptor_.native_handle();
+      }
+
+      void stop()
+      {
+         boost::system::error_code ec;
+         acceptor_.close(ec);
+         retry_timer_.cancel(ec);
+      }
+
+      void accept_connections()
+      {
+         session_ptr s(new session(io_service_, pool_, backends_));
+
+         acceptor_.async_accept(s->socket(),
+              boost::bind(&metrics_endpoint::handle_accept,
+                   this,
+                   s,
+                   boost::asio::placeholders::error));
+      }
+
+   private:
+
+      class session : public boost::enable_shared_from_this<session>
+      {
+      public:
+
+         session(boost::asio::io_service& ios,
+                 const io_service_pool& pool,
+                 const backend_set& backends)
+         : pool_(pool),
+           backends_(backends),
+           socket_(ios),
+           request_(max_request_length)
+         {}
+
+         ip::tcp::socket& socket()
+         {
+            return socket_;
+         }
+
+         void start()
+         {
+            boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+                 boost::bind(&session::handle_read,
+                      shared_from_this(),
+                      boost::asio::placeholders::error));
+         }
+
+      private:
+
+         enum { max_request_length = 8192 };
+
+         void handle_read(const boost::system::error_code& error)
+         {
+            if (error)
+            {
+               return;
+            }
+
+            std::istream request(&request_);
+            std::string method;
+            std::string target;
+            request >> method >> target;
+
+            std::ostringstream body;
+            std::ostringstream response;
+
+            if (method == "GET" && (target == "/metrics" || target.compare(0, 9, "/metrics?") == 0))
+            {
+               pool_.write_metrics(body);
+               backends_.write_metrics(body);
+
+               response << "HTTP/1.0 200 OK\r\n"
+                        << "Content-Type: text/plain; version=0.0.4\r\n";
+            }
+            else if (method == "GET" && target == "/traces")
+            {
+               pool_.write_traces(body);
+
+               response << "HTTP/1.0 200 OK\r\n"
+                        << "Content-Type: application/x-ndjson\r\n";
+            }
+            else
+            {
+               body << "not found\n";
+
+               response << "HTTP/1.0 404 Not Found\r\n"
+                        << "Content-Type: text/plain\r\n";
+            }
+
+            const std::string content = body.str();
+
+            response << "Content-Length: " << content.size() << "\r\n"
+                     << "Connection: close\r\n\r\n"
+                     << content;
+
+            response_ = response.str();
+
+            boost::asio::async_write(socket_, boost::asio::buffer(response_),
+                 boost::bind(&session::handle_write,
+                      shared_from_this(),
+                      boost::asio::placeholders::error));
+         }
+
+         void handle_write(const boost::system::error_code& error)
+         {
+            if (!error)
+            {
+               boost::system::error_code ec;
+               socket_.shutdown(ip::tcp::socket::shutdown_both, ec);
+            }
+         }
+
+         const io_service_pool& pool_;
+         const backend_set& backends_;
+         ip::tcp::socket socket_;
+         boost::asio::streambuf request_;
+         std::string response_;
+      };
+
+      typedef boost::shared_ptr<session> session_ptr;
+
+      // As a bridge acceptor does, accepts again at once after a connection
+      // the client gave up on, and after a pause on any other failure.
+      void handle_accept(session_ptr s, const boost::system::error_code& error)
+      {
+         if (error == boost::asio::error::operation_aborted || !acceptor_.is_open())
+         {
+            return;
+         }
+
+         if (!error)
+         {
+            s->start();
+         }
+         else if (!bridge::acceptor::transient_accept_error(error))
+         {
+            // Said once for each run of failures.
+            if (!failing_)
+            {
+               std::cerr << "metrics accept fail " << error << ", retrying\n";
+               failing_ = true;
+            }
+
+            retry_timer_.expires_from_now(boost::posix_time::milliseconds(100));
+            retry_timer_.async_wait(
+                 boost::bind(&metrics_endpoint::handle_retry,
+                      this,
+                      boost::asio::placeholders::error));
+            return;
+         }
+
+         failing_ = false;
+         accept_connections();
+      }
+
+      void handle_retry(const boost::system::error_code& error)
+      {
+         if (!error && acceptor_.is_open())
+         {
+            accept_connections();
+         }
+      }
+
+      boost::asio::io_service& io_service_;
+      const io_service_pool& pool_;
+      const backend_set& backends_;
+      ip::tcp::acceptor acceptor_;
+
+      // Pauses accepting after a failure.
+      boost::asio::deadline_timer retry_timer_;
+      bool failing_;
+   };
+
+   // The remote servers bridges may be sent to: the addresses configured,
+   // and every address the host names configured resolve to, each a server
+   // of its own in the backend set. The names are first looked up before
+   // the loops run, then again every dns_refresh seconds from loop 0, whose
+   // resolver runs the lookups on a thread of its own; the bridges only
+   // ever pick from the set. A name whose lookup fails keeps the addresses
+   // it had, and an address a name no longer resolves to is retired.
+   class server_directory : private boost::noncopyable
+   {
+   public:
+
+      server_directory(io_service_pool& pool, backend_set& backends, std::size_t refresh)
+      : pool_(pool),
+        backends_(backends),
+        resolver_(pool.get_worker(0).io_service),
+        refresh_(refresh),
+        refresh_timer_(pool.get_worker(0).io_service),
+        table_full_(false),
+        stopped_(false)
+      {}
+
+      // Takes the servers of the configuration the proxy starts with, and
+      // blocks until every name has resolved.
+      void resolve(const config& config)
+      {
+         set_servers(config);
+
+         for (std::size_t i = 0; i < names_.size(); ++i)
+         {
+            boost::system::error_code ec;
+            const ip::tcp::resolver::results_type results =
+               resolver_.resolve(names_[i].name.host, service(names_[i].name),
+                                 ip::tcp::resolver::numeric_service, ec);
+
+            if (ec || !set_addresses(names_[i], results))
+            {
+               throw std::runtime_error("cannot resolve " + names_[i].name.host +
+                                        (ec ? ": " + ec.message() : std::string()));
+            }
+         }
+
+         apply();
+      }
+
+      // Looks the names up again every refresh_ seconds, if at all.
+      void start()
+      {
+         if (refresh_ == 0 || stopped_)
+         {
+            return;
+         }
+
+         refresh_timer_.expires_from_now(boost::posix_time::seconds(static_cast<long>(refresh_)));
+         refresh_timer_.async_wait(
+              boost::bind(&server_directory::handle_refresh,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      // Takes the servers of a reloaded configuration, from loop 0's
+      // thread. Names not known yet are looked up, and their addresses
+      // join once resolved. Returns the number of servers.
+      std::size_t configure(const config& config)
+      {
+         set_servers(config);
+
+         for (std::size_t i = 0; i < names_.size(); ++i)
+         {
+            if (names_[i].addresses.empty())
+            {
+               lookup(names_[i].name);
+            }
+         }
+
+         return apply();
+      }
+
+      // Looks nothing up any more, from loop 0's thread. The set stays as
+      // it is for the bridges still open.
+      void stop()
+      {
+         stopped_ = true;
+
+         boost::system::error_code ec;
+         refresh_timer_.cancel(ec);
+         resolver_.cancel();
+      }
+
+      // Names that haven't resolved yet.
+      std::size_t unresolved() const
+      {
+         std::size_t count = 0;
+
+         for (std::size_t i = 0; i < names_.size(); ++i)
+         {
+            if (names_[i].addresses.empty())
+            {
+               ++count;
+            }
+         }
+
+         return count;
+      }
+
+   private:
+
+      struct name_entry
+      {
+         server_name name;
+
+         // What the name last resolved to.
+         std::vector<ip::tcp::endpoint> addresses;
+      };
+
+      static std::string service(const server_name& name)
+      {
+         std::ostringstream port;
+         port << name.port;
+         return port.str();
+      }
+
+      // Keeps the addresses of the names already known.
+      void set_servers(const config& config)
+      {
+         addresses_.clear();
+
+         if (config.forward_name.empty())
+         {
+            addresses_.push_back(config.forward);
+         }
+
+         addresses_.insert(addresses_.end(), config.backends.begin(), config.backends.end());
+
+         std::vector<server_name> wanted;
+
+         if (!config.forward_name.empty())
+         {
+            const server_name forward = { config.forward_name, config.forward.port() };
+            wanted.push_back(forward);
+         }
+
+         wanted.insert(wanted.end(), config.backend_names.begin(), config.backend_names.end());
+
+         std::vector<name_entry> names;
+
+         for (std::size_t i = 0; i < wanted.size(); ++i)
+         {
+            name_entry entry;
+            entry.name = wanted[i];
+
+            if (const name_entry* known = find(wanted[i]))
+            {
+               entry.addresses = known->addresses;
+            }
+
+            names.push_back(entry);
+         }
+
+         names_.swap(names);
+      }
+
+      const name_entry* find(const server_name& name) const
+      {
+         for (std::size_t i = 0; i < names_.size(); ++i)
+         {
+            if (names_[i].name.host == name.host && names_[i].name.port == name.port)
+            {
+               return &names_[i];
+            }
+         }
+
+         return 0;
+      }
+
+      // Returns false, leaving the addresses as they were, if there are
+      // none.
+      static bool set_addresses(name_entry& entry, const ip::tcp::resolver::results_type& results)
+      {
+         std::vector<ip::tcp::endpoint> addresses;
+
+         for (ip::tcp::resolver::results_type::const_iterator i = results.begin(); i != results.end(); ++i)
+         {
+            if (std::find(addresses.begin(), addresses.end(), i->endpoint()) == addresses.end())
+            {
+               addresses.push_back(i->endpoint());
+            }
+         }
+
+         if (addresses.empty())
+         {
+            return false;
+         }
+
+         std::sort(addresses.begin(), addresses.end());
+         entry.addresses.swap(addresses);
+         return true;
+      }
+
+      void lookup(const server_name& name)
+      {
+         if (stopped_)
+         {
+            return;
+         }
+
+         resolver_.async_resolve(name.host, service(name), ip::tcp::resolver::numeric_service,
+              boost::bind(&server_directory::handle_lookup,
+                   this,
+                   name,
+                   boost::asio::placeholders::error,
+                   boost::asio::placeholders::results));
+      }
+
+      void handle_refresh(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         for (std::size_t i = 0; i < names_.size(); ++i)
+         {
+            lookup(names_[i].name);
+         }
+
+         start();
+      }
+
+      // The name may have gone from the configuration meanwhile.
+      void handle_lookup(const server_name& name,
+                         const boost::system::error_code& error,
+                         const ip::tcp::resolver::results_type& results)
+      {
+         name_entry* entry = const_cast<name_entry*>(find(name));
+
+         if (entry == 0 || stopped_)
+         {
+            return;
+         }
+
+         const std::vector<ip::tcp::endpoint> previous = entry->addresses;
+
+         if (error || !set_addresses(*entry, results))
+         {
+            std::cerr << "cannot resolve " << name.host << ": "
+                      << (error ? error.message() : std::string("no addresses"))
+                      << ", keeping " << previous.size() << " addresses" << std::endl;
+            return;
+         }
+
+         if (entry->addresses != previous)
+         {
+            std::cerr << name.host << " resolved to " << entry->addresses.size() << " addresses" << std::endl;
+            apply();
+         }
+      }
+
+      // Brings the backend set in line with the servers known: those in it
+      // already brought back, so that a new one doesn't take the place of
+      // one of them, then the new ones, so there is always one to pick,
+      // then the rest retired. A new one that doesn't fit in the table is
+      // left out until a place is free, which retiring others makes once
+      // their bridges have finished. With none of the servers known in the
+      // set, it is left as it is. Returns the servers in the set.
+      std::size_t apply()
+      {
+         std::vector<ip::tcp::endpoint> servers(addresses_);
+
+         for (std::size_t i = 0; i < names_.size(); ++i)
+         {
+            for (std::size_t a = 0; a < names_[i].addresses.size(); ++a)
+            {
+               if (std::find(servers.begin(), servers.end(), names_[i].addresses[a]) == servers.end())
+               {
+                  servers.push_back(names_[i].addresses[a]);
+               }
+            }
+         }
+
+         std::vector<ip::tcp::endpoint> missing;
+         std::size_t present = 0;
+
+         for (std::size_t i = 0; i < servers.size(); ++i)
+         {
+            backend* b = backends_.find(servers[i]);
+
+            if (b)
+            {
+               b->set_retired(false);
+               ++present;
+            }
+            else
+            {
+               missing.push_back(servers[i]);
+            }
+         }
+
+         std::size_t left_out = 0;
+
+         for (std::size_t i = 0; i < missing.size(); ++i)
+         {
+            try
+            {
+               backends_.add(missing[i]);
+               ++present;
+            }
+            catch(std::exception& e)
+            {
+               if (left_out++ == 0 && !table_full_)
+               {
+                  std::cerr << "remote servers left out: " << e.what() << std::endl;
+               }
+            }
+         }
+
+         table_full_ = (left_out != 0);
+
+         if (present == 0)
+         {
+            return 0;
+         }
+
+         for (std::size_t i = 0; i < backends_.size(); ++i)
+         {
+            backend& b = backends_.get(i);
+
+            if (std::find(servers.begin(), servers.end(), b.endpoint()) == servers.end())
+            {
+               b.set_retired(true);
+            }
+         }
+
+         for (std::size_t i = 0; i < pool_.size(); ++i)
+         {
+            io_service_pool::worker& worker = pool_.get_worker(i);
+            worker.io_service.post(
+                 boost::bind(&io_service_pool::worker::sync_upstreams, &worker, boost::ref(backends_)));
+         }
+
+         return present;
+      }
+
+      io_service_pool& pool_;
+      backend_set& backends_;
+      ip::tcp::resolver resolver_;
+      std::size_t refresh_;
+      boost::asio::deadline_timer refresh_timer_;
+
+      std::vector<ip::tcp::endpoint> addresses_;
+      std::vector<name_entry> names_;
+
+      // Some servers didn't fit in the table at the last apply(), which
+      // has been said once.
+      bool table_full_;
+
+      bool stopped_;
+   };
+
+   // Reads the configuration again on SIGHUP and applies what can change
+   // while bridges are open: the remote servers and the admission limits.
+   // Everything else keeps its value until a restart. A configuration that
+   // fails to load leaves the running one as it was.
+   class config_reloader : private boost::noncopyable
+   {
+   public:
+
+      typedef boost::function<bool (config&)> loader_type;
+
+      config_reloader(io_service_pool& pool, server_directory& servers,
+                      admission& admission, const loader_type& loader)
+      : servers_(servers),
+        admission_(admission),
+        loader_(loader),
+        signals_(pool.get_worker(0).io_service, SIGHUP)
+      {}
+
+      void start()
+      {
+         signals_.async_wait(
+              boost::bind(&config_reloader::handle_signal,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      // Reloads nothing any more, from loop 0's thread. SIGHUP is still
+      // caught, so that it doesn't end the process.
+      void stop()
+      {
+         boost::system::error_code ec;
+         signals_.cancel(ec);
+      }
+
+   private:
+
+      void handle_signal(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         reload();
+         start();
+      }
+
+      void reload()
+      {
+         config fresh;
+
+         if (!loader_(fresh))
+         {
+            std::cerr << "reload failed, configuration unchanged" << std::endl;
+            return;
+         }
+
+         const std::size_t servers = servers_.configure(fresh);
+         admission_.set_limits(fresh.limits);
+
+         std::cerr << "reloaded, " << servers << " remote servers";
+
+         if (servers_.unresolved() != 0)
+         {
+            std::cerr << " and " << servers_.unresolved() << " names to look up";
+         }
+
+         std::cerr << std::endl;
+      }
+
+      server_directory& servers_;
+      admission& admission_;
+      loader_type loader_;
+      boost::asio::signal_set signals_;
+   };
+
+#ifdef TCP_PROXY_HANDOFF
+   // Hands the listening sockets to a newer process started with the same
+   // --handoff path (see handoff.hpp). Once that one is accepting, this one
+   // stops accepting and stops its loops when its last bridge has finished,
+   // or drain_timeout seconds later.
+   class handoff_server : private boost::noncopyable
+   {
+   public:
+
+      typedef boost::asio::local::stream_protocol protocol;
+      typedef std::vector<boost::shared_ptr<bridge::acceptor> > acceptors_type;
+
+      handoff_server(io_service_pool& pool,
+                     const std::string& path,
+                     std::size_t drain_timeout,
+                     acceptors_type& acceptors,
+                     metrics_endpoint* metrics,
+                     server_directory& servers,
+                     config_reloader* reloader)
+      : pool_(pool),
+        drain_timeout_(drain_timeout),
+        acceptors_(acceptors),
+        metrics_(metrics),
+        servers_(servers),
+        reloader_(reloader),
+        acceptor_(pool.get_worker(0).io_service),
+        channel_(pool.get_worker(0).io_service),
+        drain_timer_(pool.get_worker(0).io_service),
+        answer_(0),
+        drain_start_(0)
+      {
+         // Whatever is left at the path is the older process's, which has
+         // already handed over, or a stale one.
+         ::unlink(path.c_str());
+
+         acceptor_.open(protocol());
+         acceptor_.bind(protocol::endpoint(path));
+         acceptor_.listen();
+      }
+
+      // Connects to the process listening at the path, if there is one,
+      // and receives its listening sockets, which are then the caller's to
+      // close. The channel stays open for the answer.
+      static bool take_over(protocol::socket& channel, const std::string& path,
+                            std::vector<int>& fds, std::string& kinds)
+      {
+         boost::system::error_code ec;
+         channel.connect(protocol::endpoint(path), ec);
+
+         if (ec)
+         {
+            return false;
+         }
+
+         if (!handoff::receive(channel.native_handle(), fds, kinds))
+         {
+            handoff::close_all(fds);
+            throw std::runtime_error("handoff from " + path + " failed");
+         }
+
+         return true;
+      }
+
+      // Tells the older process it can stop accepting.
+      static void answer(protocol::socket& channel)
+      {
+         boost::asio::write(channel, boost::asio::buffer(&handoff::ready, 1));
+
+         boost::system::error_code ec;
+         channel.close(ec);
+      }
+
+      void start()
+      {
+         acceptor_.async_accept(channel_,
+              boost::bind(&handoff_server::handle_accept,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+   private:
+
+      void handle_accept(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            if (error != boost::asio::error::operation_aborted)
+            {
+               std::cerr << "handoff accept fail " << error << "\n";
+            }
+
+            return;
+         }
+
+         std::vector<int> fds;
+         std::string kinds;
+
+         for (std::size_t i = 0; i < acceptors_.size(); ++i)
+         {
+            fds.push_back(acceptors_[i]->native_handle());
+            kinds += handoff::client_listener;
+         }
+
+         if (metrics_)
+         {
+            fds.push_back(metrics_->native_handle());
+            kinds += handoff::metrics_listener;
+         }
+
+         if (!handoff::send(channel_.native_handle(), fds, kinds))
+         {
+            std::cerr << "handoff send fail" << std::endl;
+            restart();
+            return;
+         }
+
+         boost::asio::async_read(channel_, boost::asio::buffer(&answer_, 1),
+              boost::bind(&handoff_server::handle_answer,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      void handle_answer(const boost::system::error_code& error)
+      {
+         if (error || answer_ != handoff::ready)
+         {
+            std::cerr << "handoff failed, still accepting" << std::endl;
+            restart();
+            return;
+         }
+
+         std::cerr << "handed over, draining" << std::endl;
+
+         boost::system::error_code ec;
+         channel_.close(ec);
+         acceptor_.close(ec);
+
+         for (std::size_t i = 0; i < acceptors_.size(); ++i)
+         {
+            acceptors_[i]->stop();
+         }
+
+         if (metrics_)
+         {
+            metrics_->stop();
+         }
+
+         // The newer process follows the servers from now on.
+         if (reloader_)
+         {
+            reloader_->stop();
+         }
+
+         servers_.stop();
+         pool_.stop_upstreams();
+         drain_start_ = metrics::now();
+         check_drained(boost::system::error_code());
+      }
+
+      void check_drained(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         const bool expired = (drain_timeout_ != 0) &&
+                              (metrics::now() - drain_start_ >=
+                               static_cast<metrics::value_type>(drain_timeout_) * nanoseconds_per_second);
+
+         if (pool_.active_bridges() == 0 || expired)
+         {
+            pool_.stop();
+            return;
+         }
+
+         drain_timer_.expires_from_now(boost::posix_time::seconds(1));
+         drain_timer_.async_wait(
+              boost::bind(&handoff_server::check_drained,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      void restart()
+      {
+         boost::system::error_code ec;
+         channel_.close(ec);
+         start();
+      }
+
+      io_service_pool& pool_;
+      std::size_t drain_timeout_;
+      acceptors_type& acceptors_;
+      metrics_endpoint* metrics_;
+      server_directory& servers_;
+      config_reloader* reloader_;
+      protocol::acceptor acceptor_;
+      protocol::socket channel_;
+      boost::asio::deadline_timer drain_timer_;
+      char answer_;
+      metrics::value_type drain_start_;
+   };
+#endif
+}
+
+void usage()
+{
+   std::cerr << "usage: tcpproxy_server <local host ip> <local port> <forward host> <forward port> (encode|decode|passthrough) [options]\n"
+             << "       tcpproxy_server --listen=<ipv4>:<port> --forward=<host>:<port> --mode=(encode|decode|passthrough) [options]\n"
+             << "       tcpproxy_server --config=<file> [options]\n"
+             << "options:\n"
+             << "  --config=<file>                    read options from a file, one name=value a line; read again on SIGHUP\n"
+             << "  --threads=<n>                      number of I/O loops (default: one per core)\n"
+             << "  --balance=(round_robin|least_load|local)\n"
+             << "                                     how new bridges are spread over the loops (local: the\n"
+             << "                                     accepting loop's own)\n"
+             << "  --acceptors=<n>                    listening sockets sharing the port via SO_REUSEPORT\n"
+          #ifdef TCP_PROXY_AFFINITY
+             << "  --cpus=<list>                      pin the loops to these CPUs, e.g. 0-3,8 (loop i to the i-th)\n"
+             << "  --cpus_near=<interface>            pin the loops to the CPUs of the interface's NUMA node\n"
+          #endif
+             << "  --pending_accepts=<n>              outstanding accepts per listening socket\n"
+             << "  --max_bridges=<n>                  bridges open at once (default: 0, no limit)\n"
+             << "  --max_bridges_per_source=<n>       bridges open from one client address (default: 0, no limit)\n"
+             << "  --connection_rate=<n>              new bridges a second (default: 0, no limit)\n"
+             << "  --connection_burst=<n>             new bridges let in at once within the rate\n"
+             << "  --bridge_rate=<bytes>              bytes a second each direction of a bridge reads (0: no limit)\n"
+             << "  --bridge_burst=<bytes>             bytes a direction may read at once within the rate\n"
+             << "  --chunk_size=<bytes>               bytes read from the plaintext side per frame (default: 8192)\n"
+             << "  --max_chunk_size=<bytes>           largest adaptive chunk, and largest frame accepted\n"
+             << "  --adaptive_chunks=(on|off)         resize chunks to match the traffic\n"
+             << "  --max_in_flight=<bytes>            bytes per direction read ahead of the other side's writes\n"
+             << "  --low_watermark=<bytes>            queued bytes a paused direction resumes reading at\n"
+             << "  --memory_budget=<bytes>            queued bytes of all bridges before reads pause (0: no limit)\n"
+             << "  --coalesce_bytes=<bytes>           flush held back encoded frames once this much is queued\n"
+             << "  --coalesce_delay=<usec>            hold encoded frames back up to this long (0: off)\n"
+             << "  --buffer_cache=<bytes>             free buffers each loop keeps for reuse\n"
+             << "  --bridge_cache=<n>                 free bridge blocks each loop keeps for reuse\n"
+             << "  --backend=<host>:<port>            another remote server to forward to (repeatable)\n"
+             << "  --backend_balance=(round_robin|least_active|ewma)\n"
+             << "                                     how a remote server is picked for each bridge\n"
+             << "  --eject_after=<n>                  connect failures in a row that eject a server (0: never)\n"
+             << "  --eject_time=<sec>                 how long an ejected server is passed over (default: 10)\n"
+             << "  --dns_refresh=<sec>                look up servers given by name again this often (default: 30, 0: once)\n"
+             << "  --upstream_pool=<n>                connections to each remote server each loop keeps ready\n"
+             << "  --upstream_idle_timeout=<sec>      replace a ready connection after this long unused (default: 30)\n"
+             << "  --connect_timeout=<sec>            give up a connect to the remote server (default: 10, 0: never)\n"
+             << "  --idle_timeout=<sec>               close a bridge that reads nothing this long (default: 0, never)\n"
+             << "  --write_timeout=<sec>              close a bridge whose write is stuck this long (default: 60, 0: never)\n"
+             << "  --framing=(base64|binary)          wire format of the encoded side (default: base64)\n"
+             << "  --compression=(off|lz4|zstd)       compress each chunk before it is framed (default: off)\n"
+             << "  --compression_level=<n>            zstd level, or LZ4 acceleration (default: the codec's)\n"
+             << "  --compression_dictionary=<file>    trained zstd dictionary\n"
+             << "  --cipher=(xor|chacha20)            cipher of the framed data (default: xor)\n"
+             << "  --cipher_key_file=<file>           ChaCha20 key, as 64 hex digits\n"
+             << "  --nodelay=(on|off)                 send frames without waiting for ACKs (default: on)\n"
+             << "  --send_buffer=<bytes>              SO_SNDBUF of the sockets (default: the system's)\n"
+             << "  --receive_buffer=<bytes>           SO_RCVBUF of the sockets (default: the system's)\n"
+             << "  --keepalive_idle=<sec>             idle time before keepalive probes (default: 0, none)\n"
+             << "  --keepalive_interval=<sec>         time between keepalive probes\n"
+             << "  --keepalive_count=<n>              unanswered probes that drop a connection\n"
+             << "  --quickack=(on|off)                ACK every segment at once (Linux)\n"
+             << "  --cork=(on|off)                    only send full segments (Linux)\n"
+             << "                                     socket options apply to both sides, or with a\n"
+             << "                                     downstream_ or upstream_ prefix to one side\n"
+             << "  --mux=(on|off)                     carry the clients over shared tunnels (both ends)\n"
+             << "  --mux_tunnels=<n>                  tunnels each loop of the encode end keeps (default: 1)\n"
+             << "  --mux_window=<bytes>               bytes in flight per stream and direction (default: 262144)\n"
+             << "  --io_engine=(reactor|io_uring|coroutine)\n"
+             << "                                     how bridge sockets are read and written (default: reactor)\n"
+             << "  --uring_entries=<n>                submission queue size of each loop's ring (default: 4096)\n"
+             << "  --uring_buffers=<n>                receive buffers each loop registers with its ring (default: 1024)\n"
+             << "  --metrics=<ip>:<port>              serve Prometheus metrics on GET /metrics\n"
+             << "  --trace_sample=<n>                 trace one bridge in n, served on GET /traces (default: 0, none)\n"
+             << "  --trace_buffer=<n>                 traces each loop keeps (default: 4096)\n"
+          #ifdef TCP_PROXY_HANDOFF
+             << "  --handoff=<path>                   take the listening sockets over from the process at a Unix socket\n"
+             << "                                     path, and hand them on to the next one started with it\n"
+          #endif
+             << "  --drain_timeout=<sec>              once handed over, close after this long (default: 0, once idle)" << std::endl;
+   std::exit(1);
+}
+
+bool parse_size(const std::string& value, std::size_t& result)
+{
+   if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+   {
+      return false;
+   }
+
+   result = static_cast<std::size_t>(std::strtoul(value.c_str(), 0, 10));
+   return true;
+}
+
+bool parse_bool(const std::string& value, bool& result)
+{
+   if (value == "on" || value == "true" || value == "1")
+   {
+      result = true;
+   }
+   else if (value == "off" || value == "false" || value == "0")
+   {
+      result = false;
+   }
+   else
+   {
+      return false;
+   }
+
+   return true;
+}
+
+// Splits "host:port", where the host is an address, an IPv6 one possibly
+// in brackets, or a name.
+bool split_name_port(const std::string& value, std::string& host, unsigned short& port)
+{
+   const std::string::size_type colon = value.rfind(':');
+   std::size_t number = 0;
+
+   if (colon == std::string::npos ||
+       !parse_size(value.substr(colon + 1), number) ||
+       number == 0 || number > 65535)
+   {
+      return false;
+   }
+
+   host = value.substr(0, colon);
+
+   if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+   {
+      host = host.substr(1, host.size() - 2);
+   }
+
+   port = static_cast<unsigned short>(number);
+   return !host.empty();
+}
+
+// Splits "ip:port", where an IPv6 address may be given in brackets.
+bool split_host_port(const std::string& value, std::string& host, unsigned short& port)
+{
+   if (!split_name_port(value, host, port))
+   {
+      return false;
+   }
+
+   boost::system::error_code ec;
+   boost::asio::ip::address::from_string(host, ec);
+   return !ec;
+}
+
+// Sets the forward server, by address if the host is one and by name
+// otherwise.
+void set_forward(const std::string& host, unsigned short port, tcp_proxy::config& config)
+{
+   boost::system::error_code ec;
+   const boost::asio::ip::address address = boost::asio::ip::address::from_string(host, ec);
+
+   if (ec)
+   {
+      config.forward = tcp_proxy::ip::tcp::endpoint(tcp_proxy::ip::tcp::v4(), port);
+      config.forward_name = host;
+   }
+   else
+   {
+      config.forward = tcp_proxy::ip::tcp::endpoint(address, port);
+      config.forward_name.clear();
+   }
+}
+
+// Parses the value of a socket option, named without its side's prefix.
+bool parse_socket_option(const std::string& name, const std::string& value, tcp_proxy::socket_options& options)
+{
+   if (!tcp_proxy::socket_option_supported(name))
+   {
+      return false;
+   }
+   else if (name == "nodelay")
+   {
+      return parse_bool(value, options.nodelay);
+   }
+   else if (name == "send_buffer")
+   {
+      return parse_size(value, options.send_buffer);
+   }
+   else if (name == "receive_buffer")
+   {
+      return parse_size(value, options.receive_buffer);
+   }
+   else if (name == "keepalive_idle")
+   {
+      return parse_size(value, options.keepalive_idle);
+   }
+   else if (name == "keepalive_interval")
+   {
+      return parse_size(value, options.keepalive_interval);
+   }
+   else if (name == "keepalive_count")
+   {
+      return parse_size(value, options.keepalive_count);
+   }
+   else if (name == "quickack")
+   {
+      return parse_bool(value, options.quickack);
+   }
+   else if (name == "cork")
+   {
+      return parse_bool(value, options.cork);
+   }
+
+   return false;
+}
+
+bool parse_option(const std::string& arg, tcp_proxy::config& config);
+
+// Reads options from a file, one "name=value" to a line. Blank lines and
+// lines starting with # are skipped.
+bool parse_config_file(const std::string& path, tcp_proxy::config& config)
+{
+   std::ifstream file(path.c_str());
+
+   if (!file)
+   {
+      std::cerr << "cannot read " << path << std::endl;
+      return false;
+   }
+
+   std::string line;
+
+   for (std::size_t number = 1; std::getline(file, line); ++number)
+   {
+      const std::string::size_type first = line.find_first_not_of(" \t\r");
+
+      if (first == std::string::npos || line[first] == '#')
+      {
+         continue;
+      }
+
+      line = line.substr(first, line.find_last_not_of(" \t\r") + 1 - first);
+
+      if (line.compare(0, 7, "config=") == 0 || !parse_option("--" + line, config))
+      {
+         std::cerr << path << ":" << number << ": invalid option: " << line << std::endl;
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Parses a single "--name=value" argument into the configuration.
+bool parse_option(const std::string& arg, tcp_proxy::config& config)
+{
+   const std::string::size_type eq = arg.find('=');
+
+   if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+   {
+      return false;
+   }
+
+   const std::string name  = arg.substr(2, eq - 2);
+   const std::string value = arg.substr(eq + 1);
+
+   if (name == "listen")
+   {
+      return split_host_port(value, config.local_host, config.local_port);
+   }
+   else if (name == "forward")
+   {
+      std::string host;
+      unsigned short port = 0;
+
+      if (!split_name_port(value, host, port))
+      {
+         return false;
+      }
+
+      set_forward(host, port, config);
+      return true;
+   }
+   else if (name == "mode")
+   {
+      config.direction = value;
+      return value == "encode" || value == "decode" || value == "passthrough";
+   }
+   else if (name == "config")
+   {
+      config.config_file = value;
+      return parse_config_file(value, config);
+   }
+#ifdef TCP_PROXY_HANDOFF
+   else if (name == "handoff")
+   {
+      config.handoff_path = value;
+      return !value.empty();
+   }
+#endif
+   else if (name == "drain_timeout")
+   {
+      return parse_size(value, config.drain_timeout);
+   }
+   else if (name == "threads")
+   {
+      return parse_size(value, config.threads) && config.threads > 0;
+   }
+   else if (name == "acceptors")
+   {
+      return parse_size(value, config.acceptors) && config.acceptors > 0;
+   }
+#ifdef TCP_PROXY_AFFINITY
+   else if (name == "cpus")
+   {
+      std::vector<int> cpus;
+
+      if (!tcp_proxy::affinity::parse_cpu_list(value, cpus))
+      {
+         return false;
+      }
+
+      config.cpus.swap(cpus);
+      return true;
+   }
+   else if (name == "cpus_near")
+   {
+      std::vector<int> cpus;
+
+      if (!tcp_proxy::affinity::interface_cpus(value, cpus))
+      {
+         return false;
+      }
+
+      config.cpus.swap(cpus);
+      return true;
+   }
+#endif
+   else if (name == "pending_accepts")
+   {
+      return parse_size(value, config.pending_accepts) && config.pending_accepts > 0;
+   }
+   else if (name == "max_bridges")
+   {
+      return parse_size(value, config.limits.max_bridges);
+   }
+   else if (name == "max_bridges_per_source")
+   {
+      return parse_size(value, config.limits.max_bridges_per_source);
+   }
+   else if (name == "connection_rate")
+   {
+      return parse_size(value, config.limits.connection_rate);
+   }
+   else if (name == "connection_burst")
+   {
+      return parse_size(value, config.limits.connection_burst);
+   }
+   else if (name == "bridge_rate")
+   {
+      return parse_size(value, config.limits.bridge_rate);
+   }
+   else if (name == "bridge_burst")
+   {
+      return parse_size(value, config.limits.bridge_burst);
+   }
+   else if (name == "max_in_flight")
+   {
+      return parse_size(value, config.max_in_flight) && config.max_in_flight > 0;
+   }
+   else if (name == "low_watermark")
+   {
+      return parse_size(value, config.low_watermark);
+   }
+   else if (name == "memory_budget")
+   {
+      return parse_size(value, config.memory_budget_bytes);
+   }
+   else if (name == "coalesce_bytes")
+   {
+      return parse_size(value, config.coalesce_bytes);
+   }
+   else if (name == "coalesce_delay")
+   {
+      return parse_size(value, config.coalesce_delay);
+   }
+   else if (name == "buffer_cache")
+   {
+      return parse_size(value, config.buffer_cache);
+   }
+   else if (name == "bridge_cache")
+   {
+      return parse_size(value, config.bridge_cache);
+   }
+   else if (name == "chunk_size")
+   {
+      return parse_size(value, config.chunk_size) && config.chunk_size > 0;
+   }
+   else if (name == "max_chunk_size")
+   {
+      return parse_size(value, config.max_chunk_size);
+   }
+   else if (name == "adaptive_chunks")
+   {
+      return parse_bool(value, config.adaptive_chunks);
+   }
+   else if (name == "upstream_pool")
+   {
+      return parse_size(value, config.upstream_pool);
+   }
+   else if (name == "upstream_idle_timeout")
+   {
+      return parse_size(value, config.upstream_idle_timeout) && config.upstream_idle_timeout > 0;
+   }
+   else if (name == "framing")
+   {
+      if (value == "base64")
+      {
+         config.framing = tcp_proxy::framing_base64;
+      }
+      else if (value == "binary")
+      {
+         config.framing = tcp_proxy::framing_binary;
+      }
+      else
+      {
+         return false;
+      }
+
+      return true;
+   }
+   else if (name == "compression")
+   {
+      if (value == "off")
+      {
+         config.compression = tcp_proxy::compression_off;
+      }
+      else if (value == "lz4")
+      {
+         config.compression = tcp_proxy::compression_lz4;
+      }
+      else if (value == "zstd")
+      {
+         config.compression = tcp_proxy::compression_zstd;
+      }
+      else
+      {
+         return false;
+      }
+
+      return tcp_proxy::compression_supported(config.compression);
+   }
+   else if (name == "compression_level")
+   {
+      return parse_size(value, config.compression_level);
+   }
+   else if (name == "compression_dictionary")
+   {
+      config.compression_dictionary = value;
+      return !value.empty();
+   }
+   else if (name == "cipher")
+   {
+      if (value == "xor")
+      {
+         config.cipher = tcp_proxy::cipher_xor;
+      }
+      else if (value == "chacha20")
+      {
+         config.cipher = tcp_proxy::cipher_chacha20;
+      }
+      else
+      {
+         return false;
+      }
+
+      return true;
+   }
+   else if (name == "cipher_key_file")
+   {
+      config.cipher_key_file = value;
+      return !value.empty();
+   }
+   else if (name == "mux")
+   {
+      return parse_bool(value, config.mux);
+   }
+   else if (name == "mux_tunnels")
+   {
+      return parse_size(value, config.mux_tunnels) && config.mux_tunnels > 0;
+   }
+   else if (name == "mux_window")
+   {
+      return parse_size(value, config.mux_window) && config.mux_window > 0;
+   }
+   else if (name == "io_engine")
+   {
+      if (value == "reactor")
+      {
+         config.io_engine = tcp_proxy::io_engine_reactor;
+      }
+   #ifdef TCP_PROXY_IO_URING
+      else if (value == "io_uring")
+      {
+         config.io_engine = tcp_proxy::io_engine_uring;
+      }
+   #endif
+   #ifdef TCP_PROXY_COROUTINES
+      else if (value == "coroutine")
+      {
+         config.io_engine = tcp_proxy::io_engine_coroutine;
+      }
+   #endif
+      else
+      {
+         return false;
+      }
+
+      return true;
+   }
+   else if (name == "uring_entries")
+   {
+      return parse_size(value, config.uring_entries) && config.uring_entries > 0;
+   }
+   else if (name == "uring_buffers")
+   {
+      return parse_size(value, config.uring_buffers) && config.uring_buffers > 0;
+   }
+   else if (name == "metrics")
+   {
+      return split_host_port(value, config.metrics_host, config.metrics_port);
+   }
+   else if (name == "trace_sample")
+   {
+      return parse_size(value, config.trace_sample);
+   }
+   else if (name == "trace_buffer")
+   {
+      return parse_size(value, config.trace_buffer) && config.trace_buffer > 0;
+   }
+   else if (name == "backend")
+   {
+      std::string host;
+      unsigned short port = 0;
+
+      if (!split_name_port(value, host, port))
+      {
+         return false;
+      }
+
+      boost::system::error_code ec;
+      const boost::asio::ip::address address = boost::asio::ip::address::from_string(host, ec);
+
+      if (ec)
+      {
+         const tcp_proxy::server_name backend = { host, port };
+         config.backend_names.push_back(backend);
+      }
+      else
+      {
+         config.backends.push_back(tcp_proxy::ip::tcp::endpoint(address, port));
+      }
+
+      return true;
+   }
+   else if (name == "backend_balance")
+   {
+      if (value == "round_robin")
+      {
+         config.backend_balance = tcp_proxy::backend_round_robin;
+      }
+      else if (value == "least_active")
+      {
+         config.backend_balance = tcp_proxy::backend_least_active;
+      }
+      else if (value == "ewma")
+      {
+         config.backend_balance = tcp_proxy::backend_ewma;
+      }
+      else
+      {
+         return false;
+      }
+
+      return true;
+   }
+   else if (name == "connect_timeout")
+   {
+      return parse_size(value, config.connect_timeout);
+   }
+   else if (name == "idle_timeout")
+   {
+      return parse_size(value, config.idle_timeout);
+   }
+   else if (name == "write_timeout")
+   {
+      return parse_size(value, config.write_timeout);
+   }
+   else if (name == "eject_after")
+   {
+      return parse_size(value, config.eject_after);
+   }
+   else if (name == "eject_time")
+   {
+      return parse_size(value, config.eject_time);
+   }
+   else if (name == "dns_refresh")
+   {
+      return parse_size(value, config.dns_refresh);
+   }
+   else if (name == "balance")
+   {
+      if (value == "round_robin")
+      {
+         config.balance = tcp_proxy::balance_round_robin;
+      }
+      else if (value == "least_load")
+      {
+         config.balance = tcp_proxy::balance_least_load;
+      }
+      else if (value == "local")
+      {
+         config.balance = tcp_proxy::balance_local;
+      }
+      else
+      {
+         return false;
+      }
+
+      return true;
+   }
+   else if (name.compare(0, 11, "downstream_") == 0)
+   {
+      return parse_socket_option(name.substr(11), value, config.downstream_options);
+   }
+   else if (name.compare(0, 9, "upstream_") == 0)
+   {
+      return parse_socket_option(name.substr(9), value, config.upstream_options);
+   }
+   else if (tcp_proxy::socket_option_supported(name))
+   {
+      return parse_socket_option(name, value, config.downstream_options) &&
+             parse_socket_option(name, value, config.upstream_options);
+   }
+
+   return false;
+}
+
+// Builds the configuration from the command line: the five positional
+// arguments or --listen, --forward and --mode, then the options, any of
+// which may come from a --config file. Run again on every reload.
+bool load_config(const std::vector<std::string>& args, tcp_proxy::config& config)
+{
+   std::size_t first = 0;
+
+   if (!args.empty() && args[0].compare(0, 2, "--") != 0)
+   {
+      if (args.size() < 5)
+      {
+         return false;
+      }
+
+      if (args[2].empty())
+      {
+         std::cerr << "invalid forward host: " << args[2] << std::endl;
+         return false;
+      }
+
+      config.local_host = args[0];
+      config.local_port = static_cast<unsigned short>(::atoi(args[1].c_str()));
+      set_forward(args[2], static_cast<unsigned short>(::atoi(args[3].c_str())), config);
+      config.direction  = args[4];
+      first = 5;
+   }
+
+   for (std::size_t i = first; i < args.size(); ++i)
+   {
+      if (!parse_option(args[i], config))
+      {
+         std::cerr << "invalid option: " << args[i] << std::endl;
+         return false;
+      }
+   }
+
+   if (config.local_host.empty() ||
+       config.forward.port() == 0 ||
+       (config.direction != "encode" && config.direction != "decode" && config.direction != "passthrough"))
+   {
+      return false;
+   }
+
+   // The acceptors, and the admission limits per client address, are
+   // IPv4 only.
+   boost::system::error_code ec;
+   boost::asio::ip::address_v4::from_string(config.local_host, ec);
+
+   if (ec)
+   {
+      std::cerr << "listen address must be IPv4: " << config.local_host << std::endl;
+      return false;
+   }
+
+   if (config.max_chunk_size < config.chunk_size)
+   {
+      config.max_chunk_size = config.chunk_size;
+   }
+
+   if (config.max_in_flight == 0)
+   {
+      config.max_in_flight = 2 * config.chunk_size;
+   }
+
+   if (config.low_watermark == 0 || config.low_watermark > config.max_in_flight)
+   {
+      config.low_watermark = config.max_in_flight / 2;
+   }
+
+   return true;
+}
+
+int main(int argc, char* argv[])
+{
+   const std::vector<std::string> args(argv + 1, argv + argc);
+   tcp_proxy::config config;
+
+   if (!load_config(args, config))
+   {
+      usage();
+   }
+
+   if (config.direction == "encode")
+   {
+      tcp_proxy::g_encode = true;
+   }
+   else if (config.direction == "decode")
+   {
+      tcp_proxy::g_encode = false;
+   }
+   else
+   {
+      tcp_proxy::g_passthrough = true;
+   }
+
+   try
+   {
+      boost::shared_ptr<tcp_proxy::compression_dictionary> dictionary;
+
+      if (!config.compression_dictionary.empty())
+      {
+         dictionary.reset(new tcp_proxy::compression_dictionary(config.compression_dictionary,
+                                                                static_cast<int>(config.compression_level)));
+      }
+
+      boost::shared_ptr<const chacha20::key> cipher_key;
+
+      if (config.mux && tcp_proxy::g_passthrough)
+      {
+         throw std::runtime_error("--mux needs encode or decode");
+      }
+
+      if (config.mux && tcp_proxy::g_encode && config.upstream_pool)
+      {
+         throw std::runtime_error("--upstream_pool is for the decode end of mux tunnels");
+      }
+
+      if (config.cipher == tcp_proxy::cipher_chacha20)
+      {
+         if (config.cipher_key_file.empty())
+         {
+            throw std::runtime_error("--cipher=chacha20 needs a --cipher_key_file");
+         }
+
+         cipher_key.reset(new chacha20::key(chacha20::key::from_file(config.cipher_key_file)));
+      }
+
+      // Outlives the pool, whose bridges give their places back to it.
+      tcp_proxy::admission admission(config.limits);
+
+      tcp_proxy::io_service_pool pool(config);
+      tcp_proxy::backend_set backends(config.backend_balance, config.eject_after, config.eject_time);
+
+      tcp_proxy::server_directory servers(pool, backends, config.dns_refresh);
+      servers.resolve(config);
+      servers.start();
+
+      for (std::size_t i = 0; i < pool.size(); ++i)
+      {
+         tcp_proxy::io_service_pool::worker& worker = pool.get_worker(i);
+
+         if (config.compression != tcp_proxy::compression_off)
+         {
+            worker.compression.reset(new tcp_proxy::compressor(config.compression,
+                                                               static_cast<int>(config.compression_level),
+                                                               dictionary.get()));
+         }
+
+         if (cipher_key)
+         {
+            const unsigned char seed_nonce[chacha20::nonce_size] = { 0 };
+            worker.cipher_key = cipher_key;
+            worker.nonces.reset(chacha20::key::random(), seed_nonce);
+         }
+
+         worker.sync_upstreams(backends);
+
+         if (config.mux && tcp_proxy::g_encode)
+         {
+            worker.mux.reset(new tcp_proxy::mux_pool(worker, config, backends));
+            worker.mux->start();
+         }
+      }
+
+      std::vector<boost::shared_ptr<tcp_proxy::bridge::acceptor> > acceptors;
+      boost::shared_ptr<tcp_proxy::metrics_endpoint> metrics;
+
+   #ifdef TCP_PROXY_HANDOFF
+      typedef tcp_proxy::handoff_server::protocol handoff_protocol;
+      handoff_protocol::socket predecessor(pool.get_worker(0).io_service);
+      bool handed_over = false;
+
+      if (!config.handoff_path.empty())
+      {
+         std::vector<int> fds;
+         std::string kinds;
+
+         handed_over = tcp_proxy::handoff_server::take_over(predecessor, config.handoff_path, fds, kinds);
+
+         // The listening sockets, and so the addresses, are the older
+         // process's.
+         for (std::size_t i = 0; i < fds.size(); ++i)
+         {
+            if (kinds[i] == tcp_proxy::handoff::client_listener)
+            {
+               acceptors.push_back(boost::shared_ptr<tcp_proxy::bridge::acceptor>(
+                    new tcp_proxy::bridge::acceptor(pool.get_worker(acceptors.size()), pool, config,
+                                                    backends, admission, fds[i])));
+            }
+            else if (kinds[i] == tcp_proxy::handoff::metrics_listener && config.metrics_port != 0 && !metrics)
+            {
+               metrics.reset(new tcp_proxy::metrics_endpoint(pool.get_worker(0), pool, backends, fds[i]));
+            }
+            else
+            {
+               ::close(fds[i]);
+            }
+         }
+      }
+   #endif
+
+      if (acceptors.empty())
+      {
+         for (std::size_t i = 0; i < config.acceptors; ++i)
+         {
+            acceptors.push_back(boost::shared_ptr<tcp_proxy::bridge::acceptor>(
+                 new tcp_proxy::bridge::acceptor(pool.get_worker(i), pool, config, backends,
+                                                 admission, config.local_host, config.local_port)));
+         }
+      }
+
+      for (std::size_t i = 0; i < acceptors.size(); ++i)
+      {
+         acceptors[i]->accept_connections();
+      }
+
+      if (config.metrics_port != 0 && !metrics)
+      {
+         metrics.reset(new tcp_proxy::metrics_endpoint(pool.get_worker(0), pool, backends,
+                                                       config.metrics_host,
+                                                       config.metrics_port));
+      }
+
+      if (metrics)
+      {
+         metrics->accept_connections();
+      }
+
+      boost::shared_ptr<tcp_proxy::config_reloader> reloader;
+
+      if (!config.config_file.empty())
+      {
+         reloader.reset(new tcp_proxy::config_reloader(pool, servers, admission,
+                                                       boost::bind(&load_config, boost::cref(args), _1)));
+         reloader->start();
+      }
+
+   #ifdef TCP_PROXY_HANDOFF
+      boost::shared_ptr<tcp_proxy::handoff_server> handoff;
+
+      if (!config.handoff_path.empty())
+      {
+         handoff.reset(new tcp_proxy::handoff_server(pool, config.handoff_path, config.drain_timeout,
+                                                     acceptors, metrics.get(), servers, reloader.get()));
+         handoff->start();
+
+         if (handed_over)
+         {
+            tcp_proxy::handoff_server::answer(predecessor);
+         }
+      }
+   #endif
 
-      ios.run();
+      pool.run();
    }
    catch(std::exception& e)
    {
@@ -0,0 +1,313 @@
+//
+// timer_wheel.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Coarse timeouts for one loop, kept in a hierarchical timer wheel driven
+// by a single deadline_timer. Entries are embedded in their owners and
+// linked into the wheel's slots, so scheduling, moving or cancelling one
+// is a few pointer updates, with no allocation and no heap of timers.
+//
+// The wheel has four levels of 64 slots. Level 0 holds the entries due in
+// the next 64 ticks, one slot per tick; each level above covers 64 times
+// the span of the one below, and its slots are moved down a level as the
+// wheel turns into them. The timer only runs while entries are scheduled.
+//
+// Only ever used from its loop's thread.
+//
+
+
+#ifndef INCLUDE_TIMER_WHEEL_HPP
+#define INCLUDE_TIMER_WHEEL_HPP
+
+
+#include <cstddef>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "metrics.hpp"
+
+
+namespace tcp_proxy
+{
+   class timer_wheel : private boost::noncopyable
+   {
+   public:
+
+      typedef boost::uint64_t tick_type;
+
+      // A timeout, which expired() is called for once the wheel reaches
+      // its tick. It may be scheduled again from there.
+      class entry : private boost::noncopyable
+      {
+      public:
+
+         entry()
+         : wheel_(0),
+           slot_(0),
+           prev_(0),
+           next_(0),
+           expiry_(0)
+         {}
+
+         virtual ~entry()
+         {
+            cancel();
+         }
+
+         bool active() const
+         {
+            return wheel_ != 0;
+         }
+
+         tick_type expiry() const
+         {
+            return expiry_;
+         }
+
+         void cancel()
+         {
+            if (wheel_)
+            {
+               wheel_->unlink(*this);
+            }
+         }
+
+         virtual void expired() = 0;
+
+      private:
+
+         friend class timer_wheel;
+
+         timer_wheel* wheel_;
+         entry** slot_;
+         entry* prev_;
+         entry* next_;
+         tick_type expiry_;
+      };
+
+      timer_wheel(boost::asio::io_service& io_service, std::size_t tick_milliseconds)
+      : timer_(io_service),
+        tick_nanoseconds_(static_cast<metrics::value_type>(tick_milliseconds) * 1000000u),
+        origin_(metrics::now()),
+        now_(0),
+        size_(0),
+        running_(false)
+      {
+         for (std::size_t l = 0; l < levels; ++l)
+         {
+            for (std::size_t s = 0; s < slots; ++s)
+            {
+               slots_[l][s] = 0;
+            }
+         }
+      }
+
+      // Entries destroyed after the wheel find themselves unlinked.
+      ~timer_wheel()
+      {
+         for (std::size_t l = 0; l < levels; ++l)
+         {
+            for (std::size_t s = 0; s < slots; ++s)
+            {
+               for (entry* e = slots_[l][s]; e != 0; e = e->next_)
+               {
+                  e->wheel_ = 0;
+               }
+            }
+         }
+      }
+
+      // The current tick: as of the last turn of the wheel while it runs,
+      // and from the clock while it is stopped.
+      tick_type now() const
+      {
+         return running_ ? now_ : elapsed();
+      }
+
+      tick_type ticks(std::size_t seconds) const
+      {
+         return static_cast<tick_type>(seconds) * 1000000000u / tick_nanoseconds_;
+      }
+
+      // Ticks enough to cover the given nanoseconds.
+      tick_type ticks_covering(metrics::value_type nanoseconds) const
+      {
+         return (nanoseconds + tick_nanoseconds_ - 1) / tick_nanoseconds_;
+      }
+
+      // Schedules, or moves, e to expire at the given tick, or the next
+      // one if that has passed.
+      void schedule(entry& e, tick_type expiry)
+      {
+         if (e.wheel_)
+         {
+            unlink(e);
+         }
+
+         if (!running_)
+         {
+            // Nothing was scheduled; catch up with the clock at once.
+            now_ = elapsed();
+            start();
+         }
+
+         e.wheel_ = this;
+         e.expiry_ = (expiry > now_) ? expiry : now_ + 1;
+         link(e);
+         ++size_;
+      }
+
+   private:
+
+      enum {
+         level_bits = 6,
+         slots = 1 << level_bits,
+         levels = 4
+      };
+
+      tick_type elapsed() const
+      {
+         return (metrics::now() - origin_) / tick_nanoseconds_;
+      }
+
+      void start()
+      {
+         running_ = true;
+         timer_.expires_from_now(boost::posix_time::microseconds(tick_nanoseconds_ / 1000));
+         timer_.async_wait(
+              boost::bind(&timer_wheel::handle_tick,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      void handle_tick(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            running_ = false;
+            return;
+         }
+
+         for (const tick_type target = elapsed(); now_ < target && size_ > 0; )
+         {
+            advance();
+         }
+
+         if (size_ > 0)
+         {
+            start();
+         }
+         else
+         {
+            running_ = false;
+         }
+      }
+
+      // Turns to the next tick: slots of the levels above that start at it
+      // are moved down, then what is due is expired.
+      void advance()
+      {
+         ++now_;
+
+         for (std::size_t l = 1; l < levels; ++l)
+         {
+            if ((now_ & ((static_cast<tick_type>(1) << (l * level_bits)) - 1)) != 0)
+            {
+               break;
+            }
+
+            const std::size_t s = static_cast<std::size_t>(now_ >> (l * level_bits)) & (slots - 1);
+            entry* list = slots_[l][s];
+            slots_[l][s] = 0;
+
+            while (list)
+            {
+               entry* e = list;
+               list = e->next_;
+               link(*e);
+            }
+         }
+
+         entry** due = &slots_[0][static_cast<std::size_t>(now_) & (slots - 1)];
+
+         // Expiry handlers only schedule into later slots.
+         while (*due)
+         {
+            entry& e = **due;
+            unlink(e);
+            e.expired();
+         }
+      }
+
+      void link(entry& e)
+      {
+         const tick_type delta = e.expiry_ - now_;
+         std::size_t l = 0;
+
+         while (l + 1 < levels && delta >= (static_cast<tick_type>(1) << ((l + 1) * level_bits)))
+         {
+            ++l;
+         }
+
+         // Beyond the top level's span an entry waits in its last slot and
+         // is moved down from there.
+         const tick_type expiry = (l + 1 == levels && delta >= (static_cast<tick_type>(1) << (levels * level_bits)))
+                                  ? now_ + (static_cast<tick_type>(1) << (levels * level_bits)) - 1
+                                  : e.expiry_;
+
+         entry** slot = &slots_[l][static_cast<std::size_t>(expiry >> (l * level_bits)) & (slots - 1)];
+
+         e.slot_ = slot;
+         e.prev_ = 0;
+         e.next_ = *slot;
+
+         if (*slot)
+         {
+            (*slot)->prev_ = &e;
+         }
+
+         *slot = &e;
+      }
+
+      void unlink(entry& e)
+      {
+         if (e.prev_)
+         {
+            e.prev_->next_ = e.next_;
+         }
+         else
+         {
+            *e.slot_ = e.next_;
+         }
+
+         if (e.next_)
+         {
+            e.next_->prev_ = e.prev_;
+         }
+
+         e.wheel_ = 0;
+         e.slot_ = 0;
+         e.prev_ = 0;
+         e.next_ = 0;
+         --size_;
+      }
+
+      boost::asio::deadline_timer timer_;
+      metrics::value_type tick_nanoseconds_;
+      metrics::value_type origin_;
+      tick_type now_;
+      std::size_t size_;
+      bool running_;
+      entry* slots_[levels][slots];
+   };
+}
+
+#endif
@@ -0,0 +1,150 @@
+//
+// trace.hpp
+// ~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Sampled timings of the data moving through a bridge. A traced bridge
+// follows one read at a time in each direction, stamping when the read
+// completed, when what it read had been transformed and queued, when the
+// write carrying it started and when that write completed. The finished
+// records go into a fixed ring per I/O loop, overwriting the oldest.
+//
+// Only the loop's thread writes its ring, publishing each record with a
+// release store of the count. A dump copies the ring without a lock and
+// then drops the records the loop may have overwritten while it copied.
+//
+
+
+#ifndef INCLUDE_TRACE_HPP
+#define INCLUDE_TRACE_HPP
+
+
+#include <algorithm>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "metrics.hpp"
+
+
+namespace metrics
+{
+   struct trace_record
+   {
+      trace_record()
+      : loop(0),
+        bridge(0),
+        upstream(false),
+        bytes(0),
+        read(0),
+        queued(0),
+        write_started(0),
+        written(0)
+      {}
+
+      std::size_t loop;
+      value_type bridge;
+
+      // Client to remote server, or the other way.
+      bool upstream;
+      std::size_t bytes;
+
+      // From now().
+      value_type read;
+      value_type queued;
+      value_type write_started;
+      value_type written;
+   };
+
+   class trace_ring : private boost::noncopyable
+   {
+   public:
+
+      // Holds nothing while capacity is 0.
+      explicit trace_ring(std::size_t capacity)
+      : records_(capacity),
+        count_(0)
+      {}
+
+      bool enabled() const
+      {
+         return !records_.empty();
+      }
+
+      // From the loop's thread.
+      void push(const trace_record& r)
+      {
+         const value_type n = count_.load(boost::memory_order_relaxed);
+         records_[static_cast<std::size_t>(n % records_.size())] = r;
+         count_.store(n + 1, boost::memory_order_release);
+      }
+
+      // Appends the records held, oldest first. Safe to call from any
+      // thread.
+      void copy(std::vector<trace_record>& out) const
+      {
+         if (!enabled())
+         {
+            return;
+         }
+
+         const value_type size = records_.size();
+         const value_type end = count_.load(boost::memory_order_acquire);
+         const value_type begin = (end > size) ? end - size : 0;
+         const std::size_t first = out.size();
+
+         for (value_type i = begin; i < end; ++i)
+         {
+            out.push_back(records_[static_cast<std::size_t>(i % size)]);
+         }
+
+         // The loop may since have written the records below latest - size,
+         // and be writing record latest over the one size before it.
+         boost::atomic_thread_fence(boost::memory_order_acquire);
+         const value_type latest = count_.load(boost::memory_order_relaxed);
+         const value_type valid = (latest + 1 > size) ? latest + 1 - size : 0;
+
+         if (valid > begin)
+         {
+            const std::size_t torn = static_cast<std::size_t>(std::min(valid, end) - begin);
+            out.erase(out.begin() + first, out.begin() + first + torn);
+         }
+      }
+
+   private:
+
+      std::vector<trace_record> records_;
+      boost::atomic<value_type> count_;
+   };
+
+   // One JSON object a line, with the time each stage took. read_ns is on
+   // the monotonic clock, so only differences between records mean much.
+   inline void write_traces(std::ostream& out, const std::vector<trace_record>& records)
+   {
+      for (std::size_t i = 0; i < records.size(); ++i)
+      {
+         const trace_record& r = records[i];
+
+         out << "{\"loop\":" << r.loop
+             << ",\"bridge\":" << r.bridge
+             << ",\"direction\":\"" << (r.upstream ? "upstream" : "downstream") << "\""
+             << ",\"bytes\":" << r.bytes
+             << ",\"read_ns\":" << r.read
+             << ",\"transform_ns\":" << (r.queued - r.read)
+             << ",\"queue_ns\":" << (r.write_started - r.queued)
+             << ",\"write_ns\":" << (r.written - r.write_started)
+             << ",\"total_ns\":" << (r.written - r.read)
+             << "}\n";
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,330 @@
+//
+// upstream_pool.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Pre-established connections to one remote server, for one I/O loop. A
+// new bridge takes a connection that is already up instead of waiting for
+// its own handshake, and the pool connects a replacement in the background.
+//
+// Idle connections are watched for readability: a remote server that
+// closes one, or resets it, gets it dropped from the pool, to be replaced
+// by the next maintenance round. One that sends first, as SMTP, FTP or
+// MySQL servers do, keeps it with its greeting for the client it goes to.
+// Connections idle for longer than the idle timeout are replaced.
+// The background connects feed the server's latency average and health.
+// A pool is stopped while its server is retired from the set, and started
+// again if it comes back.
+//
+
+
+#ifndef INCLUDE_UPSTREAM_POOL_HPP
+#define INCLUDE_UPSTREAM_POOL_HPP
+
+
+#include <cerrno>
+#include <cstddef>
+#include <list>
+
+#include <sys/socket.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "backends.hpp"
+#include "metrics.hpp"
+#include "socket_options.hpp"
+
+
+namespace tcp_proxy
+{
+   class upstream_pool : private boost::noncopyable
+   {
+   public:
+
+      typedef boost::asio::ip::tcp::socket socket_type;
+
+      upstream_pool(boost::asio::io_service& io_service,
+                    backend_set& backends,
+                    backend& target,
+                    std::size_t max_size,
+                    std::size_t idle_timeout,
+                    const socket_options& options)
+      : io_service_(io_service),
+        backends_(backends),
+        backend_(&target),
+        size_(max_size),
+        max_size_(0),
+        idle_timeout_(boost::posix_time::seconds(static_cast<long>(idle_timeout))),
+        options_(options),
+        connecting_(0),
+        maintenance_timer_(io_service)
+      {}
+
+      ~upstream_pool()
+      {
+         close_idle();
+      }
+
+      // Keeping connections ready; the pool stays empty otherwise.
+      bool enabled() const
+      {
+         return max_size_ > 0;
+      }
+
+      // Starts filling the pool. Must be called from the loop's thread, or
+      // before the loop runs, like stop().
+      void start()
+      {
+         if (enabled() || size_ == 0)
+         {
+            return;
+         }
+
+         max_size_ = size_;
+         refill();
+         schedule_maintenance();
+      }
+
+      // Closes the idle connections and makes no more; the connects under
+      // way are closed as they complete.
+      void stop()
+      {
+         max_size_ = 0;
+         close_idle();
+         maintenance_timer_.cancel();
+      }
+
+      // The server the pool connects to.
+      const backend& target() const
+      {
+         return *backend_;
+      }
+
+      // Connects to the server that has taken the place of the pool's one
+      // in the set from now on. The pool must be stopped.
+      void retarget(backend& target)
+      {
+         backend_ = &target;
+      }
+
+      // Hands the most recently established idle connection to target over
+      // to socket. Returns false if the pool is empty, or no longer
+      // connects to target.
+      bool acquire(socket_type& socket, const backend& target)
+      {
+         if (idle_.empty() || &target != backend_)
+         {
+            return false;
+         }
+
+         // Cancels the readability wait, whose handler then leaves the
+         // released socket alone.
+         boost::shared_ptr<socket_type> pooled = idle_.back().socket;
+         idle_.pop_back();
+
+         boost::system::error_code ec;
+         const socket_type::native_handle_type fd = pooled->release(ec);
+
+         if (!ec)
+         {
+            socket.assign(backend_->endpoint().protocol(), fd, ec);
+         }
+
+         refill();
+         return !ec;
+      }
+
+   private:
+
+      void close_idle()
+      {
+         for (std::list<entry>::iterator i = idle_.begin(); i != idle_.end(); ++i)
+         {
+            boost::system::error_code ec;
+            i->socket->close(ec);
+         }
+
+         idle_.clear();
+      }
+
+      struct entry
+      {
+         boost::shared_ptr<socket_type> socket;
+         boost::posix_time::ptime expires;
+      };
+
+      void refill()
+      {
+         while (idle_.size() + connecting_ < max_size_)
+         {
+            boost::shared_ptr<socket_type> socket(new socket_type(io_service_));
+
+            boost::system::error_code ec;
+            socket->open(backend_->endpoint().protocol(), ec);
+            apply_buffer_options(*socket, options_, ec);
+
+            socket->async_connect(backend_->endpoint(),
+                 boost::bind(&upstream_pool::handle_connect,
+                      this,
+                      socket,
+                      backend_,
+                      metrics::now(),
+                      boost::asio::placeholders::error));
+
+            ++connecting_;
+         }
+      }
+
+      // A connect started before the pool was retargeted is of no use,
+      // and tells nothing of the server now targeted.
+      void handle_connect(boost::shared_ptr<socket_type> socket,
+                          backend* target,
+                          metrics::value_type started,
+                          const boost::system::error_code& error)
+      {
+         --connecting_;
+
+         if (target != backend_)
+         {
+            boost::system::error_code ec;
+            socket->close(ec);
+            return;
+         }
+
+         if (error)
+         {
+            backends_.connect_failed(*backend_);
+
+            // Retried by the next maintenance round rather than straight
+            // away, so an unreachable server isn't hammered.
+            return;
+         }
+
+         backends_.connect_succeeded(*backend_, metrics::now() - started);
+
+         if (!enabled())
+         {
+            boost::system::error_code ec;
+            socket->close(ec);
+            return;
+         }
+
+         apply_socket_options(*socket, options_);
+
+         entry e;
+         e.socket = socket;
+         e.expires = boost::posix_time::microsec_clock::universal_time() + idle_timeout_;
+         idle_.push_back(e);
+
+         watch(socket);
+      }
+
+      void watch(const boost::shared_ptr<socket_type>& socket)
+      {
+         socket->async_wait(socket_type::wait_read,
+              boost::bind(&upstream_pool::handle_readable,
+                   this,
+                   socket,
+                   boost::asio::placeholders::error));
+      }
+
+      // An idle connection was closed or written to by the remote server.
+      // What it sent stays queued on the socket; the connection is only
+      // dropped at the end of the stream or on an error. It isn't replaced
+      // here, so a server that closes every connection straight away is
+      // reconnected to once a maintenance round rather than in a loop.
+      void handle_readable(boost::shared_ptr<socket_type> socket,
+                           const boost::system::error_code& error)
+      {
+         if (error == boost::asio::error::operation_aborted || !socket->is_open())
+         {
+            return;
+         }
+
+         if (!error)
+         {
+            char byte;
+            const ssize_t peeked = ::recv(socket->native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+            if (peeked > 0)
+            {
+               // A greeting; the connection is no longer watched, and is
+               // handed out or times out as any other.
+               return;
+            }
+
+            if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+               watch(socket);
+               return;
+            }
+         }
+
+         for (std::list<entry>::iterator i = idle_.begin(); i != idle_.end(); ++i)
+         {
+            if (i->socket == socket)
+            {
+               boost::system::error_code ec;
+               socket->close(ec);
+               idle_.erase(i);
+               break;
+            }
+         }
+      }
+
+      void schedule_maintenance()
+      {
+         maintenance_timer_.expires_from_now(boost::posix_time::seconds(1));
+         maintenance_timer_.async_wait(
+              boost::bind(&upstream_pool::handle_maintenance,
+                   this,
+                   boost::asio::placeholders::error));
+      }
+
+      // Closes the connections that have been idle too long, oldest first,
+      // and replaces whatever is missing.
+      void handle_maintenance(const boost::system::error_code& error)
+      {
+         if (error)
+         {
+            return;
+         }
+
+         const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+         while (!idle_.empty() && idle_.front().expires <= now)
+         {
+            boost::system::error_code ec;
+            idle_.front().socket->close(ec);
+            idle_.pop_front();
+         }
+
+         refill();
+         schedule_maintenance();
+      }
+
+      boost::asio::io_service& io_service_;
+      backend_set& backends_;
+      backend* backend_;
+
+      // Connections kept while started, and the current target.
+      std::size_t size_;
+      std::size_t max_size_;
+      boost::posix_time::time_duration idle_timeout_;
+      const socket_options& options_;
+
+      // Oldest first.
+      std::list<entry> idle_;
+      std::size_t connecting_;
+      boost::asio::deadline_timer maintenance_timer_;
+   };
+}
+
+#endif
@@ -0,0 +1,503 @@
+//
+// xorb64.hpp
+// ~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0.
+//
+//
+// Description
+// ~~~~~~~~~~~
+// Fused XOR + Base64 kernels. xorb64enc XORs every input byte with a key
+// and Base64 encodes the result; xorb64dec decodes Base64 and XORs every
+// decoded byte with the key. The SIMD loops apply the key while the data is
+// already in registers, so each byte is loaded and stored only once.
+//
+// The kernel is chosen once at runtime from what the CPU supports
+// (AVX-512 VBMI, AVX2, SSSE3). Whatever the vector loop leaves over, and
+// every call on CPUs without those extensions, goes through the plain
+// XOR pass followed by TurboBase64, so the output is bit-for-bit that of
+// tb64enc/tb64dec.
+//
+
+
+#ifndef INCLUDE_XORB64_HPP
+#define INCLUDE_XORB64_HPP
+
+
+#include <cstddef>
+
+#include "TurboBase64/turbob64.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+   #define XORB64_X86
+   #include <immintrin.h>
+#endif
+
+
+namespace xorb64
+{
+   // Encodes length bytes of in to out, XORing in with key first. The input
+   // buffer is used as scratch space and its contents are unspecified
+   // afterwards. Returns the number of bytes written to out,
+   // TB64ENCLEN(length).
+   typedef std::size_t (*encode_function)(unsigned char* in, std::size_t length,
+                                          unsigned char* out, unsigned char key);
+
+   // Decodes length bytes of in to out, XORing every decoded byte with key.
+   // Returns the number of bytes written to out, or 0 if the input is not
+   // valid Base64.
+   typedef std::size_t (*decode_function)(const unsigned char* in, std::size_t length,
+                                          unsigned char* out, unsigned char key);
+
+   namespace details
+   {
+      inline std::size_t encode_tail(unsigned char* in, std::size_t length,
+                                     unsigned char* out, unsigned char key)
+      {
+         for (std::size_t i = 0; i < length; ++i)
+         {
+            in[i] ^= key;
+         }
+
+         return tb64enc(in, length, out);
+      }
+
+      inline std::size_t decode_tail(const unsigned char* in, std::size_t length,
+                                     unsigned char* out, unsigned char key)
+      {
+         const std::size_t decoded = tb64dec(in, length, out);
+
+         for (std::size_t i = 0; i < decoded; ++i)
+         {
+            out[i] ^= key;
+         }
+
+         return decoded;
+      }
+
+      // Combines the output of the vector loop, which consumed the first
+      // consumed characters, with that of the tail, which is 0 on a decode
+      // error.
+      inline std::size_t decode_result(std::size_t consumed, std::size_t length,
+                                       std::size_t head, std::size_t tail)
+      {
+         if (consumed == length)
+         {
+            return head;
+         }
+
+         return (tail == 0) ? 0 : head + tail;
+      }
+
+   #ifdef XORB64_X86
+
+      /*
+         SSSE3: 12 input bytes to 16 characters per step, using the
+         multiply-shift unpacking and pshufb lookups of Mula and Lemire.
+      */
+
+      __attribute__((target("ssse3")))
+      inline __m128i encode_lookup_ssse3(const __m128i indices)
+      {
+         const __m128i shift_lut = _mm_setr_epi8(
+              'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+              '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+              '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+              '/' - 63, 'A', 0, 0);
+
+         __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+         const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+         result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+         result = _mm_shuffle_epi8(shift_lut, result);
+
+         return _mm_add_epi8(result, indices);
+      }
+
+      __attribute__((target("ssse3")))
+      inline std::size_t encode_ssse3(unsigned char* in, std::size_t length,
+                                      unsigned char* out, unsigned char key)
+      {
+         const __m128i key_vector = _mm_set1_epi8(static_cast<char>(key));
+         const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                               4,  5, 3,  4, 1, 2, 0, 1);
+         std::size_t i = 0;
+         std::size_t o = 0;
+
+         // Each step loads 16 bytes but consumes only 12.
+         for (; i + 16 <= length; i += 12, o += 16)
+         {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            v = _mm_xor_si128(v, key_vector);
+            v = _mm_shuffle_epi8(v, shuffle);
+
+            const __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+            const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+            const __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+            const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o),
+                             encode_lookup_ssse3(_mm_or_si128(t1, t3)));
+         }
+
+         return o + encode_tail(in + i, length - i, out + o, key);
+      }
+
+      // Maps 16 characters to their 6-bit values. Returns false if any of
+      // them is not in the Base64 alphabet (this includes '=' padding).
+      __attribute__((target("ssse3")))
+      inline bool decode_lookup_ssse3(__m128i& v)
+      {
+         const __m128i lut_lo = _mm_setr_epi8(
+              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+              0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+         const __m128i lut_hi = _mm_setr_epi8(
+              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+         const __m128i lut_roll = _mm_setr_epi8(
+              0, 16, 19, 4, -65, -65, -71, -71,
+              0,  0,  0, 0,   0,   0,   0,   0);
+         const __m128i mask_2f = _mm_set1_epi8(0x2F);
+
+         const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+         const __m128i lo_nibbles = _mm_and_si128(v, mask_2f);
+         const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+         const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+         const __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+
+         if (_mm_movemask_epi8(invalid) != 0xFFFF)
+         {
+            return false;
+         }
+
+         const __m128i eq_2f = _mm_cmpeq_epi8(v, mask_2f);
+         const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+         v = _mm_add_epi8(v, roll);
+
+         return true;
+      }
+
+      __attribute__((target("ssse3")))
+      inline std::size_t decode_ssse3(const unsigned char* in, std::size_t length,
+                                      unsigned char* out, unsigned char key)
+      {
+         const __m128i key_vector = _mm_set1_epi8(static_cast<char>(key));
+         const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                            -1, -1, -1, -1);
+         std::size_t i = 0;
+         std::size_t o = 0;
+
+         // Each step stores 16 bytes but produces only 12; keeping 24
+         // characters in hand guarantees the extra 4 land inside the output.
+         for (; i + 24 <= length; i += 16, o += 12)
+         {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+
+            if (!decode_lookup_ssse3(v))
+            {
+               break;
+            }
+
+            v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+            v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+            v = _mm_shuffle_epi8(v, pack);
+            v = _mm_xor_si128(v, key_vector);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), v);
+         }
+
+         return decode_result(i, length, o, decode_tail(in + i, length - i, out + o, key));
+      }
+
+      /*
+         AVX2: the SSSE3 steps on two 128-bit lanes at once.
+      */
+
+      __attribute__((target("avx2")))
+      inline std::size_t encode_avx2(unsigned char* in, std::size_t length,
+                                     unsigned char* out, unsigned char key)
+      {
+         const __m256i key_vector = _mm256_set1_epi8(static_cast<char>(key));
+         const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                                  4,  5, 3,  4, 1, 2, 0, 1,
+                                                 10, 11, 9, 10, 7, 8, 6, 7,
+                                                  4,  5, 3,  4, 1, 2, 0, 1);
+         const __m256i shift_lut = _mm256_setr_epi8(
+              'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+              '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+              '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+              '/' - 63, 'A', 0, 0,
+              'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+              '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+              '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+              '/' - 63, 'A', 0, 0);
+         std::size_t i = 0;
+         std::size_t o = 0;
+
+         // Each step loads 12 bytes into each lane from two 16-byte loads.
+         for (; i + 28 <= length; i += 24, o += 32)
+         {
+            const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            v = _mm256_xor_si256(v, key_vector);
+            v = _mm256_shuffle_epi8(v, shuffle);
+
+            const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+            const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+            const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            const __m256i indices = _mm256_or_si256(t1, t3);
+
+            __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+            const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+            result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+            result = _mm256_shuffle_epi8(shift_lut, result);
+            result = _mm256_add_epi8(result, indices);
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), result);
+         }
+
+         return o + encode_ssse3(in + i, length - i, out + o, key);
+      }
+
+      __attribute__((target("avx2")))
+      inline std::size_t decode_avx2(const unsigned char* in, std::size_t length,
+                                     unsigned char* out, unsigned char key)
+      {
+         const __m256i key_vector = _mm256_set1_epi8(static_cast<char>(key));
+         const __m256i lut_lo = _mm256_setr_epi8(
+              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+              0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+              0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+         const __m256i lut_hi = _mm256_setr_epi8(
+              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+         const __m256i lut_roll = _mm256_setr_epi8(
+              0, 16, 19, 4, -65, -65, -71, -71,
+              0,  0,  0, 0,   0,   0,   0,   0,
+              0, 16, 19, 4, -65, -65, -71, -71,
+              0,  0,  0, 0,   0,   0,   0,   0);
+         const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+         const __m256i pack = _mm256_setr_epi8(
+              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+         const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+         std::size_t i = 0;
+         std::size_t o = 0;
+
+         // Each step stores 32 bytes but produces only 24.
+         for (; i + 48 <= length; i += 32, o += 24)
+         {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+
+            const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+            const __m256i lo_nibbles = _mm256_and_si256(v, mask_2f);
+            const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+            const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+            if (!_mm256_testz_si256(lo, hi))
+            {
+               break;
+            }
+
+            const __m256i eq_2f = _mm256_cmpeq_epi8(v, mask_2f);
+            const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+            v = _mm256_add_epi8(v, roll);
+
+            v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+            v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+            v = _mm256_shuffle_epi8(v, pack);
+            v = _mm256_permutevar8x32_epi32(v, pack_lanes);
+            v = _mm256_xor_si256(v, key_vector);
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), v);
+         }
+
+         return decode_result(i, length, o, decode_ssse3(in + i, length - i, out + o, key));
+      }
+
+      /*
+         AVX-512 VBMI: 48 bytes to 64 characters per step with byte
+         permutes doing both the unpacking and the alphabet lookup. The
+         zero-masking forms are used throughout only because the unmasked
+         ones trip GCC's maybe-uninitialized warning.
+      */
+
+      static const char encode_alphabet[64 + 1] =
+         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+      // 6-bit value of every 7-bit character, 0x80 for characters outside
+      // the alphabet.
+      static const unsigned char decode_table[128] =
+         {
+            0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+            0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+            0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,   62, 0x80, 0x80, 0x80,   63,
+              52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+            0x80,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+              15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25, 0x80, 0x80, 0x80, 0x80, 0x80,
+            0x80,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+              41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51, 0x80, 0x80, 0x80, 0x80, 0x80
+         };
+
+      __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+      inline std::size_t encode_avx512vbmi(unsigned char* in, std::size_t length,
+                                           unsigned char* out, unsigned char key)
+      {
+         const __m512i key_vector = _mm512_set1_epi8(static_cast<char>(key));
+         const __m512i shuffle = _mm512_setr_epi32(
+              0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+              0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+              0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+              0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+         const __m512i shifts = _mm512_set_epi32(
+              0x3036242a, 0x1016040a, 0x3036242a, 0x1016040a,
+              0x3036242a, 0x1016040a, 0x3036242a, 0x1016040a,
+              0x3036242a, 0x1016040a, 0x3036242a, 0x1016040a,
+              0x3036242a, 0x1016040a, 0x3036242a, 0x1016040a);
+         const __m512i alphabet = _mm512_loadu_si512(encode_alphabet);
+         const __mmask64 input_mask = (static_cast<__mmask64>(1) << 48) - 1;
+         const __mmask64 all_lanes = ~static_cast<__mmask64>(0);
+         std::size_t i = 0;
+         std::size_t o = 0;
+
+         for (; i + 48 <= length; i += 48, o += 64)
+         {
+            __m512i v = _mm512_maskz_loadu_epi8(input_mask, in + i);
+            v = _mm512_xor_si512(v, key_vector);
+            v = _mm512_maskz_permutexvar_epi8(all_lanes, shuffle, v);
+            v = _mm512_maskz_multishift_epi64_epi8(all_lanes, shifts, v);
+            v = _mm512_maskz_permutexvar_epi8(all_lanes, v, alphabet);
+
+            _mm512_storeu_si512(out + o, v);
+         }
+
+         return o + encode_avx2(in + i, length - i, out + o, key);
+      }
+
+      __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+      inline std::size_t decode_avx512vbmi(const unsigned char* in, std::size_t length,
+                                           unsigned char* out, unsigned char key)
+      {
+         static const unsigned char pack_indices[64] =
+            {
+                2,  1,  0,  6,  5,  4, 10,  9,  8, 14, 13, 12,
+               18, 17, 16, 22, 21, 20, 26, 25, 24, 30, 29, 28,
+               34, 33, 32, 38, 37, 36, 42, 41, 40, 46, 45, 44,
+               50, 49, 48, 54, 53, 52, 58, 57, 56, 62, 61, 60,
+                0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+            };
+
+         const __m512i key_vector = _mm512_set1_epi8(static_cast<char>(key));
+         const __m512i lookup_lo = _mm512_loadu_si512(decode_table);
+         const __m512i lookup_hi = _mm512_loadu_si512(decode_table + 64);
+         const __m512i pack = _mm512_loadu_si512(pack_indices);
+         const __mmask64 output_mask = (static_cast<__mmask64>(1) << 48) - 1;
+         const __mmask64 all_lanes = ~static_cast<__mmask64>(0);
+         std::size_t i = 0;
+         std::size_t o = 0;
+
+         for (; i + 64 <= length; i += 64, o += 48)
+         {
+            const __m512i v = _mm512_loadu_si512(in + i);
+            __m512i values = _mm512_permutex2var_epi8(lookup_lo, v, lookup_hi);
+
+            // Characters with the high bit set, or mapped to 0x80, are invalid.
+            if (_mm512_movepi8_mask(_mm512_or_si512(values, v)) != 0)
+            {
+               break;
+            }
+
+            values = _mm512_maddubs_epi16(values, _mm512_set1_epi32(0x01400140));
+            values = _mm512_madd_epi16(values, _mm512_set1_epi32(0x00011000));
+            values = _mm512_maskz_permutexvar_epi8(all_lanes, pack, values);
+            values = _mm512_xor_si512(values, key_vector);
+
+            _mm512_mask_storeu_epi8(out + o, output_mask, values);
+         }
+
+         return decode_result(i, length, o, decode_avx2(in + i, length - i, out + o, key));
+      }
+
+   #endif
+
+      struct kernel
+      {
+         kernel()
+         : encode(&encode_tail),
+           decode(&decode_tail),
+           name("scalar")
+         {
+         #ifdef XORB64_X86
+            __builtin_cpu_init();
+
+            if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw"))
+            {
+               encode = &encode_avx512vbmi;
+               decode = &decode_avx512vbmi;
+               name   = "avx512vbmi";
+            }
+            else if (__builtin_cpu_supports("avx2"))
+            {
+               encode = &encode_avx2;
+               decode = &decode_avx2;
+               name   = "avx2";
+            }
+            else if (__builtin_cpu_supports("ssse3"))
+            {
+               encode = &encode_ssse3;
+               decode = &decode_ssse3;
+               name   = "ssse3";
+            }
+         #endif
+         }
+
+         encode_function encode;
+         decode_function decode;
+         const char* name;
+      };
+
+      inline const kernel& selected_kernel()
+      {
+         static const kernel k;
+         return k;
+      }
+   }
+
+   inline std::size_t xorb64enc(unsigned char* in, std::size_t length,
+                                unsigned char* out, unsigned char key)
+   {
+      return details::selected_kernel().encode(in, length, out, key);
+   }
+
+   inline std::size_t xorb64dec(const unsigned char* in, std::size_t length,
+                                unsigned char* out, unsigned char key)
+   {
+      return details::selected_kernel().decode(in, length, out, key);
+   }
+
+   // Copies length bytes of in to out, XORing every byte with key, for the
+   // binary framing, which skips Base64. A plain loop, which the compiler
+   // vectorises.
+   inline void xorcopy(const unsigned char* in, std::size_t length,
+                       unsigned char* out, unsigned char key)
+   {
+      for (std::size_t i = 0; i < length; ++i)
+      {
+         out[i] = in[i] ^ key;
+      }
+   }
+
+   // Name of the kernel picked for this CPU.
+   inline const char* xorb64_kernel_name()
+   {
+      return details::selected_kernel().name;
+   }
+}
+
+#endif